@@ -0,0 +1,131 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright (c) 2023 Amol Surati
+// vim: set noet ts=4 sts=4 sw=4:
+
+// cc -std=c11 -O3 -Wall -Wextra -I.
+//	bench.bindings.c src/stats.c src/types.c
+// ./a.out [num-file-scope-names [num-lookups]]
+//
+// Times the lookups of typedef names through the table of bindings, against
+// a scan of the scopes, innermost first, as the parser did before the table.
+// The file-scope holds num-file-scope-names names, and three block-scopes are
+// nested within it, each with 100 names of its own; a tenth of those shadow
+// a file-scope name. The full glibc-header TU cannot be measured yet, since
+// the parser does not build in this tree.
+/* For clock_gettime */
+#define _POSIX_C_SOURCE 199309L
+
+#include "src/cc/bindings.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NUM_SCOPES			4	/* the file-scope and three blocks */
+#define NUM_BLOCK_NAMES		100
+
+struct scope {
+	char	**names;
+	int		num_names;
+	int		num_bindings;	/* when the scope began */
+};
+
+static
+double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static
+char *name_new(const char *prefix,
+			   const int i)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "__%s_name_%d_t", prefix, i);
+	return strdup(buf);
+}
+
+static
+bool scan_find(const struct scope *scopes,
+			   const char *name)
+{
+	int i, j;
+
+	for (i = NUM_SCOPES - 1; i >= 0; --i) {
+		for (j = 0; j < scopes[i].num_names; ++j) {
+			if (!strcmp(scopes[i].names[j], name))
+				return true;
+		}
+	}
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	int i, j, num_names, num_lookups, num_hits[2];
+	double t[3];
+	char **lookups;
+	struct scope scopes[NUM_SCOPES];
+	struct cc_bindings bindings;
+
+	num_names = argc > 1 ? atoi(argv[1]) : 5000;
+	num_lookups = argc > 2 ? atoi(argv[2]) : 200000;
+	if (num_names <= 0 || num_lookups <= 0)
+		return EXIT_FAILURE;
+
+	cc_bindings_init(&bindings);
+	for (i = 0; i < NUM_SCOPES; ++i) {
+		scopes[i].num_names = i ? NUM_BLOCK_NAMES : num_names;
+		scopes[i].names = calloc(scopes[i].num_names, sizeof(char *));
+		scopes[i].num_bindings = bindings.num_entries;
+		for (j = 0; j < scopes[i].num_names; ++j) {
+			if (i && j % 10 == 0)
+				scopes[i].names[j] = name_new("typedef", (i * 7 + j) % num_names);
+			else
+				scopes[i].names[j] = name_new(i ? "block" : "typedef",
+											  i * NUM_BLOCK_NAMES + j);
+			if (cc_bindings_add(&bindings, scopes[i].names[j],
+								CC_NAME_SPACE_ORDINARY, NULL))
+				return EXIT_FAILURE;
+		}
+	}
+
+	/* Mostly hits, spread over the file-scope; an eighth miss */
+	lookups = calloc(num_lookups, sizeof(char *));
+	for (i = 0; i < num_lookups; ++i)
+		lookups[i] = name_new(i % 8 ? "typedef" : "missing",
+							  (int)((i * 7919ull) % num_names));
+
+	num_hits[0] = num_hits[1] = 0;
+	t[0] = now();
+	for (i = 0; i < num_lookups; ++i)
+		num_hits[0] += scan_find(scopes, lookups[i]);
+	t[1] = now();
+	for (i = 0; i < num_lookups; ++i)
+		num_hits[1] += cc_bindings_find(&bindings, lookups[i],
+										CC_NAME_SPACE_ORDINARY) != NULL;
+	t[2] = now();
+	printf("%d names, %d lookups, %d hits\n", bindings.num_entries,
+		   num_lookups, num_hits[0]);
+	printf("scan:  %.3fs\n", t[1] - t[0]);
+	printf("table: %.3fs\n", t[2] - t[1]);
+
+	/* Leaving the scopes undoes their bindings */
+	for (i = NUM_SCOPES - 1; i > 0; --i)
+		cc_bindings_pop(&bindings, scopes[i].num_bindings);
+	for (i = 0; i < NUM_SCOPES; ++i) {
+		for (j = 0; j < scopes[i].num_names; ++j)
+			free(scopes[i].names[j]);
+		free(scopes[i].names);
+	}
+	for (i = 0; i < num_lookups; ++i)
+		free(lookups[i]);
+	free(lookups);
+	cc_bindings_empty(&bindings);
+	return num_hits[0] == num_hits[1] ? EXIT_SUCCESS : EXIT_FAILURE;
+}
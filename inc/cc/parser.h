@@ -7,9 +7,16 @@
 
 #include <inc/errno.h>
 
+#include <stdbool.h>
+
 struct parser;
 err_t	parser_new(const char *path,
 				   struct parser **out);
 err_t	parser_delete(struct parser *this);
 err_t	parser_parse(struct parser *this);
+void	parser_set_skip_function_bodies(struct parser *this,
+										const bool skip);
+err_t	parser_dump_ast(const struct parser *this,
+						const char *path,
+						const bool is_compact);
 #endif
@@ -121,6 +121,8 @@ NODE(DECLARATION_SPECIFIERS)
 NODE(DECLARATOR)
 NODE(ABSTRACT_DECLARATOR)
 NODE(ATTRIBUTE_DECLARATION)
+NODE(FUNCTION_DEFINITION)
+NODE(FUNCTION_BODY)
 #endif
 /* Grammar (CC) terminals and non-terminals end here */
 
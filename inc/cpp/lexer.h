@@ -166,4 +166,16 @@ err_t	lexer_new(const char *path,	/* Either path, or buffer, but not both */
 err_t	lexer_delete(struct lexer *this);
 err_t	lexer_lex_token(struct lexer *this,
 						struct lexer_token **out);
+err_t	lexer_lex_from_buffer(const char *buffer,
+							  const off_t buffer_size,
+							  struct lexer_token **out);
+err_t	lexer_token_paste_punctuators(const struct lexer_token *left,
+									  const struct lexer_token *right,
+									  struct lexer_token **out);
+err_t	lexer_token_new(const enum lexer_token_type type,
+						const char *source,
+						const size_t source_len,
+						const char *resolved,
+						const size_t resolved_len,
+						struct lexer_token **out);
 #endif
@@ -7,10 +7,43 @@
 
 #include <inc/errno.h>
 
+#include <sys/types.h>
+
 struct scanner;
+struct scanner_cache;
 err_t	scanner_new(struct scanner **out);
 err_t	scanner_delete(struct scanner *this);
+err_t	scanner_define(struct scanner *this,
+					   const char *definition);
+err_t	scanner_undefine(struct scanner *this,
+						 const char *name);
+err_t	scanner_set_prefix_header(struct scanner *this,
+								  const char *path);
+err_t	scanner_set_pch_path(struct scanner *this,
+							 const char *path);
+err_t	scanner_set_include_cache(struct scanner *this,
+								  const char *dir_path,
+								  const off_t size);
+err_t	scanner_set_macro_profile(struct scanner *this,
+								  const char *path);
+err_t	scanner_set_include_trace(struct scanner *this,
+								  const char *path);
 err_t	scanner_scan(struct scanner *this,
 					 const char *path);
 const char	*scanner_cpp_tokens_path(const struct scanner *this);
+void	scanner_if_cache_stats(const struct scanner *this,
+							   size_t *out_num_hits,
+							   size_t *out_num_misses);
+void	scanner_set_cache(struct scanner *this,
+						  const struct scanner_cache *cache);
+err_t	scanner_write_lexed_paths(const struct scanner *this,
+								  const int fd);
+/*****************************************************************************/
+/* Kept warm across the requests of the compile server. */
+struct scanner_cache;
+err_t	scanner_cache_new(struct scanner_cache **out);
+void	scanner_cache_delete(struct scanner_cache *this);
+err_t	scanner_cache_add_file(struct scanner_cache *this,
+							   const char *path);
+void	scanner_cache_prune(struct scanner_cache *this);
 #endif
@@ -0,0 +1,94 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2023 Amol Surati */
+/* vim: set noet ts=4 sts=4 sw=4: */
+
+#ifndef INC_CPP_TOKEN_FILE_H
+#define INC_CPP_TOKEN_FILE_H
+
+#include <inc/errno.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The file of cpp-tokens, written by the scanner and mapped by the parser.
+ *	magic (8 bytes, with the nul), u32 version, u32 byte-order
+ *	records, each a u8 type followed by:
+ *		nothing, for lexer-key-words and punctuators
+ *		varint path-len, path, nul, varint size; for LXR_TOKEN_EMBED
+ *		varint ref; for the rest. A ref of 0 is followed by the definition
+ *		of a spelling: varint len, spelling, nul.
+ *	u8 TOKEN_FILE_END
+ *	the index: varint num-entries; for each: varint position, varint ordinal
+ *	u64 the position of the index
+ *
+ * The non-zero ref of a spelling that was defined before is the distance
+ * from the ref back to that definition. Since a record depends only on the
+ * bytes before it, and not on any state of the reader, a reader can begin at
+ * any record. The nul after a spelling allows it to be used in place.
+ *
+ * The index lists the boundaries between the top-level declarations, after
+ * the first one, which begins right after the header. The position of a
+ * boundary is that of the first record of the declaration, and its ordinal is
+ * the number of records before it; an #embed record counts as one. Each is
+ * written as the difference from that of the previous entry.
+ *
+ * A varint is the LEB128 encoding: 7 bits per byte, the least significant
+ * first, with the high bit set on all but the last byte.
+ */
+#define TOKEN_FILE_MAGIC		"x24-tok"	/* 8 bytes, with the nul */
+#define TOKEN_FILE_VERSION		2
+#define TOKEN_FILE_BYTE_ORDER	0x01020304
+#define TOKEN_FILE_HEADER_SIZE	16
+#define TOKEN_FILE_END			0xff
+#define TOKEN_FILE_VARINT_MAX	10	/* bytes, for 64 bits */
+
+struct token_file_boundary {
+	size_t	position;
+	size_t	ordinal;
+};
+
+static inline
+size_t token_file_put_varint(unsigned char *buf,
+							 uint64_t value)
+{
+	size_t size;
+
+	for (size = 0; value >= 0x80; value >>= 7)
+		buf[size++] = (value & 0x7f) | 0x80;
+	buf[size++] = value;
+	return size;
+}
+
+/*
+ * Reads the varint at *buf, and moves *buf past it. The file may be corrupt:
+ * a varint that runs into end, or that is longer than 64 bits, is EINVAL.
+ */
+static inline
+err_t token_file_get_varint(const char **buf,
+							const char *end,
+							uint64_t *out)
+{
+	size_t size;
+	uint64_t value;
+	unsigned char byte;
+	const char *p;
+
+	p = *buf;
+	value = 0;
+	for (size = 0; ; ++size) {
+		if (size == TOKEN_FILE_VARINT_MAX || p + size >= end)
+			return EINVAL;
+		byte = p[size];
+		/* The 10th byte holds only the 64th bit */
+		if (size == TOKEN_FILE_VARINT_MAX - 1 && byte > 1)
+			return EINVAL;
+		value |= (uint64_t)(byte & 0x7f) << (7 * size);
+		if ((byte & 0x80) == 0)
+			break;
+	}
+	*buf = p + size + 1;
+	*out = value;
+	return ESUCCESS;
+}
+#endif
@@ -199,3 +199,6 @@ DEF(PLACE_MARKER)
 DEF(REPL_LIST_END)
 DEF(NON_STRINGIZING_DOUBLE_HASH)
 DEF(UNARY_MINUS)
+
+/* A #embed resource. Passed to cc as one record; cc expands it */
+DEF(EMBED)
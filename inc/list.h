@@ -142,4 +142,41 @@ void list_move(struct list_entry *from,
 	list_for_each_with_del(from, e)
 		list_add_tail(to, e);
 }
+
+/* O(1) versions of list_move. from is empty on return. */
+static inline
+void list_splice_tail(struct list_entry *from,
+					  struct list_entry *to)
+{
+	struct list_entry *first, *last;
+
+	if (list_is_empty(from))
+		return;
+
+	first = from->next;
+	last = from->prev;
+	first->prev = to->prev;
+	to->prev->next = first;
+	last->next = to;
+	to->prev = last;
+	list_init(from);
+}
+
+static inline
+void list_splice_head(struct list_entry *from,
+					  struct list_entry *to)
+{
+	struct list_entry *first, *last;
+
+	if (list_is_empty(from))
+		return;
+
+	first = from->next;
+	last = from->prev;
+	last->next = to->next;
+	to->next->prev = last;
+	first->prev = to;
+	to->next = first;
+	list_init(from);
+}
 #endif
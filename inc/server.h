@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2023 Amol Surati */
+/* vim: set noet ts=4 sts=4 sw=4: */
+
+#ifndef INC_SERVER_H
+#define INC_SERVER_H
+
+#include <inc/errno.h>
+#include <inc/cpp/scanner.h>
+
+/*
+ * Runs in a child of the server, for each request. The child writes the paths
+ * of the files it lexed to report_fd; the server lexes them into its cache.
+ */
+typedef err_t fn_server_compile(int argc,
+								char **argv,
+								const struct scanner_cache *cache,
+								const int report_fd);
+
+err_t	server_run(const char *socket_path,
+				   fn_server_compile *compile);
+err_t	client_run(const char *socket_path,
+				   int argc,
+				   char **argv,
+				   int *out_status);
+#endif
@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2023 Amol Surati */
+/* vim: set noet ts=4 sts=4 sw=4: */
+
+#ifndef INC_STATS_H
+#define INC_STATS_H
+
+#include <inc/errno.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * The time of a phase excludes that of the phases entered from within it;
+ * e.g. the lexing done while expanding a macro is charged to lexing.
+ */
+enum stats_phase {
+	STATS_PHASE_OTHER,
+	STATS_PHASE_PREDEFINED_MACROS,
+	STATS_PHASE_LEX,
+	STATS_PHASE_DIRECTIVE,
+	STATS_PHASE_EXPAND,
+	STATS_PHASE_SERIALIZE,
+	STATS_PHASE_READ_TOKENS,
+	STATS_PHASE_PARSE,
+	STATS_PHASE_DUMP_AST,
+	STATS_PHASE_NUM_PHASES,
+};
+
+/* Reading the file of cpp-tokens counts as the parser's. */
+enum stats_subsystem {
+	STATS_SUBSYSTEM_LEXER,
+	STATS_SUBSYSTEM_SCANNER,
+	STATS_SUBSYSTEM_PARSER,
+	STATS_SUBSYSTEM_NUM_SUBSYSTEMS,
+};
+
+/* The CPU time is sampled only at the boundaries of the two stages. */
+enum stats_stage {
+	STATS_STAGE_SCAN,
+	STATS_STAGE_PARSE,
+	STATS_STAGE_NUM_STAGES,
+};
+
+struct stats {
+	bool	is_enabled;
+	enum stats_phase	phase;
+	uint64_t	stamp;	/* ns, when the current phase was entered */
+	uint64_t	wall_ns[STATS_PHASE_NUM_PHASES];
+	clock_t	cpu_start;
+	clock_t	cpu[STATS_STAGE_NUM_STAGES];
+
+	size_t	num_allocs[STATS_SUBSYSTEM_NUM_SUBSYSTEMS];
+	size_t	num_alloc_bytes[STATS_SUBSYSTEM_NUM_SUBSYSTEMS];
+
+	size_t	num_bytes_lexed;
+	size_t	num_tokens_lexed;
+	size_t	num_tokens_emitted;
+	size_t	num_bytes_emitted;
+	size_t	num_tokens_read;
+};
+
+extern struct stats g_stats;
+
+/* A monotonic clock; the durations of the phases must not go backwards. */
+uint64_t	stats_ns();
+
+/* Returns the phase to pass to stats_leave. */
+static inline
+enum stats_phase stats_enter(const enum stats_phase phase)
+{
+	uint64_t now;
+	enum stats_phase prev;
+
+	prev = g_stats.phase;
+	if (!g_stats.is_enabled || prev == phase)
+		return prev;
+	now = stats_ns();
+	g_stats.wall_ns[prev] += now - g_stats.stamp;
+	g_stats.stamp = now;
+	g_stats.phase = phase;
+	return prev;
+}
+
+static inline
+void stats_leave(const enum stats_phase prev)
+{
+	stats_enter(prev);
+}
+
+static inline
+void stats_note_alloc(const enum stats_subsystem subsystem,
+					  const size_t size)
+{
+	++g_stats.num_allocs[subsystem];
+	g_stats.num_alloc_bytes[subsystem] += size;
+}
+
+void	stats_enable();
+void	stats_begin_stage(const enum stats_stage stage);
+void	stats_end_stage(const enum stats_stage stage);
+err_t	stats_write(const char *path);
+#endif
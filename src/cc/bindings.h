@@ -0,0 +1,168 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2023 Amol Surati */
+/* vim: set noet ts=4 sts=4 sw=4: */
+
+#ifndef SRC_CC_BINDINGS_H
+#define SRC_CC_BINDINGS_H
+
+#include "parser.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The table of struct cc_bindings; see the notes on struct cc_binding. */
+static inline
+uint64_t cc_bindings_hash(const char *name,
+						  const enum cc_name_space_type name_space)
+{
+	uint64_t hash;
+
+	hash = 0xcbf29ce484222325ull ^ name_space;	/* FNV-1a */
+	for (; *name; ++name) {
+		hash ^= (uint8_t)*name;
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+static inline
+void cc_bindings_init(struct cc_bindings *this)
+{
+	this->entries = NULL;
+	this->num_entries = this->num_entries_allocated = 0;
+	this->buckets = NULL;
+	this->num_buckets = 0;
+}
+
+static inline
+void cc_bindings_empty(struct cc_bindings *this)
+{
+	free(this->entries);
+	free(this->buckets);
+	cc_bindings_init(this);
+}
+
+/* The bindings are rehashed in order, to keep the buckets newest first. */
+static inline
+err_t cc_bindings_grow(struct cc_bindings *this)
+{
+	int i, num_entries, mask;
+	int *buckets;
+	struct cc_binding *entries;
+
+	num_entries = this->num_entries_allocated ?
+		2 * this->num_entries_allocated : 256;
+	entries = realloc(this->entries, num_entries * sizeof(*entries));
+	if (entries == NULL)
+		return ENOMEM;
+	stats_note_alloc(STATS_SUBSYSTEM_PARSER, num_entries * sizeof(*entries));
+	this->entries = entries;
+	this->num_entries_allocated = num_entries;
+
+	buckets = malloc(num_entries * sizeof(*buckets));
+	if (buckets == NULL)
+		return ENOMEM;
+	stats_note_alloc(STATS_SUBSYSTEM_PARSER, num_entries * sizeof(*buckets));
+	free(this->buckets);
+	this->buckets = buckets;
+	this->num_buckets = num_entries;
+	mask = num_entries - 1;
+	for (i = 0; i < num_entries; ++i)
+		buckets[i] = -1;
+	for (i = 0; i < this->num_entries; ++i) {
+		entries[i].next = buckets[entries[i].hash & mask];
+		buckets[entries[i].hash & mask] = i;
+	}
+	return ESUCCESS;
+}
+
+static inline
+struct cc_binding *cc_bindings_find(const struct cc_bindings *this,
+									const char *name,
+									const enum cc_name_space_type name_space)
+{
+	int i;
+	uint64_t hash;
+	struct cc_binding *binding;
+
+	if (this->num_entries == 0)
+		return NULL;
+	hash = cc_bindings_hash(name, name_space);
+	for (i = this->buckets[hash & (this->num_buckets - 1)]; i >= 0;
+		 i = binding->next) {
+		binding = &this->entries[i];
+		if (binding->hash == hash && binding->name_space == name_space &&
+			!strcmp(binding->name, name))
+			return binding;
+	}
+	return NULL;
+}
+
+static inline
+err_t cc_bindings_add(struct cc_bindings *this,
+					  const char *name,
+					  const enum cc_name_space_type name_space,
+					  struct cc_node *symbol)
+{
+	err_t err;
+	int *bucket;
+	struct cc_binding *binding;
+
+	if (this->num_entries == this->num_entries_allocated) {
+		err = cc_bindings_grow(this);
+		if (err)
+			return err;
+	}
+	binding = &this->entries[this->num_entries];
+	binding->name = name;
+	binding->hash = cc_bindings_hash(name, name_space);
+	binding->symbol = symbol;
+	binding->name_space = name_space;
+	bucket = &this->buckets[binding->hash & (this->num_buckets - 1)];
+	binding->next = *bucket;
+	*bucket = this->num_entries++;
+	return ESUCCESS;
+}
+
+/* Undoes the bindings made since there were num_entries of them. */
+static inline
+void cc_bindings_pop(struct cc_bindings *this,
+					 const int num_entries)
+{
+	struct cc_binding *binding;
+
+	assert(num_entries <= this->num_entries);
+	while (this->num_entries > num_entries) {
+		binding = &this->entries[--this->num_entries];
+		assert(this->buckets[binding->hash & (this->num_buckets - 1)] ==
+			   this->num_entries);
+		this->buckets[binding->hash & (this->num_buckets - 1)] =
+			binding->next;
+	}
+}
+
+/*
+ * The bindings are the first ones of from, in order. They are popped, or
+ * extended from from, to be its first num_entries.
+ */
+static inline
+err_t cc_bindings_sync(struct cc_bindings *this,
+					   const struct cc_bindings *from,
+					   const int num_entries)
+{
+	err_t err;
+	const struct cc_binding *binding;
+
+	assert(num_entries <= from->num_entries);
+	if (this->num_entries > num_entries)
+		cc_bindings_pop(this, num_entries);
+	err = ESUCCESS;
+	while (!err && this->num_entries < num_entries) {
+		binding = &from->entries[this->num_entries];
+		err = cc_bindings_add(this, binding->name, binding->name_space,
+							  binding->symbol);
+	}
+	return err;
+}
+#endif
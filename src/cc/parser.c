@@ -3,6 +3,7 @@
 /* vim: set noet ts=4 sts=4 sw=4: */
 
 #include "parser.h"
+#include "bindings.h"
 
 #include <inc/unicode.h>
 
@@ -41,18 +42,6 @@ static const char *g_cc_node_type_str[] = {
 #undef NODE
 };
 /*****************************************************************************/
-void cc_token_delete(void *p)
-{
-	struct cc_token *this = p;
-	/*
-	 * Do not free the string for punctuator & key-words. They are
-	 * allocated in .rodata.
-	 */
-	if (!cc_token_is_key_word(this) && !cc_token_is_punctuator(this))
-		free((void *)this->string);
-	free(this);
-}
-
 //static
 void cc_token_print(const struct cc_token *this)
 {
@@ -78,11 +67,87 @@ bool cc_token_is_standard_attribute(const struct cc_token *this,
 }
 /*****************************************************************************/
 static
+void cc_arena_init(struct cc_arena *this)
+{
+	ptrq_init(&this->chunks, free);
+	this->next = NULL;
+	this->num_left = 0;
+}
+
+static
+void cc_arena_empty(struct cc_arena *this)
+{
+	ptrq_empty(&this->chunks);
+	cc_arena_init(this);
+}
+
+/* The memory is zeroed, as calloc would. */
+static
+void *cc_arena_alloc(struct cc_arena *this,
+					 size_t size)
+{
+	err_t err;
+	char *chunk;
+	void *p;
+	size_t chunk_size;
+	const size_t align = _Alignof(max_align_t);
+
+	size = (size + align - 1) & ~(align - 1);
+	if (size > this->num_left) {
+		chunk_size = size > CC_ARENA_CHUNK_SIZE ? size : CC_ARENA_CHUNK_SIZE;
+		chunk = malloc(chunk_size);
+		if (chunk == NULL)
+			return NULL;
+		err = ptrq_add_tail(&this->chunks, chunk);
+		if (err) {
+			free(chunk);
+			return NULL;
+		}
+		stats_note_alloc(STATS_SUBSYSTEM_PARSER, chunk_size);
+		this->next = chunk;
+		this->num_left = chunk_size;
+	}
+	p = memset(this->next, 0, size);
+	this->next += size;
+	this->num_left -= size;
+	return p;
+}
+
+/*
+ * The queue only grows at its tail, and never gives up an entry. On growth,
+ * the old array is left behind in the arena.
+ */
+static
+err_t cc_arena_ptrq_add_tail(struct cc_arena *this,
+							 struct ptr_queue *q,
+							 void *entry)
+{
+	int num_entries;
+	void **entries;
+
+	assert(q->read == 0);
+	if (ptrq_is_full(q)) {
+		num_entries = q->num_entries_allocated ?
+			2 * q->num_entries_allocated : 4;
+		entries = cc_arena_alloc(this, num_entries * sizeof(*entries));
+		if (entries == NULL)
+			return ENOMEM;
+		if (q->num_entries)
+			memcpy(entries, q->entries, q->num_entries * sizeof(*entries));
+		q->entries = entries;
+		q->num_entries_allocated = num_entries;
+	}
+	q->entries[q->num_entries++] = entry;
+	return ESUCCESS;
+}
+/*****************************************************************************/
+static
 void *cc_type_assert(struct cc_type *this,
 					 const enum cc_type_type type)
 {
 	assert(this);
 	assert(cc_type_type(this) == type);
+	this = cc_type_unqualified(this);	/* The payload is with it */
 	switch (type) {
 	default:
 		assert(0);
@@ -92,34 +157,27 @@ void *cc_type_assert(struct cc_type *this,
 }
 
 static
-void cc_type_delete(void *p)
-{
-	/* TODO free based on type */
-	struct cc_type *this = p;
-	ptrt_empty(&this->tree);
-	free(this);
-}
-
-static
-struct cc_type *cc_type_new(const enum cc_type_type type)
+struct cc_type *cc_type_new(struct cc_arena *arena,
+							const enum cc_type_type type)
 {
-	struct cc_type *this = calloc(1, sizeof(*this));
+	struct cc_type *this = cc_arena_alloc(arena, sizeof(*this));
 	if (this == NULL)
 		return NULL;
 	this->type = type;
-	ptrt_init(&this->tree, cc_type_delete);
+	ptrt_init(&this->tree, NULL);
 	return this;
 }
 
 static
-struct cc_type *cc_type_new_integer(const enum cc_type_type type)
+struct cc_type *cc_type_new_integer(struct cc_arena *arena,
+									const enum cc_type_type type)
 {
 	struct cc_type *this;
 	struct cc_type_integer *ti;
 
 	assert(type >= CC_TYPE_CHAR && type <= CC_TYPE_LONG_LONG);
-	this = cc_type_new(type);
-	ti = calloc(1, sizeof(*ti));
+	this = cc_type_new(arena, type);
+	ti = cc_arena_alloc(arena, sizeof(*ti));
 	if (this == NULL || ti == NULL)
 		return NULL;
 	this->u.integer = ti;
@@ -127,53 +185,47 @@ struct cc_type *cc_type_new_integer(const enum cc_type_type type)
 }
 /*****************************************************************************/
 static
-void cc_node_delete(void *p)
+struct cc_node *cc_node_new(struct cc_arena *arena,
+							const enum cc_node_type type)
 {
-	/* TODO free based on type */
-	struct cc_node *this = p;
-	ptrt_empty(&this->tree);
-	free(this);
-}
-
-static
-struct cc_node *cc_node_new(const enum cc_node_type type)
-{
-	struct cc_node *this = calloc(1, sizeof(*this));
+	struct cc_node *this = cc_arena_alloc(arena, sizeof(*this));
 	if (this == NULL)
 		return NULL;
 	this->type = type;
-	ptrt_init(&this->tree, cc_node_delete);
+	ptrt_init(&this->tree, NULL);
 	return this;
 }
 
 static
-struct cc_node *cc_node_new_symbols(const enum cc_scope scope)
+struct cc_node *cc_node_new_symbols(struct cc_arena *arena,
+									const enum cc_scope scope)
 {
 	int i;
 	struct cc_node *this;
 	struct cc_node_symbols *ss;
 
-	this = cc_node_new(CC_NODE_SYMBOLS);
-	ss = calloc(1, sizeof(*ss));
+	this = cc_node_new(arena, CC_NODE_SYMBOLS);
+	ss = cc_arena_alloc(arena, sizeof(*ss));
 	if (this == NULL || ss == NULL)
 		return NULL;
 	this->u.symbols = ss;
 	ss->scope = scope;
 	for (i = 0; i < CC_NAME_SPACE_MAX; ++i)
-		ptrq_init(&ss->entries[i], cc_node_delete);
+		ptrq_init(&ss->entries[i], NULL);
 	return this;
 }
 
 static
-struct cc_node *cc_node_new_symbol(struct cc_node *symbols,
+struct cc_node *cc_node_new_symbol(struct cc_arena *arena,
+								   struct cc_node *symbols,
 								   const enum cc_node_type type)
 {
 	struct cc_node *this;
 	struct cc_node_symbol *s;
 
 	assert(cc_node_type_is_symbol(type));
-	this = cc_node_new(type);
-	s = calloc(1, sizeof(*s));
+	this = cc_node_new(arena, type);
+	s = cc_arena_alloc(arena, sizeof(*s));
 	if (this == NULL || s == NULL)
 		return NULL;
 	this->u.symbol = s;
@@ -182,13 +234,13 @@ struct cc_node *cc_node_new_symbol(struct cc_node *symbols,
 }
 
 static
-struct cc_node *cc_node_new_type_specifiers(void)
+struct cc_node *cc_node_new_type_specifiers(struct cc_arena *arena)
 {
 	struct cc_node *this;
 	struct cc_node_type_specifiers *ts;
 
-	this = cc_node_new(CC_NODE_TYPE_SPECIFIERS);
-	ts = calloc(1, sizeof(*ts));
+	this = cc_node_new(arena, CC_NODE_TYPE_SPECIFIERS);
+	ts = cc_arena_alloc(arena, sizeof(*ts));
 	if (this == NULL || ts == NULL)
 		return NULL;
 	this->u.type_specifiers = ts;
@@ -196,13 +248,13 @@ struct cc_node *cc_node_new_type_specifiers(void)
 }
 
 static
-struct cc_node *cc_node_new_type_qualifiers(void)
+struct cc_node *cc_node_new_type_qualifiers(struct cc_arena *arena)
 {
 	struct cc_node *this;
 	struct cc_node_type_qualifiers *tq;
 
-	this = cc_node_new(CC_NODE_TYPE_QUALIFIERS);
-	tq = calloc(1, sizeof(*tq));
+	this = cc_node_new(arena, CC_NODE_TYPE_QUALIFIERS);
+	tq = cc_arena_alloc(arena, sizeof(*tq));
 	if (this == NULL || tq == NULL)
 		return NULL;
 	this->u.type_qualifiers = tq;
@@ -210,13 +262,13 @@ struct cc_node *cc_node_new_type_qualifiers(void)
 }
 
 //static
-struct cc_node *cc_node_new_function_specifiers(void)
+struct cc_node *cc_node_new_function_specifiers(struct cc_arena *arena)
 {
 	struct cc_node *this;
 	struct cc_node_function_specifiers *fs;
 
-	this = cc_node_new(CC_NODE_FUNCTION_SPECIFIERS);
-	fs = calloc(1, sizeof(*fs));
+	this = cc_node_new(arena, CC_NODE_FUNCTION_SPECIFIERS);
+	fs = cc_arena_alloc(arena, sizeof(*fs));
 	if (this == NULL || fs == NULL)
 		return NULL;
 	this->u.function_specifiers = fs;
@@ -224,13 +276,13 @@ struct cc_node *cc_node_new_function_specifiers(void)
 }
 
 static
-struct cc_node *cc_node_new_storage_specifiers(void)
+struct cc_node *cc_node_new_storage_specifiers(struct cc_arena *arena)
 {
 	struct cc_node *this;
 	struct cc_node_storage_specifiers *ss;
 
-	this = cc_node_new(CC_NODE_STORAGE_SPECIFIERS);
-	ss = calloc(1, sizeof(*ss));
+	this = cc_node_new(arena, CC_NODE_STORAGE_SPECIFIERS);
+	ss = cc_arena_alloc(arena, sizeof(*ss));
 	if (this == NULL || ss == NULL)
 		return NULL;
 	this->u.storage_specifiers = ss;
@@ -238,13 +290,13 @@ struct cc_node *cc_node_new_storage_specifiers(void)
 }
 
 //static
-struct cc_node *cc_node_new_attribute_specifiers(void)
+struct cc_node *cc_node_new_attribute_specifiers(struct cc_arena *arena)
 {
 	struct cc_node *this;
 	struct cc_node_attribute_specifiers *as;
 
-	this = cc_node_new(CC_NODE_ATTRIBUTE_SPECIFIERS);
-	as = calloc(1, sizeof(*as));
+	this = cc_node_new(arena, CC_NODE_ATTRIBUTE_SPECIFIERS);
+	as = cc_arena_alloc(arena, sizeof(*as));
 	if (this == NULL || as == NULL)
 		return NULL;
 	this->u.attribute_specifiers = as;
@@ -253,14 +305,15 @@ struct cc_node *cc_node_new_attribute_specifiers(void)
 
 /* Scope is block or prototype */
 static
-struct cc_node *cc_node_new_block(const enum cc_scope scope)
+struct cc_node *cc_node_new_block(struct cc_arena *arena,
+								  const enum cc_scope scope)
 {
 	struct cc_node *this, *symbols;
 	struct cc_node_block *b;
 
-	this = cc_node_new(CC_NODE_BLOCK);
-	symbols = cc_node_new_symbols(scope);
-	b = calloc(1, sizeof(*b));
+	this = cc_node_new(arena, CC_NODE_BLOCK);
+	symbols = cc_node_new_symbols(arena, scope);
+	b = cc_arena_alloc(arena, sizeof(*b));
 	if (this == NULL || b == NULL || symbols == NULL)
 		return NULL;
 	b->symbols = symbols;
@@ -269,13 +322,13 @@ struct cc_node *cc_node_new_block(const enum cc_scope scope)
 }
 #if 0
 static
-struct cc_node *cc_node_new_type_array(void)
+struct cc_node *cc_node_new_type_array(struct cc_arena *arena)
 {
 	struct cc_node *this;
 	struct cc_node_type_array *ta;
 
-	this = cc_node_new(CC_NODE_TYPE_ARRAY);
-	ta = calloc(1, sizeof(*ta));
+	this = cc_node_new(arena, CC_NODE_TYPE_ARRAY);
+	ta = cc_arena_alloc(arena, sizeof(*ta));
 	if (this == NULL || ta == NULL)
 		return NULL;
 	this->u.type_array = ta;
@@ -283,7 +336,7 @@ struct cc_node *cc_node_new_type_array(void)
 }
 
 static
-struct cc_node *cc_node_new_type_function(void)
+struct cc_node *cc_node_new_type_function(struct cc_arena *arena)
 {
 	struct cc_node *this, *block;
 	struct cc_node_type_function *tf;
@@ -292,9 +345,9 @@ struct cc_node *cc_node_new_type_function(void)
 	 * scope is set to prototype initially. Once parser knows that it is
 	 * parsing a func-defn, it changes the scope to block.
 	 */
-	block = cc_node_new_block(CC_SCOPE_PROTOTYPE);
-	this = cc_node_new(CC_NODE_TYPE_FUNCTION);
-	tf = calloc(1, sizeof(*tf));
+	block = cc_node_new_block(arena, CC_SCOPE_PROTOTYPE);
+	this = cc_node_new(arena, CC_NODE_TYPE_FUNCTION);
+	tf = cc_arena_alloc(arena, sizeof(*tf));
 	if (this == NULL || tf == NULL || block == NULL)
 		return NULL;
 	tf->block = block;
@@ -303,52 +356,53 @@ struct cc_node *cc_node_new_type_function(void)
 }
 
 static
-struct cc_node *cc_node_new_type_pointer(void)
+struct cc_node *cc_node_new_type_pointer(struct cc_arena *arena)
 {
-	return cc_node_new(CC_NODE_TYPE_POINTER);
+	return cc_node_new(arena, CC_NODE_TYPE_POINTER);
 }
 #endif
 
 static
-struct cc_node *cc_node_new_declarator(void)
+struct cc_node *cc_node_new_declarator(struct cc_arena *arena)
 {
 	struct cc_node *this;
 	struct cc_node_declarator *d;
 
-	this = cc_node_new(CC_NODE_DECLARATOR);
-	d = calloc(1, sizeof(*d));
+	this = cc_node_new(arena, CC_NODE_DECLARATOR);
+	d = cc_arena_alloc(arena, sizeof(*d));
 	if (this == NULL || d == NULL)
 		return NULL;
-	ptrq_init(&d->list, cc_node_delete);
+	ptrq_init(&d->list, NULL);
 	this->u.declarator = d;
 	return this;
 }
 
 static
-struct cc_node *cc_node_new_declaration_specifiers(void)
+struct cc_node *cc_node_new_declaration_specifiers(struct cc_arena *arena)
 {
 	struct cc_node_declaration_specifiers *ds;
 	struct cc_node *this;
 
-	this = cc_node_new(CC_NODE_DECLARATION_SPECIFIERS);
-	ds = calloc(1, sizeof(*ds));
+	this = cc_node_new(arena, CC_NODE_DECLARATION_SPECIFIERS);
+	ds = cc_arena_alloc(arena, sizeof(*ds));
 	if (this == NULL || ds == NULL)
 		return NULL;
 	this->u.declaration_specifiers = ds;
 	return this;
 }
 
-/* Claims ownership of string */
+/* The string is borrowed from the token; see struct cc_token. */
 static
-struct cc_node *cc_node_new_identifier(const char *string,
+struct cc_node *cc_node_new_identifier(struct cc_arena *arena,
+									   const char *string,
 									   const size_t string_len)
 {
 	struct cc_node *this;
 	struct cc_node_identifier *ident;
 
 	assert(string);
-	this = cc_node_new(CC_NODE_IDENTIFIER);
-	ident = calloc(1, sizeof(*ident));
+	this = cc_node_new(arena, CC_NODE_IDENTIFIER);
+	ident = cc_arena_alloc(arena, sizeof(*ident));
 	if (this == NULL || ident == NULL)
 		return NULL;
 	ident->string = string;
@@ -356,6 +410,313 @@ struct cc_node *cc_node_new_identifier(const char *string,
 	this->u.identifier = ident;
 	return this;
 }
+
+static
+struct cc_node *cc_node_new_function_body(struct cc_arena *arena)
+{
+	struct cc_node *this;
+	struct cc_node_function_body *fb;
+
+	this = cc_node_new(arena, CC_NODE_FUNCTION_BODY);
+	fb = cc_arena_alloc(arena, sizeof(*fb));
+	if (this == NULL || fb == NULL)
+		return NULL;
+	this->u.function_body = fb;
+	return this;
+}
+
+static
+err_t cc_node_add_tail_child(struct cc_arena *arena,
+							 struct cc_node *this,
+							 struct cc_node *child)
+{
+	return cc_arena_ptrq_add_tail(arena, &this->tree.q, child);
+}
+/*****************************************************************************/
+static
+void cc_ast_init(struct cc_ast *this)
+{
+	this->types = NULL;
+	this->first_child = this->next_sibling = this->payloads = NULL;
+	this->num_nodes = this->num_nodes_allocated = 0;
+	this->chars = NULL;
+	this->num_chars = this->num_chars_allocated = 0;
+}
+
+static
+void cc_ast_empty(struct cc_ast *this)
+{
+	free(this->types);
+	free(this->first_child);
+	free(this->next_sibling);
+	free(this->payloads);
+	free(this->chars);
+	cc_ast_init(this);
+}
+
+static
+err_t cc_ast_grow_nodes(struct cc_ast *this)
+{
+	uint32_t num_nodes;
+	void *p;
+
+	num_nodes = this->num_nodes_allocated ?
+		2 * this->num_nodes_allocated : 1024;
+	if (num_nodes <= this->num_nodes_allocated)
+		return ENOMEM;
+	p = realloc(this->types, num_nodes * sizeof(*this->types));
+	if (p == NULL)
+		return ENOMEM;
+	this->types = p;
+	p = realloc(this->first_child, num_nodes * sizeof(*this->first_child));
+	if (p == NULL)
+		return ENOMEM;
+	this->first_child = p;
+	p = realloc(this->next_sibling, num_nodes * sizeof(*this->next_sibling));
+	if (p == NULL)
+		return ENOMEM;
+	this->next_sibling = p;
+	p = realloc(this->payloads, num_nodes * sizeof(*this->payloads));
+	if (p == NULL)
+		return ENOMEM;
+	this->payloads = p;
+	stats_note_alloc(STATS_SUBSYSTEM_PARSER,
+					 num_nodes * (sizeof(*this->types) +
+								  3 * sizeof(*this->first_child)));
+	this->num_nodes_allocated = num_nodes;
+	return ESUCCESS;
+}
+
+/* The spelling, with a nul appended, is copied into chars. */
+static
+err_t cc_ast_add_string(struct cc_ast *this,
+						const char *string,
+						const size_t string_len,
+						uint32_t *out)
+{
+	uint32_t num_chars;
+	char *chars;
+
+	num_chars = this->num_chars_allocated ? this->num_chars_allocated : 4096;
+	while (num_chars - this->num_chars <= string_len) {
+		if (2 * num_chars <= num_chars)
+			return ENOMEM;
+		num_chars *= 2;
+	}
+	if (num_chars != this->num_chars_allocated) {
+		chars = realloc(this->chars, num_chars);
+		if (chars == NULL)
+			return ENOMEM;
+		stats_note_alloc(STATS_SUBSYSTEM_PARSER, num_chars);
+		this->chars = chars;
+		this->num_chars_allocated = num_chars;
+	}
+	*out = this->num_chars;
+	memcpy(&this->chars[this->num_chars], string, string_len);
+	this->num_chars += string_len;
+	this->chars[this->num_chars++] = 0;
+	return ESUCCESS;
+}
+
+/*
+ * Only identifiers, numbers, char-consts, and string-literals have
+ * a spelling; that of the others is NULL.
+ */
+static
+const char *cc_node_spelling(const struct cc_node *node,
+							 size_t *out_len)
+{
+	*out_len = 0;
+	if (cc_node_is_identifier(node) && !cc_node_is_key_word(node)) {
+		*out_len = node->u.identifier->string_len;
+		return node->u.identifier->string;
+	}
+	if (cc_node_is_number(node)) {
+		*out_len = node->u.number->string_len;
+		return node->u.number->string;
+	}
+	if (cc_node_is_char_const(node)) {
+		*out_len = node->u.char_const->string_len;
+		return node->u.char_const->string;
+	}
+	if (cc_node_is_string_literal(node)) {
+		*out_len = node->u.string_literal->string_len;
+		return node->u.string_literal->string;
+	}
+	return NULL;
+}
+
+static
+err_t cc_ast_add_payload(struct cc_ast *this,
+						 const struct cc_node *node,
+						 uint32_t *out)
+{
+	size_t string_len;
+	const char *string;
+
+	*out = CC_AST_NONE;
+	string = cc_node_spelling(node, &string_len);
+	if (string == NULL)
+		return ESUCCESS;
+	return cc_ast_add_string(this, string, string_len, out);
+}
+
+/* The children are linked in by cc_ast_build. */
+static
+err_t cc_ast_add_node(struct cc_ast *this,
+					  const struct cc_node *node,
+					  uint32_t *out)
+{
+	err_t err;
+	uint32_t index;
+
+	err = ESUCCESS;
+	if (this->num_nodes == this->num_nodes_allocated)
+		err = cc_ast_grow_nodes(this);
+	if (err)
+		return err;
+	index = this->num_nodes++;
+	assert(node->type <= UINT16_MAX);
+	this->types[index] = node->type;
+	this->first_child[index] = this->next_sibling[index] = CC_AST_NONE;
+	*out = index;
+	return cc_ast_add_payload(this, node, &this->payloads[index]);
+}
+
+static
+err_t cc_ast_push_frame(struct val_queue *stack,
+						const struct cc_node *node,
+						const uint32_t index)
+{
+	struct cc_ast_frame frame;
+
+	frame.node = node;
+	frame.index = index;
+	frame.last_child = CC_AST_NONE;
+	frame.next_child = 0;
+	return valq_add_tail(stack, &frame);
+}
+
+/*
+ * The root, if any, is the node 0. A node receives its index before its
+ * children do, i.e. pre-order. The walk keeps its own stack, so that a deep
+ * tree does not exhaust that of the thread.
+ */
+static
+err_t cc_ast_build(struct cc_ast *this,
+				   const struct cc_node *root)
+{
+	err_t err;
+	uint32_t index;
+	struct val_queue stack;
+	struct cc_ast_frame *top;
+	const struct cc_node *child;
+
+	cc_ast_empty(this);
+	if (root == NULL)
+		return ESUCCESS;
+	valq_init(&stack, sizeof(struct cc_ast_frame), NULL);
+	err = cc_ast_add_node(this, root, &index);
+	if (!err)
+		err = cc_ast_push_frame(&stack, root, index);
+	while (!err && !valq_is_empty(&stack)) {
+		top = valq_peek_tail(&stack);
+		if (top->next_child == cc_node_num_children(top->node)) {
+			valq_remove_tail(&stack);
+			continue;
+		}
+		child = cc_node_peek_child(top->node, top->next_child++);
+		err = cc_ast_add_node(this, child, &index);
+		if (err)
+			break;
+		if (top->last_child == CC_AST_NONE)
+			this->first_child[top->index] = index;
+		else
+			this->next_sibling[top->last_child] = index;
+		top->last_child = index;
+		err = cc_ast_push_frame(&stack, child, index);
+	}
+	while (!valq_is_empty(&stack))
+		valq_remove_tail(&stack);
+	return err;
+}
+#ifndef NDEBUG
+static
+bool cc_ast_is_same_node(const struct cc_ast *this,
+						 const uint32_t index,
+						 const struct cc_node *node)
+{
+	size_t string_len;
+	const char *string;
+	const char *ast_string;
+
+	if (cc_ast_type(this, index) != node->type)
+		return false;
+	string = cc_node_spelling(node, &string_len);
+	ast_string = cc_ast_string(this, index);
+	if (string == NULL || ast_string == NULL)
+		return string == ast_string;
+	return strlen(ast_string) == string_len &&
+		!memcmp(ast_string, string, string_len);
+}
+
+/*
+ * Walks the pointer tree and the ast side by side, the way cc_ast_build
+ * does, and returns EINVAL at the first node where they differ in type,
+ * spelling, pre-order index, or children. Here, the last_child of a frame is
+ * the index of the ast child expected next.
+ */
+static
+err_t cc_ast_verify(const struct cc_ast *this,
+					const struct cc_node *root)
+{
+	err_t err;
+	uint32_t index;
+	uint32_t num_nodes;
+	struct val_queue stack;
+	struct cc_ast_frame *top;
+	const struct cc_node *child;
+
+	if (root == NULL)
+		return cc_ast_num_nodes(this) ? EINVAL : ESUCCESS;
+	if (cc_ast_num_nodes(this) == 0 || !cc_ast_is_same_node(this, 0, root))
+		return EINVAL;
+	num_nodes = 1;
+	valq_init(&stack, sizeof(struct cc_ast_frame), NULL);
+	err = cc_ast_push_frame(&stack, root, 0);
+	if (!err) {
+		top = valq_peek_tail(&stack);
+		top->last_child = cc_ast_first_child(this, 0);
+	}
+	while (!err && !valq_is_empty(&stack)) {
+		top = valq_peek_tail(&stack);
+		if (top->next_child == cc_node_num_children(top->node)) {
+			if (top->last_child != CC_AST_NONE)
+				err = EINVAL;
+			valq_remove_tail(&stack);
+			continue;
+		}
+		child = cc_node_peek_child(top->node, top->next_child++);
+		index = top->last_child;
+		if (index != num_nodes++ || index >= cc_ast_num_nodes(this) ||
+			!cc_ast_is_same_node(this, index, child)) {
+			err = EINVAL;
+			break;
+		}
+		top->last_child = cc_ast_next_sibling(this, index);
+		err = cc_ast_push_frame(&stack, child, index);
+		if (err)
+			break;
+		top = valq_peek_tail(&stack);
+		top->last_child = cc_ast_first_child(this, index);
+	}
+	while (!valq_is_empty(&stack))
+		valq_remove_tail(&stack);
+	if (!err && num_nodes != cc_ast_num_nodes(this))
+		err = EINVAL;
+	return err;
+}
+#endif
 /*****************************************************************************/
 static
 void *cc_node_assert_type(struct cc_node *this,
@@ -366,7 +727,10 @@ void *cc_node_assert_type(struct cc_node *this,
 	switch (type) {
 	case CC_NODE_TRANSLATION_UNIT:
 	case CC_NODE_DECLARATION_SPECIFIERS:
+	case CC_NODE_FUNCTION_DEFINITION:
 		return this;
+	case CC_NODE_FUNCTION_BODY:
+		return this->u.function_body;
 	case CC_NODE_BLOCK:
 		return this->u.block;
 	case CC_NODE_DECLARATOR:
@@ -375,6 +739,8 @@ void *cc_node_assert_type(struct cc_node *this,
 		return this->u.type_specifiers;
 	case CC_NODE_STORAGE_SPECIFIERS:
 		return this->u.storage_specifiers;
+	case CC_NODE_IDENTIFIER:
+		return this->u.identifier;
 	case CC_NODE_SYMBOLS:
 		return this->u.symbols;
 	case CC_NODE_SYMBOL:
@@ -730,69 +1096,124 @@ err_t cc_node_apply_attribute_specifiers(struct cc_node *this,
 }
 /*****************************************************************************/
 static
-err_t cc_node_add_symbol(struct cc_node *this,
+err_t cc_node_add_symbol(struct cc_arena *arena,
+						 struct cc_node *this,
 						 struct cc_node *node)
 {
 	const enum cc_node_type type = cc_node_type(node);
 	struct cc_node_symbols *ss = cc_node_assert_type(this, CC_NODE_SYMBOLS);
 	struct cc_node_symbol *s = cc_node_assert_type(node, type);
 	struct ptr_queue *q = &ss->entries[s->name_space];
-	return ptrq_add_tail(q, node);
+	return cc_arena_ptrq_add_tail(arena, q, node);
 }
 /*****************************************************************************/
+/* symbols becomes the current scope; it is nested within the current one. */
 static
-err_t cc_node_symbols_find_type_def(const struct cc_node_symbols *this,
-									const char *name,
-									struct ptr_queue *out)
+err_t parser_enter_scope(struct parser *this,
+						 struct cc_node *symbols)
 {
-	int i;
 	err_t err;
-	const struct ptr_queue *q;
-	struct cc_node *n;
-	struct cc_node_identifier *ident;
+	struct cc_scope_frame frame;
+
+	frame.symbols = this->symbols;
+	frame.num_bindings = this->bindings.num_entries;
+	err = valq_add_tail(&this->scopes, &frame);
+	if (!err)
+		this->symbols = symbols;
+	return err;
+}
+
+static
+void parser_leave_scope(struct parser *this)
+{
+	struct cc_scope_frame *frame;
+
+	frame = valq_peek_tail(&this->scopes);
+	cc_bindings_pop(&this->bindings, frame->num_bindings);
+	this->symbols = frame->symbols;
+	valq_remove_tail(&this->scopes);
+}
+
+/*
+ * Adds the symbol to the current scope, and binds its name. symbol.prev links
+ * it to the earlier declaration of the same name within the same scope.
+ */
+static
+err_t parser_add_symbol(struct parser *this,
+						struct cc_node *node)
+{
+	err_t err;
+	const struct cc_binding *binding;
 	struct cc_node_symbol *s;
-	const enum cc_name_space_type ns = CC_NAME_SPACE_ORDINARY;
-	/* type-def-names are in ordinary name-space */
+	struct cc_node_identifier *ident;
 
-	q = &this->entries[ns];
-	PTRQ_FOR_EACH(q, i, n) {
-		assert(cc_node_is_symbol(n));	/* only symbols in a symtab */
-		if (cc_node_type(n) != CC_NODE_SYMBOL_TYPE_DEF)
-			continue;
-		s = cc_node_assert_type(n, CC_NODE_SYMBOL_TYPE_DEF);
+	err = cc_node_add_symbol(&this->arena, this->symbols, node);
+	s = cc_node_assert_type(node, cc_node_type(node));
+	if (err || s->identifier == NULL ||
+		s->name_space == CC_NAME_SPACE_MEMBER)
+		return err;
 
-		n = s->identifier;
-		assert(n);
-		ident = cc_node_assert_type(n, CC_NODE_IDENTIFIER);
-		assert(ident->string);
-		if (strcmp(ident->string, name))
-			continue;
-		err = ptrq_add_tail(out, s);
-		if (err)
-			return err;
-	}
-	return ESUCCESS;
+	ident = cc_node_assert_type(s->identifier, CC_NODE_IDENTIFIER);
+	binding = cc_bindings_find(&this->bindings, ident->string, s->name_space);
+	if (binding && binding->symbol->u.symbol->symbols == this->symbols)
+		s->prev = binding->symbol;
+	return cc_bindings_add(&this->bindings, ident->string, s->name_space,
+						   node);
 }
 
-/* out initialized by caller */
+/*
+ * Re-enters the prototype-scope of a function-definition, for its body, and
+ * binds the names of the parameters again.
+ */
 static
-err_t cc_node_find_type_def(struct cc_node *this,
-							const char *name,
-							struct ptr_queue *out)
+err_t parser_enter_parameters(struct parser *this,
+							  struct cc_node *symbols)
 {
 	err_t err;
-	const struct cc_node_symbols *ss;
+	int i, j;
+	struct cc_node *node;
+	struct cc_node_symbols *ss;
+	struct cc_node_symbol *s;
+	struct cc_node_identifier *ident;
 
-	assert(this);
-	while (this) {
-		ss = cc_node_assert_type(this, CC_NODE_SYMBOLS);
-		err = cc_node_symbols_find_type_def(ss, name, out);
-		if (err)
-			return err;
-		this = cc_node_parent(this);
+	ss = cc_node_assert_type(symbols, CC_NODE_SYMBOLS);
+	assert(cc_node_symbols_scope(ss) == CC_SCOPE_PROTOTYPE);
+	err = parser_enter_scope(this, symbols);
+	for (i = 0; !err && i < CC_NAME_SPACE_MAX; ++i) {
+		if (i == CC_NAME_SPACE_MEMBER)
+			continue;
+		PTRQ_FOR_EACH(&ss->entries[i], j, node) {
+			s = cc_node_assert_type(node, cc_node_type(node));
+			if (s->identifier == NULL)
+				continue;
+			ident = cc_node_assert_type(s->identifier, CC_NODE_IDENTIFIER);
+			err = cc_bindings_add(&this->bindings, ident->string,
+								  s->name_space, node);
+			if (err) {
+				parser_leave_scope(this);
+				break;
+			}
+		}
 	}
-	if (ptrq_num_entries(out) == 0)
+	return err;
+}
+
+/*
+ * A name is a TypedefName if its innermost binding in the ordinary name-space
+ * is a type-def; an object of the same name in a nested scope hides it.
+ */
+static
+err_t parser_find_type_def(const struct parser *this,
+						   const char *name,
+						   struct cc_node **out)
+{
+	const struct cc_binding *binding;
+
+	binding = cc_bindings_find(&this->bindings, name, CC_NAME_SPACE_ORDINARY);
+	if (binding == NULL ||
+		cc_node_type(binding->symbol) != CC_NODE_SYMBOL_TYPE_DEF)
 		return ENOENT;
+	*out = binding->symbol;
 	return ESUCCESS;
 }
 /*****************************************************************************/
@@ -835,10 +1256,11 @@ err_t parser_build_types(struct parser *this)
 	assert(cc_node_symbols_scope(ss) == CC_SCOPE_FILE);
 	for (i = 0; i < (int)ARRAY_SIZE(types); ++i) {
 		if (i > 0)
-			type = cc_type_new_integer(types[i]);
+			type = cc_type_new_integer(&this->arena, types[i]);
 		else
-			type = cc_type_new(types[i]);	/* CC_NODE_TYPE_VOID */
-		node = cc_node_new_symbol(this->symbols, CC_NODE_SYMBOL_TYPE);
+			type = cc_type_new(&this->arena, types[i]);	/* CC_NODE_TYPE_VOID */
+		node = cc_node_new_symbol(&this->arena, this->symbols,
+								  CC_NODE_SYMBOL_TYPE);
 		if (type == NULL || node == NULL)
 			return ENOMEM;
 		if (i > 0) {
@@ -851,7 +1273,7 @@ err_t parser_build_types(struct parser *this)
 		s->linkage = CC_LINKAGE_NONE;	/* types have no linkages */
 		s->storage = CC_STORAGE_NONE;	/* types have no storage duration */
 		s->name_space = CC_NAME_SPACE_ORDINARY;
-		err = cc_node_add_symbol(this->symbols, node);
+		err = parser_add_symbol(this, node);
 		if (err)
 			return err;
 	}
@@ -896,23 +1318,40 @@ err_t parser_new(const char *path,
 		err = errno;
 		goto err1;
 	}
+	if (!cc_token_stream_is_valid(buffer, size)) {
+		munmap((void *)buffer, size);
+		err = EINVAL;
+		goto err1;
+	}
 	this->cpp_tokens_path = path;
 	this->cpp_tokens_fd = fd;
 	this->root = NULL;
-	this->symbols = cc_node_new_symbols(CC_SCOPE_FILE);
+	this->prototype = NULL;
+	this->skip_function_bodies = false;
+	cc_ast_init(&this->ast);
+	cc_arena_init(&this->arena);
+	cc_bindings_init(&this->bindings);
+	cc_bindings_init(&this->body_bindings);
+	valq_init(&this->scopes, sizeof(struct cc_scope_frame), NULL);
+	this->symbols = cc_node_new_symbols(&this->arena, CC_SCOPE_FILE);
 	if (this->symbols == NULL) {
 		err = ENOMEM;
-		goto err1;
+		goto err2;
 	}
 	err = parser_build_types(this);
 	if (err)
-		goto err1;
+		goto err2;
 	cc_token_stream_init(&this->stream, buffer, size);
 	*out = this;
 	return ESUCCESS;
+err2:
+	cc_bindings_empty(&this->bindings);
+	cc_arena_empty(&this->arena);
+	munmap((void *)buffer, size);
 err1:
 	close(fd);
 err0:
+	free(this);
 	return err;
 }
 
@@ -920,7 +1359,8 @@ static
 void parser_cleanup0(struct parser *this)
 {
 	assert(this);
-	munmap((void *)this->stream.buffer, this->stream.buffer_size);
+	if (this->stream.embed)
+		munmap((void *)this->stream.embed, this->stream.embed_size);
 	close(this->cpp_tokens_fd);
 	unlink(this->cpp_tokens_path);
 	free((void *)this->cpp_tokens_path);
@@ -930,11 +1370,23 @@ void parser_cleanup0(struct parser *this)
 err_t parser_delete(struct parser *this)
 {
 	assert(this);
-	cc_node_delete(this->root);
-	cc_node_delete(this->symbols);
+	/* The tree, the types and the sym-tables are all in the arena */
+	cc_arena_empty(&this->arena);
+	cc_ast_empty(&this->ast);
+	cc_bindings_empty(&this->bindings);
+	cc_bindings_empty(&this->body_bindings);
+	assert(valq_is_empty(&this->scopes));
+	/* The identifiers in the tree point into the buffer */
+	munmap((void *)this->stream.buffer, this->stream.buffer_size);
 	free(this);
 	return ESUCCESS;
 }
+
+void parser_set_skip_function_bodies(struct parser *this,
+									 const bool skip)
+{
+	this->skip_function_bodies = skip;
+}
 /*****************************************************************************/
 static
 err_t cc_token_convert_radix(struct cc_token *this,
@@ -1200,28 +1652,196 @@ err_t cc_token_convert(struct cc_token *this)
 	return err;
 }
 /*****************************************************************************/
+static
+err_t cc_token_stream_alloc_token(struct cc_token_stream *this,
+								  struct cc_token **out)
+{
+	int i;
+	err_t err;
+	struct cc_token_arena *arena;
+
+	if (!ptrq_is_empty(&this->free_tokens)) {
+		*out = ptrq_remove_head(&this->free_tokens);
+		return ESUCCESS;
+	}
+
+	arena = malloc(sizeof(*arena));
+	if (arena == NULL)
+		return ENOMEM;
+	stats_note_alloc(STATS_SUBSYSTEM_PARSER, sizeof(*arena));
+	err = ptrq_add_tail(&this->arenas, arena);
+	if (err) {
+		free(arena);
+		return err;
+	}
+	for (i = 1; !err && i < CC_TOKEN_ARENA_SIZE; ++i)
+		err = ptrq_add_tail(&this->free_tokens, &arena->tokens[i]);
+	*out = &arena->tokens[0];
+	return err;
+}
+/*****************************************************************************/
+/* The spellings of the numbers 0 to 255 */
+static const char g_embed_numbers[256][4] = {
+	"0", "1", "2", "3", "4", "5", "6", "7", "8", "9",
+	"10", "11", "12", "13", "14", "15", "16", "17", "18", "19",
+	"20", "21", "22", "23", "24", "25", "26", "27", "28", "29",
+	"30", "31", "32", "33", "34", "35", "36", "37", "38", "39",
+	"40", "41", "42", "43", "44", "45", "46", "47", "48", "49",
+	"50", "51", "52", "53", "54", "55", "56", "57", "58", "59",
+	"60", "61", "62", "63", "64", "65", "66", "67", "68", "69",
+	"70", "71", "72", "73", "74", "75", "76", "77", "78", "79",
+	"80", "81", "82", "83", "84", "85", "86", "87", "88", "89",
+	"90", "91", "92", "93", "94", "95", "96", "97", "98", "99",
+	"100", "101", "102", "103", "104", "105", "106", "107", "108", "109",
+	"110", "111", "112", "113", "114", "115", "116", "117", "118", "119",
+	"120", "121", "122", "123", "124", "125", "126", "127", "128", "129",
+	"130", "131", "132", "133", "134", "135", "136", "137", "138", "139",
+	"140", "141", "142", "143", "144", "145", "146", "147", "148", "149",
+	"150", "151", "152", "153", "154", "155", "156", "157", "158", "159",
+	"160", "161", "162", "163", "164", "165", "166", "167", "168", "169",
+	"170", "171", "172", "173", "174", "175", "176", "177", "178", "179",
+	"180", "181", "182", "183", "184", "185", "186", "187", "188", "189",
+	"190", "191", "192", "193", "194", "195", "196", "197", "198", "199",
+	"200", "201", "202", "203", "204", "205", "206", "207", "208", "209",
+	"210", "211", "212", "213", "214", "215", "216", "217", "218", "219",
+	"220", "221", "222", "223", "224", "225", "226", "227", "228", "229",
+	"230", "231", "232", "233", "234", "235", "236", "237", "238", "239",
+	"240", "241", "242", "243", "244", "245", "246", "247", "248", "249",
+	"250", "251", "252", "253", "254", "255"
+};
+
+/*
+ * Returns the next token of the byte-list of the #embed resource: a number
+ * for each byte, and a comma between two bytes. The resource is unmapped
+ * after its last byte.
+ */
+static
+err_t cc_token_stream_read_embed(struct cc_token_stream *this,
+								 struct cc_token **out)
+{
+	err_t err;
+	size_t position;
+	const char *src;
+	struct cc_token *token;
+
+	assert(this->embed);
+	err = cc_token_stream_alloc_token(this, &token);
+	if (err)
+		return err;
+
+	position = this->embed_position;
+	if (position & 1) {
+		token->type = CC_TOKEN_COMMA;
+		token->string = NULL;
+		token->string_len = 0;
+	} else {
+		src = g_embed_numbers[this->embed[position >> 1]];
+		token->type = CC_TOKEN_NUMBER;
+		token->string = src;
+		token->string_len = strlen(src);
+	}
+
+	++position;
+	this->embed_position = position;
+	if (position == 2 * this->embed_size - 1) {
+		munmap((void *)this->embed, this->embed_size);
+		this->embed = NULL;
+	}
+	*out = token;
+	return ESUCCESS;
+}
+
+/* The record is the path, and the number of bytes to embed. */
+static
+err_t cc_token_stream_map_embed(struct cc_token_stream *this,
+								size_t position)
+{
+	err_t err;
+	int fd, ret;
+	const char *path, *record, *end;
+	uint64_t path_len, size;
+	void *p;
+	struct stat stat;
+
+	record = &this->buffer[position];
+	end = &this->buffer[this->buffer_size];
+	err = token_file_get_varint(&record, end, &path_len);
+	if (!err && (path_len >= (uint64_t)(end - record) || record[path_len]))
+		err = EINVAL;
+	if (err)
+		return err;
+	path = record;
+	record += path_len + 1;
+	err = token_file_get_varint(&record, end, &size);
+	if (!err && size == 0)
+		err = EINVAL;
+	if (err)
+		return err;
+	position = record - this->buffer;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return errno;
+	ret = fstat(fd, &stat);
+	if (ret < 0) {
+		err = errno;
+		goto err0;
+	}
+
+	/* The resource shrank since it was scanned */
+	if ((size_t)stat.st_size < size) {
+		err = EINVAL;
+		goto err0;
+	}
+
+	p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		err = errno;
+		goto err0;
+	}
+	this->embed = p;
+	this->embed_size = size;
+	this->embed_position = 0;
+	this->position = position;
+	err = ESUCCESS;
+err0:
+	close(fd);
+	return err;
+}
+
 static
 err_t cc_token_stream_read_token(struct cc_token_stream *this,
 								 struct cc_token **out)
 {
 	struct cc_token *token;
 	bool is_ident;
-	char *src;
-	size_t src_len;
+	uint64_t ref, src_len;
 	enum cc_token_type type;	/* lxr_token_type == cc_token_type */
-	size_t position;
+	size_t position, def_position;
+	const char *record, *end;
+	err_t err;
+
+	if (this->embed)
+		return cc_token_stream_read_embed(this, out);
 
 	position = this->position;
-	if (position >= this->buffer_size)
+	if (position >= this->end)
 		return EOF;
 
-	assert(position < this->buffer_size);
-	assert(sizeof(type) == 4);
-	memcpy(&type, &this->buffer[position], sizeof(type));
-	position += sizeof(type);
-	token = malloc(sizeof(*token));
-	if (token == NULL)
-		return ENOMEM;
+	type = (unsigned char)this->buffer[position++];
+	assert(type != TOKEN_FILE_END);
+
+	/* Expanded into the byte-list only now that the parser needs it. */
+	if (type == CC_TOKEN_EMBED) {
+		err = cc_token_stream_map_embed(this, position);
+		if (err)
+			return err;
+		return cc_token_stream_read_embed(this, out);
+	}
+
+	err = cc_token_stream_alloc_token(this, &token);
+	if (err)
+		return err;
 	token->type = type;
 
 	/* cc_token_type_is_key_word only checks for c-key-words */
@@ -1249,25 +1869,35 @@ err_t cc_token_stream_read_token(struct cc_token_stream *this,
 		is_ident = true;
 	if (is_ident) {
 		/* These are lexer-key-words. No src-len */
-		token->string = src = strdup(g_key_words[type - CC_TOKEN_ATOMIC]);
-		if (src == NULL)
-			return ENOMEM;
+		token->string = g_key_words[type - CC_TOKEN_ATOMIC];
 		token->string_len = strlen(token->string);
 		token->type = CC_TOKEN_IDENTIFIER;
 		goto done;
 	}
-	memcpy(&src_len, &this->buffer[position], sizeof(src_len));
-	assert(src_len);
-
-	position += sizeof(src_len);
-	src = NULL;
-	src = malloc(src_len + 1);
-	if (src == NULL)
-		return ENOMEM;
-	src[src_len] = 0;
-	memcpy(src, &this->buffer[position], src_len);
-	position += src_len;
-	token->string = src;
+	/* A spelling that was defined before is at a distance of ref. */
+	end = &this->buffer[this->buffer_size];
+	record = &this->buffer[position];
+	err = token_file_get_varint(&record, end, &ref);
+	if (!err && ref > position - TOKEN_FILE_HEADER_SIZE)
+		err = EINVAL;
+	def_position = ref ? position - ref : (size_t)(record - this->buffer);
+	if (!err) {
+		position = record - this->buffer;
+		record = &this->buffer[def_position];
+		err = token_file_get_varint(&record, end, &src_len);
+	}
+	/* The string is referenced in place; the scanner writes its nul too. */
+	if (!err && (src_len == 0 || src_len >= (uint64_t)(end - record) ||
+				 record[src_len]))
+		err = EINVAL;
+	if (err) {
+		cc_token_stream_delete_token(this, token);
+		return err;
+	}
+	def_position = record - this->buffer;
+	if (ref == 0)
+		position = def_position + src_len + 1;
+	token->string = &this->buffer[def_position];
 	token->string_len = src_len;
 done:
 	assert(position > this->position);
@@ -1283,6 +1913,7 @@ err_t cc_token_stream_peek_entry(struct cc_token_stream *this,
 {
 	err_t err;
 	int num_entries;
+	enum stats_phase phase;
 	struct cc_token *token;
 
 	num_entries = ptrq_num_entries(&this->q);
@@ -1295,9 +1926,13 @@ err_t cc_token_stream_peek_entry(struct cc_token_stream *this,
 	/* Not reading from the cpp_tokens file? EOF */
 	if (this->buffer == NULL)
 		return EOF;
+	phase = stats_enter(STATS_PHASE_READ_TOKENS);
 	err = cc_token_stream_read_token(this, &token);
 	if (!err)
 		err = cc_token_convert(token);
+	stats_leave(phase);
+	if (!err)
+		++g_stats.num_tokens_read;
 	if (!err)
 		err = ptrq_add_tail(&this->q, token);
 	if (!err)
@@ -1326,6 +1961,91 @@ err_t cc_token_stream_remove_head(struct cc_token_stream *this,
 	assert(token == *out);
 	return err;
 }
+
+/* Moves *position past the record at it. */
+static
+err_t cc_token_stream_next_record(const struct cc_token_stream *this,
+								  size_t *position)
+{
+	err_t err;
+	uint64_t value;
+	const char *record, *end;
+	enum cc_token_type type;
+
+	record = &this->buffer[*position];
+	end = &this->buffer[this->buffer_size];
+	type = (unsigned char)*record++;
+	err = ESUCCESS;
+	if (type == CC_TOKEN_EMBED) {
+		err = token_file_get_varint(&record, end, &value);
+		if (!err && value >= (uint64_t)(end - record))
+			err = EINVAL;
+		if (!err)
+			record += value + 1;	/* the path and its nul */
+		if (!err)
+			err = token_file_get_varint(&record, end, &value);
+	} else if (!cc_token_type_is_key_word(type) &&
+			   !cc_token_type_is_punctuator(type) &&
+			   !(type >= CC_TOKEN_NO_RETURN &&
+				 type <= CC_TOKEN_REPRODUCIBLE) &&
+			   !(type >= CC_TOKEN_DIRECTIVE_DEFINE &&
+				 type <= CC_TOKEN_DIRECTIVE_WARNING)) {
+		err = token_file_get_varint(&record, end, &value);
+		/* A ref of 0 is followed by the definition of the spelling */
+		if (!err && value == 0) {
+			err = token_file_get_varint(&record, end, &value);
+			if (!err && value >= (uint64_t)(end - record))
+				err = EINVAL;
+			if (!err)
+				record += value + 1;	/* the spelling and its nul */
+		}
+	}
+	if (!err)
+		*position = record - this->buffer;
+	return err;
+}
+
+/*
+ * The head of the stream is a {, and it must be the only token read ahead.
+ * Skips up to and including the matching }, walking the records without
+ * reading them into tokens. Returns the range of the records skipped.
+ */
+static
+err_t cc_token_stream_skip_braces(struct cc_token_stream *this,
+								  size_t *out_begin,
+								  size_t *out_end)
+{
+	err_t err;
+	int depth;
+	size_t position;
+	enum cc_token_type type;
+	struct cc_token *token;
+
+	assert(ptrq_num_entries(&this->q) == 1);
+	assert(this->embed == NULL);
+	err = cc_token_stream_remove_head(this, &token);
+	assert(err == ESUCCESS);
+	assert(cc_token_type(token) == CC_TOKEN_LEFT_BRACE);
+	cc_token_stream_delete_token(this, token);
+
+	position = this->position - 1;	/* A punctuator takes a byte */
+	assert(this->buffer[position] == CC_TOKEN_LEFT_BRACE);
+	*out_begin = position;
+	for (++position, depth = 1; depth; ) {
+		if (position >= this->end)
+			return EINVAL;	/* The { is not matched */
+		type = (unsigned char)this->buffer[position];
+		if (type == CC_TOKEN_LEFT_BRACE)
+			++depth;
+		else if (type == CC_TOKEN_RIGHT_BRACE)
+			--depth;
+		err = cc_token_stream_next_record(this, &position);
+		if (err)
+			return err;
+	}
+	this->position = *out_end = position;
+	return ESUCCESS;
+}
 /*****************************************************************************/
 static
 bool parser_has_attributes(struct parser *this)
@@ -1436,7 +2156,7 @@ err_t parser_parse_type_specifier(struct parser *this,
 	struct cc_token *token;
 
 	if (out[0] == NULL)
-		out[0] = cc_node_new_type_specifiers();
+		out[0] = cc_node_new_type_specifiers(&this->arena);
 	if (out[0] == NULL)
 		return ENOMEM;
 
@@ -1476,7 +2196,7 @@ err_t parser_parse_type_qualifier(struct parser *this,
 	struct cc_token *token;
 
 	if (out[0] == NULL)
-		out[0] = cc_node_new_type_qualifiers();
+		out[0] = cc_node_new_type_qualifiers(&this->arena);
 	if (out[0] == NULL)
 		return ENOMEM;
 	stream = parser_token_stream(this);
@@ -1485,7 +2205,7 @@ err_t parser_parse_type_qualifier(struct parser *this,
 	err = cc_token_stream_remove_head(stream, &token);
 	assert(err == ESUCCESS);
 	type = cc_token_type(token);
-	cc_token_delete(token);
+	cc_token_stream_delete_token(stream, token);
 
 	/* Try to update the bitmask */
 	return cc_node_add_type_qualifier(out[0], type);
@@ -1511,7 +2231,7 @@ err_t parser_parse_storage_specifier(struct parser *this,
 	struct cc_token *token;
 
 	if (out[0] == NULL)
-		out[0] = cc_node_new_storage_specifiers();
+		out[0] = cc_node_new_storage_specifiers(&this->arena);
 	if (out[0] == NULL)
 		return ENOMEM;
 	stream = parser_token_stream(this);
@@ -1520,7 +2240,7 @@ err_t parser_parse_storage_specifier(struct parser *this,
 	err = cc_token_stream_remove_head(stream, &token);
 	assert(err == ESUCCESS);
 	type = cc_token_type(token);
-	cc_token_delete(token);
+	cc_token_stream_delete_token(stream, token);
 
 	/* Try to update the bitmask */
 	return cc_node_add_storage_specifier(out[0], type);
@@ -1615,9 +2335,7 @@ err_t parser_parse_declaration_specifiers(struct parser *this,
 	err_t err;
 	bool is_specifier;
 	const char *str;
-	struct ptr_queue stes;
-	const struct cc_node *ste;
-	struct cc_node *attributes;
+	struct cc_node *attributes, *type_def;
 	struct cc_token_stream *stream;
 	struct cc_token *token;
 	struct cc_node_declaration_specifiers *ds;
@@ -1626,10 +2344,9 @@ err_t parser_parse_declaration_specifiers(struct parser *this,
 	 * array of DeclarationSpecifier elements. The array may optionally end
 	 * with an AttributeSpecifierSequence
 	 */
-	ptrq_init(&stes, NULL);
 	stream = parser_token_stream(this);
 	assert(out[0] == NULL);
-	out[0] = cc_node_new_declaration_specifiers();
+	out[0] = cc_node_new_declaration_specifiers(&this->arena);
 	if (out[0] == NULL)
 		return ENOMEM;
 
@@ -1654,16 +2371,13 @@ err_t parser_parse_declaration_specifiers(struct parser *this,
 			/* Should be a TypedefName. If not, break */
 			str = cc_token_string(token);
 			assert(str);
-			assert(this->symbols);
-			err = cc_node_find_type_def(this->symbols, str, &stes);
+			err = parser_find_type_def(this, str, &type_def);
 			if (err == ENOENT) {
 				err = ESUCCESS;
 				break;	/* Not a TypedefName */
 			}
 			if (err)
 				return err;
-			/* Free stes */
-			PTRQ_FOR_EACH_WITH_REMOVE(&stes, ste);
 			/* this is indeed a TypedefName */
 		}
 		err = parser_parse_declaration_specifier(this, out[0]);
@@ -1805,7 +2519,7 @@ err_t parser_parse_declaration(struct parser *this,
 		if (cc_token_type(token) == CC_TOKEN_SEMI_COLON) {
 			err = cc_token_stream_remove_head(stream, &token);
 			assert(err == ESUCCESS);
-			cc_token_delete(token);
+			cc_token_stream_delete_token(stream, token);
 			return parser_process_declaration(this, nodes);
 		}
 	}
@@ -1815,15 +2529,126 @@ err_t parser_parse_declaration(struct parser *this,
 	return ENOTSUP;
 }
 /*****************************************************************************/
+/* Statements are not parsed yet; a body fails the parse with ENOTSUP. */
 static
-err_t parser_parse_function_definition(struct parser *this,
-									   struct ptr_queue *nodes)
+err_t parser_parse_compound_statement(struct parser *this,
+									  struct cc_node **out)
 {
-	assert(0);
 	(void)this;
-	(void)nodes;
+	(void)out;
 	return ENOTSUP;
 }
+
+/*
+ * The stream is pointed at the records of the body, and then restored; any
+ * tokens read ahead must have been consumed.
+ */
+static
+err_t parser_parse_function_body0(struct parser *this,
+								  struct cc_node *node)
+{
+	err_t err;
+	size_t position, end;
+	struct cc_token_stream *stream;
+	struct cc_node_function_body *fb;
+
+	fb = cc_node_assert_type(node, CC_NODE_FUNCTION_BODY);
+	stream = parser_token_stream(this);
+	assert(ptrq_is_empty(&stream->q));
+	assert(stream->embed == NULL);
+	position = stream->position;
+	end = stream->end;
+	stream->position = fb->begin;
+	stream->end = fb->end;
+	err = parser_parse_compound_statement(this, &fb->block);
+	assert(err || stream->position == fb->end);
+	stream->position = position;
+	stream->end = end;
+	if (!err)
+		err = cc_node_add_tail_child(&this->arena, node, fb->block);
+	return err;
+}
+
+/*
+ * Parses a body that was skipped, if it was not parsed already. The names
+ * bound since the definition are hidden by parsing against body_bindings,
+ * which then holds the file-scope as it was at the definition.
+ */
+static
+err_t parser_parse_function_body(struct parser *this,
+								 struct cc_node *node)
+{
+	err_t err;
+	bool is_late;
+	struct cc_bindings bindings;
+	struct cc_node_function_body *fb;
+
+	fb = cc_node_assert_type(node, CC_NODE_FUNCTION_BODY);
+	if (fb->block)
+		return ESUCCESS;
+
+	err = ESUCCESS;
+	is_late = fb->num_bindings < this->bindings.num_entries;
+	if (is_late) {
+		bindings = this->bindings;
+		this->bindings = this->body_bindings;
+		err = cc_bindings_sync(&this->bindings, &bindings,
+							   fb->num_bindings);
+	}
+	if (!err && fb->parameters) {
+		err = parser_enter_parameters(this, fb->parameters);
+		if (!err) {
+			err = parser_parse_function_body0(this, node);
+			parser_leave_scope(this);
+		}
+	} else if (!err) {
+		err = parser_parse_function_body0(this, node);
+	}
+	if (is_late) {
+		this->body_bindings = this->bindings;
+		this->bindings = bindings;
+	}
+	return err;
+}
+
+/*
+ * It receives attributes, specifiers, and one declarator. The head of the
+ * stream is the { of the body. The body is always skipped first; unless the
+ * parser skips the function-bodies, it is then parsed right away.
+ */
+static
+err_t parser_parse_function_definition(struct parser *this,
+									   struct cc_node *parent,
+									   struct ptr_queue *nodes)
+{
+	err_t err;
+	struct cc_node *node, *body;
+	struct cc_node_function_body *fb;
+
+	node = cc_node_new(&this->arena, CC_NODE_FUNCTION_DEFINITION);
+	body = cc_node_new_function_body(&this->arena);
+	if (node == NULL || body == NULL)
+		return ENOMEM;
+	fb = cc_node_assert_type(body, CC_NODE_FUNCTION_BODY);
+	fb->parameters = this->prototype;
+	fb->num_bindings = this->bindings.num_entries;
+	this->prototype = NULL;
+
+	err = ESUCCESS;
+	while (!err && !ptrq_is_empty(nodes))
+		err = cc_node_add_tail_child(&this->arena, node,
+									 ptrq_remove_head(nodes));
+	if (!err)
+		err = cc_node_add_tail_child(&this->arena, node, body);
+	if (!err)
+		err = cc_token_stream_skip_braces(parser_token_stream(this),
+										  &fb->begin, &fb->end);
+	if (!err && !this->skip_function_bodies)
+		err = parser_parse_function_body(this, body);
+	if (!err)
+		err = cc_node_add_tail_child(&this->arena, parent, node);
+	return err;
+}
 /*****************************************************************************/
 static
 err_t parser_parse_identifier(struct parser *this,
@@ -1839,12 +2664,11 @@ err_t parser_parse_identifier(struct parser *this,
 	err = cc_token_stream_remove_head(stream, &token);
 	assert(err == ESUCCESS);
 	assert(cc_token_is_identifier(token));
-	out[0] = cc_node_new_identifier(cc_token_string(token),
+	out[0] = cc_node_new_identifier(&this->arena, cc_token_string(token),
 									cc_token_string_length(token));
+	cc_token_stream_delete_token(stream, token);
 	if (out[0] == NULL)
 		return ENOMEM;
-	cc_token_reset_string(token);
-	cc_token_delete(token);
 	return err;
 }
 /*****************************************************************************/
@@ -1864,9 +2688,9 @@ err_t parser_parse_type_pointer(struct parser *this,
 	err = cc_token_stream_remove_head(stream, &token);
 	assert(err == ESUCCESS);
 	assert(cc_token_type(token) == CC_TOKEN_MUL);
-	cc_token_delete(token);
+	cc_token_stream_delete_token(stream, token);
 
-	out[0] = cc_node_new_type_pointer();
+	out[0] = cc_node_new_type_pointer(&this->arena);
 	if (out[0] == NULL)
 		return ENOMEM;
 
@@ -1879,7 +2703,7 @@ err_t parser_parse_type_pointer(struct parser *this,
 		attributes = NULL;
 		err = parser_parse_attribute_specifiers(this, &attributes);
 		if (!err)
-			err = cc_node_add_tail_child(out[0], attributes);
+			err = cc_node_add_tail_child(&this->arena, out[0], attributes);
 		if (err)
 			return err;
 		/* fallthrough */
@@ -1900,7 +2724,7 @@ err_t parser_parse_type_pointer(struct parser *this,
 		if (err)
 			return err;
 	}
-	return cc_node_add_tail_child(out[0], node);
+	return cc_node_add_tail_child(&this->arena, out[0], node);
 }
 #endif
 /*****************************************************************************/
@@ -1994,7 +2818,6 @@ err_t parser_parse_type_function(struct parser *this,
 	enum cc_token_type type;
 	struct cc_token_stream *stream;
 	struct cc_token *token;
-	struct cc_node *symbols;
 	struct cc_node_type_function *tf;
 	struct cc_node_block *b;
 	struct cc_node_symbols *ss;
@@ -2007,7 +2830,7 @@ err_t parser_parse_type_function(struct parser *this,
 	 */
 	assert(out[0] == NULL);
 #if 0
-	out[0] = cc_node_new_type_function();
+	out[0] = cc_node_new_type_function(&this->arena);
 #endif
 	if (out[0] == NULL)
 		return ENOMEM;
@@ -2016,7 +2839,7 @@ err_t parser_parse_type_function(struct parser *this,
 	err = cc_token_stream_remove_head(stream, &token);
 	assert(err == ESUCCESS);
 	assert(cc_token_type(token) == CC_TOKEN_LEFT_PAREN);
-	cc_token_delete(token);
+	cc_token_stream_delete_token(stream, token);
 
 	tf = cc_node_assert_type(out[0], CC_NODE_TYPE_FUNCTION);
 	b = cc_node_assert_type(tf->block, CC_NODE_BLOCK);
@@ -2028,40 +2851,43 @@ err_t parser_parse_type_function(struct parser *this,
 	 * This helps in processing parameters, as that requires looking up
 	 * types.
 	 */
-	err = cc_node_add_tail_child(this->symbols, b->symbols);
+	err = cc_node_add_tail_child(&this->arena, this->symbols, b->symbols);
+	if (!err)
+		err = parser_enter_scope(this, b->symbols);
 	if (err)
 		return err;
-	symbols = this->symbols;	/* Save the current symbol-table */
-	this->symbols = b->symbols;	/* Set the new symbol-table */
 	has_ellipsis = false;
 	while (true) {
 		err = cc_token_stream_remove_head(stream, &token);
 		if (err)
-			return err;
+			goto err0;
 		type = cc_token_type(token);
-		if (has_ellipsis && type != CC_TOKEN_RIGHT_PAREN)
-			return EINVAL;
+		if (has_ellipsis && type != CC_TOKEN_RIGHT_PAREN) {
+			err = EINVAL;
+			goto err0;
+		}
 		if (type == CC_TOKEN_RIGHT_PAREN) {
-			cc_token_delete(token);
+			cc_token_stream_delete_token(stream, token);
 			break;
 		}
 		if (type == CC_TOKEN_ELLIPSIS) {
-			cc_token_delete(token);
+			cc_token_stream_delete_token(stream, token);
 			has_ellipsis = true;
 			continue;
 		}
 		err = parser_parse_parameter_declaration(this);
+		if (!err)
+			err = cc_token_stream_peek_head(stream, &token);
 		if (err)
-			return err;
-		err = cc_token_stream_peek_head(stream, &token);
-		if (err)
-			return err;
+			goto err0;
 		type = cc_token_type(token);
 		if (type == CC_TOKEN_RIGHT_PAREN)
 			continue;
-		if (type != CC_TOKEN_COMMA)
-			return EINVAL;
-		cc_token_delete(token);
+		if (type != CC_TOKEN_COMMA) {
+			err = EINVAL;
+			goto err0;
+		}
+		cc_token_stream_delete_token(stream, token);
 	}
 	/* TODO AttributeSpecifierSequence */
 	/*
@@ -2069,7 +2895,18 @@ err_t parser_parse_type_function(struct parser *this,
 	 * function-name/identifier.
 	 */
 	assert(err == ESUCCESS);
-	this->symbols = symbols;	/* Revert back to the previous symtab */
+err0:
+	parser_leave_scope(this);	/* Revert back to the previous symtab */
+
+	/*
+	 * Of the prototypes of a declarator, the first one to end outside of
+	 * any parameter-list is that of the function being declared; if the
+	 * declarator begins a definition, its body sees the parameters.
+	 */
+	ss = cc_node_assert_type(this->symbols, CC_NODE_SYMBOLS);
+	if (!err && this->prototype == NULL &&
+		cc_node_symbols_scope(ss) != CC_SCOPE_PROTOTYPE)
+		this->prototype = b->symbols;
 	return err;
 }
 /*****************************************************************************/
@@ -2129,7 +2966,7 @@ err_t parser_parse_declarator(struct parser *this,
 	assert(out[0] == NULL);	/* for now */
 
 	stream = parser_token_stream(this);
-	out[0] = cc_node_new_declarator();
+	out[0] = cc_node_new_declarator(&this->arena);
 	if (out[0] == NULL)
 		return ENOMEM;
 
@@ -2202,7 +3039,7 @@ err_t parser_parse_declarator(struct parser *this,
 		if (type == CC_TOKEN_RIGHT_PAREN && ident_found) {
 			err = cc_token_stream_remove_head(stream, &token);
 			assert(err == ESUCCESS);
-			cc_token_delete(token);
+			cc_token_stream_delete_token(stream, token);
 
 			node = NULL;
 			while (ptrq_num_entries(&stack)) {
@@ -2216,7 +3053,7 @@ err_t parser_parse_declarator(struct parser *this,
 			}
 			if (node == NULL)
 				return EINVAL;
-			cc_node_delete(node);	/* the left-paren */
+			/* The left-paren is left behind in the arena */
 			continue;
 		}
 
@@ -2235,8 +3072,8 @@ err_t parser_parse_declarator(struct parser *this,
 				/* This is a precedence-ordering paren */
 				err = cc_token_stream_remove_head(stream, &token);
 				assert(err == ESUCCESS);
-				cc_token_delete(token);
-				node = cc_node_new(CC_NODE_LEFT_PAREN);
+				cc_token_stream_delete_token(stream, token);
+				node = cc_node_new(&this->arena, CC_NODE_LEFT_PAREN);
 				if (node == NULL)
 					return ENOMEM;
 				err = ptrq_add_tail(&stack, node);
@@ -2276,7 +3113,10 @@ err_t parser_parse_declarator(struct parser *this,
 	d = cc_node_assert_type(out[0], CC_NODE_DECLARATOR);
 	if (is_abstract_delarator)
 		out[0]->type = CC_NODE_ABSTRACT_DECLARATOR;
-	return ptrq_move(&list, &d->list);
+	while (!err && !ptrq_is_empty(&list))
+		err = cc_arena_ptrq_add_tail(&this->arena, &d->list,
+									 ptrq_remove_head(&list));
+	return err;
 }
 /*****************************************************************************/
 static
@@ -2289,7 +3129,7 @@ err_t parser_parse_external_declaration(struct parser *this,
 	struct cc_node *attributes, *specifiers, *declarator;
 	struct ptr_queue nodes;
 
-	ptrq_init(&nodes, cc_node_delete);
+	ptrq_init(&nodes, NULL);
 	cc_node_assert_type(parent, CC_NODE_TRANSLATION_UNIT);
 
 	/* Is it a static_assert declaration? */
@@ -2309,9 +3149,9 @@ err_t parser_parse_external_declaration(struct parser *this,
 		if (!err && cc_token_type(token) == CC_TOKEN_SEMI_COLON) {
 			err = cc_token_stream_remove_head(stream, &token);
 			assert(err == ESUCCESS);
-			cc_token_delete(token);
+			cc_token_stream_delete_token(stream, token);
 			attributes->type = CC_NODE_ATTRIBUTE_DECLARATION;
-			return cc_node_add_tail_child(parent, attributes);
+			return cc_node_add_tail_child(&this->arena, parent, attributes);
 		}
 		if (err)
 			return err;
@@ -2339,7 +3179,7 @@ err_t parser_parse_external_declaration(struct parser *this,
 	if (attributes == NULL && cc_token_type(token) == CC_TOKEN_SEMI_COLON) {
 		err = cc_token_stream_remove_head(stream, &token);
 		assert(err == ESUCCESS);
-		cc_token_delete(token);
+		cc_token_stream_delete_token(stream, token);
 		return parser_process_declaration(this, &nodes);
 	}
 
@@ -2347,6 +3187,7 @@ err_t parser_parse_external_declaration(struct parser *this,
 	 * Parse a single Declarator first. TODO Pass specifiers.type so that
 	 * it can be modified further by each declarator according to its needs.
 	 */
+	this->prototype = NULL;
 	err = parser_parse_declarator(this, &declarator);
 	/* Should not be an AbstractDeclarator */
 	if (!err)
@@ -2358,7 +3199,7 @@ err_t parser_parse_external_declaration(struct parser *this,
 	if (err)
 		return err;
 	if (cc_token_type(token) == CC_TOKEN_LEFT_BRACE)
-		return parser_parse_function_definition(this, &nodes);
+		return parser_parse_function_definition(this, parent, &nodes);
 	return parser_parse_declaration(this, &nodes);
 }
 /*****************************************************************************/
@@ -2370,7 +3211,7 @@ err_t parser_parse_translation_unit(struct parser *this,
 
 	/* TranslationUnit is the root of ast; array of ExternalDeclaration */
 	assert(out[0] == NULL);
-	out[0] = cc_node_new(CC_NODE_TRANSLATION_UNIT);
+	out[0] = cc_node_new(&this->arena, CC_NODE_TRANSLATION_UNIT);
 	if (out[0] == NULL)
 		return ENOMEM;
 
@@ -2384,43 +3225,201 @@ err_t parser_parse_translation_unit(struct parser *this,
 }
 /*****************************************************************************/
 static
-void cc_node_print(const struct cc_node *this)
+err_t cc_ast_printer_init(struct cc_ast_printer *this,
+						  const int fd,
+						  const bool is_compact)
 {
-	int i;
-	const struct cc_node *child;
+	this->fd = fd;
+	this->is_compact = is_compact;
+	valq_init(&this->stack, sizeof(uint32_t), NULL);
+	this->size = 0;
+	this->buffer = malloc(CC_AST_PRINTER_BUFFER_SIZE);
+	if (this->buffer == NULL)
+		return ENOMEM;
+	stats_note_alloc(STATS_SUBSYSTEM_PARSER, CC_AST_PRINTER_BUFFER_SIZE);
+	return ESUCCESS;
+}
 
-	/*
-	 * Only identifiers, numbers, char-consts, and string-literals have
-	 * non-null string field. The string is not nul terminated.
-	 */
-	printf("\n(");
-	if (cc_node_is_identifier(this) && !cc_node_is_key_word(this))
-		printf("%s", this->u.identifier->string);
-	else if (cc_node_is_number(this))
-		printf("%s", this->u.number->string);
-	else if (cc_node_is_char_const(this))
-		printf("%s", this->u.char_const->string);
-	else if (cc_node_is_string_literal(this))
-		printf("%s", this->u.string_literal->string);
+static
+void cc_ast_printer_empty(struct cc_ast_printer *this)
+{
+	while (!valq_is_empty(&this->stack))
+		valq_remove_tail(&this->stack);
+	free(this->buffer);
+}
+
+static
+err_t cc_ast_printer_write(struct cc_ast_printer *this,
+						   const char *p,
+						   size_t size)
+{
+	ssize_t ret;
+
+	while (size) {
+		ret = write(this->fd, p, size);
+		if (ret < 0)
+			return errno;
+		p += ret;
+		size -= ret;
+	}
+	return ESUCCESS;
+}
+
+static
+err_t cc_ast_printer_flush(struct cc_ast_printer *this)
+{
+	err_t err;
+
+	err = cc_ast_printer_write(this, this->buffer, this->size);
+	this->size = 0;
+	return err;
+}
+
+/* A string larger than the buffer, such as a long string-literal, bypasses it */
+static
+err_t cc_ast_printer_put(struct cc_ast_printer *this,
+						 const char *str,
+						 const size_t size)
+{
+	err_t err;
+
+	if (this->size + size > CC_AST_PRINTER_BUFFER_SIZE) {
+		err = cc_ast_printer_flush(this);
+		if (err)
+			return err;
+		if (size > CC_AST_PRINTER_BUFFER_SIZE)
+			return cc_ast_printer_write(this, str, size);
+	}
+	memcpy(this->buffer + this->size, str, size);
+	this->size += size;
+	return ESUCCESS;
+}
+
+static
+err_t cc_ast_printer_open(struct cc_ast_printer *this,
+						  const struct cc_ast *ast,
+						  const uint32_t node,
+						  const bool is_root)
+{
+	err_t err;
+	const char *string;
+
+	string = cc_ast_string(ast, node);
+	if (string == NULL)
+		string = &g_cc_node_type_str[cc_ast_type(ast, node)]
+			[strlen("CC_NODE_")];
+	if (!this->is_compact)
+		err = cc_ast_printer_put(this, "\n(", 2);
+	else if (is_root)
+		err = cc_ast_printer_put(this, "(", 1);
 	else
-		printf("%s", &g_cc_node_type_str[this->type][strlen("CC_NODE_")]);
-	CC_NODE_FOR_EACH_CHILD(this, i, child)
-		cc_node_print(child);
-	printf(")\n");
+		err = cc_ast_printer_put(this, " (", 2);
+	if (!err)
+		err = cc_ast_printer_put(this, string, strlen(string));
+	return err;
 }
 
-//static
-void parser_print_ast(const struct parser *this)
+static
+err_t cc_ast_printer_close(struct cc_ast_printer *this)
+{
+	if (this->is_compact)
+		return cc_ast_printer_put(this, ")", 1);
+	return cc_ast_printer_put(this, ")\n", 2);
+}
+
+/*
+ * Descend through the first children, pushing the parents. A node without
+ * children is closed, along with each of its ancestors of which it is within
+ * the last subtree; the walk resumes at the next sibling of the last one
+ * closed. The subtree at node is printed; its siblings are not.
+ */
+static
+err_t cc_ast_printer_print(struct cc_ast_printer *this,
+						   const struct cc_ast *ast,
+						   uint32_t node)
+{
+	err_t err;
+	uint32_t next;
+
+	err = cc_ast_printer_open(this, ast, node, true);
+	while (!err) {
+		next = cc_ast_first_child(ast, node);
+		if (next != CC_AST_NONE) {
+			err = valq_add_tail(&this->stack, &node);
+			if (err)
+				break;
+			node = next;
+			err = cc_ast_printer_open(this, ast, node, false);
+			continue;
+		}
+
+		while (true) {
+			err = cc_ast_printer_close(this);
+			if (err || valq_is_empty(&this->stack))
+				goto done;
+			next = cc_ast_next_sibling(ast, node);
+			if (next != CC_AST_NONE)
+				break;
+			node = *(uint32_t *)valq_peek_tail(&this->stack);
+			valq_remove_tail(&this->stack);
+		}
+		node = next;
+		err = cc_ast_printer_open(this, ast, node, false);
+	}
+done:
+	if (!err && this->is_compact)
+		err = cc_ast_printer_put(this, "\n", 1);
+	return err;
+}
+
+/*
+ * Writes the ast to the file at path; to stdout if path is "-". The output is
+ * parenthesized, one node per line, unless is_compact is set, in which case
+ * the ast takes a single line.
+ */
+err_t parser_dump_ast(const struct parser *this,
+					  const char *path,
+					  const bool is_compact)
 {
-	cc_node_print(this->root);
+	int fd;
+	err_t err;
+	struct cc_ast_printer printer;
+
+	fd = STDOUT_FILENO;
+	if (strcmp(path, "-")) {
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		if (fd < 0)
+			return errno;
+	} else if (fflush(stdout)) {
+		/* The output of stdio must come out before that of write(2) */
+		return errno;
+	}
+	err = cc_ast_printer_init(&printer, fd, is_compact);
+	if (!err && cc_ast_num_nodes(&this->ast))
+		err = cc_ast_printer_print(&printer, &this->ast, 0);
+	if (!err)
+		err = cc_ast_printer_flush(&printer);
+	cc_ast_printer_empty(&printer);
+	if (fd != STDOUT_FILENO)
+		close(fd);
+	return err;
 }
 /*****************************************************************************/
 err_t parser_parse(struct parser *this)
 {
 	err_t err;
 	err = parser_parse_translation_unit(this, &this->root);
+	/*
+	 * The pointer tree stays in the arena, since the declaration payloads
+	 * still hang off it. Until the passes that need them are ported, the ast
+	 * is held in addition to the tree.
+	 */
+	if (!err)
+		err = cc_ast_build(&this->ast, this->root);
+#ifndef NDEBUG
 	if (!err)
-		parser_cleanup0(this);
-	assert(!err);
+		err = cc_ast_verify(&this->ast, this->root);
+#endif
+	parser_cleanup0(this);
 	return err;
 }
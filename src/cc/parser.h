@@ -11,6 +11,7 @@
 
 #include <inc/bits.h>
 #include <inc/types.h>
+#include <inc/stats.h>
 /*****************************************************************************/
 /* Only std attributes */
 #define CC_ATTRIBUTE_DEPRECATED_POS		0
@@ -181,8 +182,12 @@ struct cc_type_struct {
  * CC_TYPE_POINTER and the hierarchy is enough.
  */
 
+/*
+ * The type is shared by all the functions of the same prototype; the body of
+ * a definition is with its FUNCTION_DEFINITION node.
+ */
 struct cc_type_function {
-	struct cc_node	*block;
+	bool	has_ellipsis;
 };
 
 /* These entries are stored in scope-sym-tab[enum_tags_ns] */
@@ -190,9 +195,18 @@ struct cc_type_enum {
 	bool	is_fixed;	/* is the underlying type fixed */
 };
 
+/*
+ * A qualified type holds only its qualifiers; the payload, the symbol and the
+ * children are read through its unqualified type, which may be a struct
+ * completed after the qualified type is built. The children of a pointer, an
+ * array, and a function are the types pointed to, of the elements, and the
+ * return type followed by those of the parameters, respectively.
+ */
 struct cc_type {
 	struct ptr_tree		tree;
 	enum cc_type_type	type;
+	int					qualifiers;	/* mask of CC_TYPE_QUALIFIER_* */
+	struct cc_type		*unqualified;	/* null, if this is unqualified */
 	struct cc_node		*symbol;	/* points back to type's name */
 	union {
 		struct cc_type_integer		*integer;
@@ -205,7 +219,7 @@ struct cc_type {
 };
 
 #define CC_TYPE_FOR_EACH_CHILD(p, ix, c)	\
-	PTRT_FOR_EACH_CHILD(&(p)->tree, ix, c)
+	PTRT_FOR_EACH_CHILD(&cc_type_unqualified(p)->tree, ix, c)
 
 static inline
 enum cc_type_type cc_type_type(const struct cc_type *this)
@@ -213,9 +227,17 @@ enum cc_type_type cc_type_type(const struct cc_type *this)
 	return this->type;
 }
 
+static inline
+struct cc_type *cc_type_unqualified(struct cc_type *this)
+{
+	return this->unqualified ? this->unqualified : this;
+}
+
 static inline
 int cc_type_num_children(const struct cc_type *this)
 {
+	if (this->unqualified)
+		this = this->unqualified;
 	return ptrt_num_children(&this->tree);
 }
 
@@ -223,6 +245,8 @@ static inline
 struct cc_type *cc_type_peek_child(const struct cc_type *this,
 								   const int index)
 {
+	if (this->unqualified)
+		this = this->unqualified;
 	return ptrt_peek_child(&this->tree, index);
 }
 
@@ -446,6 +470,22 @@ struct cc_node_block {
 	struct cc_node	*symbols;
 };
 
+/*
+ * The records of a function-body, from its { up to and including its }. The
+ * body is first skipped by matching the braces. It is parsed right away, or,
+ * if the parser skips the function-bodies, only when a later pass asks for
+ * it; see parser_parse_function_body. Once parsed, the block is also the
+ * only child of the node. A body parsed late sees only the names that were
+ * bound at the definition, and the parameters of its prototype.
+ */
+struct cc_node_function_body {
+	size_t	begin;	/* position of the { */
+	size_t	end;	/* position after the } */
+	struct cc_node	*block;	/* null, until parsed */
+	struct cc_node	*parameters;	/* symbols of the prototype-scope */
+	int		num_bindings;	/* at the definition */
+};
+
 /* These entries are stored in scope-sym-tab[ordinary_ns] */
 struct cc_node_object {
 	struct cc_node	*type;
@@ -542,6 +582,7 @@ struct cc_node {
 		struct cc_node_symbol			*symbol;
 
 		struct cc_node_block			*block;
+		struct cc_node_function_body	*function_body;
 	} u;
 };
 
@@ -608,17 +649,157 @@ bool cc_node_is_symbol(const struct cc_node *this)
 {
 	return cc_node_type_is_symbol(cc_node_type(this));
 }
+/*****************************************************************************/
+/*
+ * The identifiers in scope, in all the name-spaces but the members. The
+ * bindings are kept in the order in which they were made, which also serves
+ * as the undo log: a scope ends by popping the bindings made within it. The
+ * buckets of the hash table are linked newest first, so that a lookup finds
+ * the innermost binding of a name, and a popped binding is always at the head
+ * of its bucket. Neither a lookup, nor a check for a redeclaration within the
+ * current scope, depends on the depth of the nesting.
+ */
+struct cc_binding {
+	const char	*name;
+	uint64_t	hash;		/* of the name and the name-space */
+	struct cc_node	*symbol;
+	enum cc_name_space_type	name_space;
+	int			next;		/* in the bucket; -1 at the end */
+};
+
+/* A scope that encloses the current one. */
+struct cc_scope_frame {
+	struct cc_node	*symbols;
+	int		num_bindings;	/* when the nested scope began */
+};
+
+struct cc_bindings {
+	struct cc_binding	*entries;
+	int		num_entries;
+	int		num_entries_allocated;
+	int		*buckets;
+	int		num_buckets;	/* a power of 2 */
+};
+/*****************************************************************************/
+/*
+ * A compact copy of the ast, built once the parse is done. The nodes are in
+ * pre-order, and are addressed by their indices into the parallel arrays. The
+ * children of a node are reached through first_child, and then through
+ * next_sibling. The payload of a node that has a spelling (an identifier, a
+ * number, a char-const or a string-literal) is the position of that spelling,
+ * nul-terminated, within chars; that of the others is CC_AST_NONE.
+ *
+ * Since it holds no pointers, the ast can be written out and read back as is.
+ */
+#define CC_AST_NONE	UINT32_MAX
+
+struct cc_ast {
+	uint16_t	*types;			/* enum cc_node_type */
+	uint32_t	*first_child;
+	uint32_t	*next_sibling;
+	uint32_t	*payloads;
+	uint32_t	num_nodes;
+	uint32_t	num_nodes_allocated;
+
+	char		*chars;
+	uint32_t	num_chars;
+	uint32_t	num_chars_allocated;
+};
 
 static inline
-err_t cc_node_add_tail_child(struct cc_node *this,
-							 struct cc_node *child)
+uint32_t cc_ast_num_nodes(const struct cc_ast *this)
 {
-	return ptrt_add_tail_child(&this->tree, child);
+	return this->num_nodes;
 }
+
+static inline
+enum cc_node_type cc_ast_type(const struct cc_ast *this,
+							  const uint32_t node)
+{
+	assert(node < this->num_nodes);
+	return this->types[node];
+}
+
+static inline
+uint32_t cc_ast_first_child(const struct cc_ast *this,
+							const uint32_t node)
+{
+	assert(node < this->num_nodes);
+	return this->first_child[node];
+}
+
+static inline
+uint32_t cc_ast_next_sibling(const struct cc_ast *this,
+							 const uint32_t node)
+{
+	assert(node < this->num_nodes);
+	return this->next_sibling[node];
+}
+
+/* Returns NULL if the node has no spelling */
+static inline
+const char *cc_ast_string(const struct cc_ast *this,
+						  const uint32_t node)
+{
+	assert(node < this->num_nodes);
+	if (this->payloads[node] == CC_AST_NONE)
+		return NULL;
+	return &this->chars[this->payloads[node]];
+}
+
+#define CC_AST_FOR_EACH_CHILD(ast, n, c)	\
+	for (c = cc_ast_first_child(ast, n);	\
+		 c != CC_AST_NONE;	\
+		 c = cc_ast_next_sibling(ast, c))
+
+/* A node of the tree being copied, and the next of its children to copy */
+struct cc_ast_frame {
+	const struct cc_node	*node;
+	uint32_t	index;
+	uint32_t	last_child;	/* copied so far */
+	int			next_child;
+};
+/*****************************************************************************/
+#define CC_AST_PRINTER_BUFFER_SIZE	(256 * 1024)
+
+/*
+ * The ast is printed without recursion; the stack holds the nodes whose
+ * children are being printed. The output is collected in the buffer, and
+ * written out only when the buffer is full. In the compact form, a node is
+ * separated from its previous sibling by a space, instead of by newlines.
+ */
+struct cc_ast_printer {
+	int		fd;
+	bool	is_compact;
+	struct val_queue	stack;	/* of uint32_t */
+	size_t	size;
+	char	*buffer;
+};
+/*****************************************************************************/
+#define CC_ARENA_CHUNK_SIZE	(64 * 1024)
+
+/*
+ * The nodes, the types, their payloads, and the arrays of their children and
+ * of the symbols, live as long as the parser does. They are carved out of
+ * large chunks, and are never freed individually; parser_delete frees the
+ * chunks.
+ */
+struct cc_arena {
+	struct ptr_queue	chunks;
+	char	*next;		/* the free space in the last chunk */
+	size_t	num_left;
+};
 /*****************************************************************************/
 struct parser {
 	struct cc_node	*root;		/* root of the ast */
 	struct cc_node	*symbols;	/* current sym-table */
+	struct cc_ast	ast;		/* compact copy of the ast */
+	struct cc_arena	arena;
+	struct cc_bindings	bindings;
+	struct cc_bindings	body_bindings;	/* for the bodies parsed late */
+	struct val_queue	scopes;		/* of cc_scope_frame */
+	struct cc_node	*prototype;	/* of the declarator being parsed */
+	bool	skip_function_bodies;
 
 	int	cpp_tokens_fd;
 	const char	*cpp_tokens_path;
@@ -6,6 +6,7 @@
 #define SRC_CC_TOKEN_H
 
 #include <inc/types.h>
+#include <inc/cpp/token_file.h>
 
 /*
  * Only terminals, including char-consts, string-literals, integer-consts,
@@ -141,6 +142,10 @@ struct cc_token {
 	 *
 	 * For string-literals and char-consts, this is their exec-char-set
 	 * representation.
+	 *
+	 * The string is never owned by the token. It points either into the
+	 * mapped cpp_tokens file, where each string is followed by its nul, or to
+	 * a static string. It remains valid until parser_delete.
 	 */
 	const char	*string;
 	size_t		string_len;	/* doesn't include the nul char */
@@ -245,15 +250,71 @@ bool cc_token_is_function_specifier(const struct cc_token *this)
 {
 	return cc_token_type_is_function_specifier(cc_token_type(this));
 }
-void	cc_token_delete(void *this);
 /*****************************************************************************/
+/*
+ * The tokens are allocated from arenas, and recycled through the free list;
+ * once the stream is warmed up, reading a token allocates nothing.
+ */
+#define CC_TOKEN_ARENA_SIZE	256
+
+struct cc_token_arena {
+	struct cc_token	tokens[CC_TOKEN_ARENA_SIZE];
+};
+
 struct cc_token_stream {
 	const char	*buffer;	/* file containing the cpp_tokens */
 	size_t		buffer_size;
 	size_t		position;
+	size_t		end;	/* of the records, or of the slice being read */
 	struct ptr_queue	q;
+	struct ptr_queue	arenas;
+	struct ptr_queue	free_tokens;
+
+	/*
+	 * The mapped #embed resource, being expanded into its byte-list. The
+	 * position counts the bytes and the commas between them.
+	 */
+	const unsigned char	*embed;
+	size_t		embed_size;
+	size_t		embed_position;
 };
 
+/* Returns the position of the index, from the end of the file. */
+static inline
+size_t cc_token_stream_index_position(const char *buffer,
+									  const size_t buffer_size)
+{
+	uint64_t position;
+
+	memcpy(&position, &buffer[buffer_size - sizeof(position)],
+		   sizeof(position));
+	return position;
+}
+
+/*
+ * Checks the header, and the trailer that a truncated file would lack; see
+ * inc/cpp/token_file.h
+ */
+static inline
+bool cc_token_stream_is_valid(const char *buffer,
+							  const size_t buffer_size)
+{
+	size_t position;
+	uint32_t version, byte_order;
+
+	if (buffer_size < TOKEN_FILE_HEADER_SIZE + 2 + sizeof(uint64_t) ||
+		memcmp(buffer, TOKEN_FILE_MAGIC, sizeof(TOKEN_FILE_MAGIC)))
+		return false;
+	memcpy(&version, &buffer[8], sizeof(version));
+	memcpy(&byte_order, &buffer[12], sizeof(byte_order));
+	if (version != TOKEN_FILE_VERSION || byte_order != TOKEN_FILE_BYTE_ORDER)
+		return false;
+	position = cc_token_stream_index_position(buffer, buffer_size);
+	return position > TOKEN_FILE_HEADER_SIZE &&
+		position <= buffer_size - sizeof(uint64_t) &&
+		(unsigned char)buffer[position - 1] == TOKEN_FILE_END;
+}
+
 static inline
 void cc_token_stream_init(struct cc_token_stream *this,
 						  const char *buffer,
@@ -261,8 +322,15 @@ void cc_token_stream_init(struct cc_token_stream *this,
 {
 	this->buffer = buffer;
 	this->buffer_size = buffer_size;
-	this->position = 0;
-	ptrq_init(&this->q, cc_token_delete);
+	this->position = TOKEN_FILE_HEADER_SIZE;
+	this->end = cc_token_stream_index_position(buffer, buffer_size) - 1;
+	this->embed = NULL;
+	this->embed_size = 0;
+	this->embed_position = 0;
+	/* The tokens in q and free_tokens are freed along with the arenas */
+	ptrq_init(&this->q, NULL);
+	ptrq_init(&this->free_tokens, NULL);
+	ptrq_init(&this->arenas, free);
 	/* Each entry in the queue is a pointer. */
 }
 #if 0
@@ -286,9 +354,93 @@ err_t cc_token_stream_add_head(struct cc_token_stream *this,
 	return ptrq_add_head(&this->q, token);
 }
 
+/*
+ * Reads the declaration boundaries. The first entry is the beginning of the
+ * first declaration. The caller frees the array. A boundary past the records
+ * is EINVAL.
+ */
+static inline
+err_t cc_token_stream_read_index(const struct cc_token_stream *this,
+								 struct token_file_boundary **out,
+								 size_t *out_num_entries)
+{
+	err_t err;
+	size_t i, index_position;
+	uint64_t num_entries, value;
+	const char *p, *end;
+	struct token_file_boundary *boundaries;
+
+	/* Not this->end + 1, which a seek moves to the end of a slice */
+	index_position = cc_token_stream_index_position(this->buffer,
+													this->buffer_size);
+	p = &this->buffer[index_position];
+	end = &this->buffer[this->buffer_size - sizeof(uint64_t)];
+	err = token_file_get_varint(&p, end, &num_entries);
+	if (err)
+		return err;
+	/* Each entry takes at least two bytes */
+	if (num_entries > (uint64_t)(end - p) / 2)
+		return EINVAL;
+	boundaries = malloc((num_entries + 1) * sizeof(*boundaries));
+	if (boundaries == NULL)
+		return ENOMEM;
+	boundaries[0].position = TOKEN_FILE_HEADER_SIZE;
+	boundaries[0].ordinal = 0;
+	for (i = 1; !err && i <= num_entries; ++i) {
+		err = token_file_get_varint(&p, end, &value);
+		if (!err && value >= index_position - boundaries[i - 1].position)
+			err = EINVAL;
+		if (!err)
+			boundaries[i].position = boundaries[i - 1].position + value;
+		if (!err)
+			err = token_file_get_varint(&p, end, &value);
+		if (!err)
+			boundaries[i].ordinal = boundaries[i - 1].ordinal + value;
+	}
+	if (err) {
+		free(boundaries);
+		return err;
+	}
+	*out = boundaries;
+	*out_num_entries = num_entries + 1;
+	return ESUCCESS;
+}
+
+/*
+ * Restricts the stream to the records from the boundary begin up to end; an
+ * end of NULL is the end of the records. The queue must be empty, so several
+ * streams, e.g. one per worker, can each read a slice of the same buffer.
+ */
+static inline
+void cc_token_stream_seek(struct cc_token_stream *this,
+						  const struct token_file_boundary *begin,
+						  const struct token_file_boundary *end)
+{
+	assert(ptrq_is_empty(&this->q));
+	assert(this->embed == NULL);
+	this->position = begin->position;
+	this->end = cc_token_stream_index_position(this->buffer,
+											   this->buffer_size) - 1;
+	if (end)
+		this->end = end->position;
+	assert(this->position <= this->end);
+}
+
+static inline
+void cc_token_stream_delete_token(struct cc_token_stream *this,
+								  struct cc_token *token)
+{
+	/* On ENOMEM, the token is only reclaimed with its arena */
+	ptrq_add_tail(&this->free_tokens, token);
+}
+
 static inline
 void cc_token_stream_empty(struct cc_token_stream *this)
 {
-	ptrq_empty(&this->q);
+	while (!ptrq_is_empty(&this->q))
+		ptrq_remove_head(&this->q);
+	while (!ptrq_is_empty(&this->free_tokens))
+		ptrq_remove_head(&this->free_tokens);
+	ptrq_empty(&this->arenas);
 }
 #endif
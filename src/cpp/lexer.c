@@ -101,6 +101,44 @@ const char *g_punctuators[] = {
 	"...",
 };
 
+/* Pairs of punctuators that paste into a single punctuator. */
+struct punctuator_paste {
+	enum lexer_token_type	left;
+	enum lexer_token_type	right;
+	enum lexer_token_type	result;
+};
+
+static const struct punctuator_paste g_punctuator_pastes[] = {
+	{LXR_TOKEN_HASH,		LXR_TOKEN_HASH,		LXR_TOKEN_DOUBLE_HASH},
+	{LXR_TOKEN_COLON,		LXR_TOKEN_COLON,	LXR_TOKEN_DOUBLE_COLON},
+	{LXR_TOKEN_PLUS,		LXR_TOKEN_PLUS,		LXR_TOKEN_INCR},
+	{LXR_TOKEN_MINUS,		LXR_TOKEN_MINUS,	LXR_TOKEN_DECR},
+	{LXR_TOKEN_MINUS,		LXR_TOKEN_GREATER_THAN,	LXR_TOKEN_ARROW},
+	{LXR_TOKEN_LESS_THAN,	LXR_TOKEN_LESS_THAN,	LXR_TOKEN_SHIFT_LEFT},
+	{LXR_TOKEN_GREATER_THAN,	LXR_TOKEN_GREATER_THAN,	LXR_TOKEN_SHIFT_RIGHT},
+	{LXR_TOKEN_BITWISE_OR,	LXR_TOKEN_BITWISE_OR,	LXR_TOKEN_LOGICAL_OR},
+	{LXR_TOKEN_BITWISE_AND,	LXR_TOKEN_BITWISE_AND,	LXR_TOKEN_LOGICAL_AND},
+
+	{LXR_TOKEN_ASSIGN,		LXR_TOKEN_ASSIGN,	LXR_TOKEN_EQUALS},
+	{LXR_TOKEN_LOGICAL_NOT,	LXR_TOKEN_ASSIGN,	LXR_TOKEN_NOT_EQUALS},
+	{LXR_TOKEN_LESS_THAN,	LXR_TOKEN_ASSIGN,	LXR_TOKEN_LESS_THAN_EQUALS},
+	{LXR_TOKEN_GREATER_THAN,	LXR_TOKEN_ASSIGN,	LXR_TOKEN_GREATER_THAN_EQUALS},
+	{LXR_TOKEN_MUL,			LXR_TOKEN_ASSIGN,	LXR_TOKEN_MUL_ASSIGN},
+	{LXR_TOKEN_DIV,			LXR_TOKEN_ASSIGN,	LXR_TOKEN_DIV_ASSIGN},
+	{LXR_TOKEN_MOD,			LXR_TOKEN_ASSIGN,	LXR_TOKEN_MOD_ASSIGN},
+	{LXR_TOKEN_PLUS,		LXR_TOKEN_ASSIGN,	LXR_TOKEN_PLUS_ASSIGN},
+	{LXR_TOKEN_MINUS,		LXR_TOKEN_ASSIGN,	LXR_TOKEN_MINUS_ASSIGN},
+	{LXR_TOKEN_BITWISE_AND,	LXR_TOKEN_ASSIGN,	LXR_TOKEN_BITWISE_AND_ASSIGN},
+	{LXR_TOKEN_BITWISE_OR,	LXR_TOKEN_ASSIGN,	LXR_TOKEN_BITWISE_OR_ASSIGN},
+	{LXR_TOKEN_BITWISE_XOR,	LXR_TOKEN_ASSIGN,	LXR_TOKEN_BITWISE_XOR_ASSIGN},
+
+	{LXR_TOKEN_SHIFT_LEFT,	LXR_TOKEN_ASSIGN,	LXR_TOKEN_SHIFT_LEFT_ASSIGN},
+	{LXR_TOKEN_SHIFT_RIGHT,	LXR_TOKEN_ASSIGN,	LXR_TOKEN_SHIFT_RIGHT_ASSIGN},
+	{LXR_TOKEN_LESS_THAN,	LXR_TOKEN_LESS_THAN_EQUALS,	LXR_TOKEN_SHIFT_LEFT_ASSIGN},
+	{LXR_TOKEN_GREATER_THAN,	LXR_TOKEN_GREATER_THAN_EQUALS,
+		LXR_TOKEN_SHIFT_RIGHT_ASSIGN},
+};
+
 /* These are all key-words for lexer. */
 const char *g_key_words[] = {
 	/* c-key-words */
@@ -232,6 +270,7 @@ err_t transform_new_lines(const char *src,
 	dst = malloc(src_size);
 	if (dst == NULL)
 		return ENOMEM;
+	stats_note_alloc(STATS_SUBSYSTEM_LEXER, src_size);
 
 	memset(&state, 0, sizeof(state));
 	ptr = src;
@@ -348,6 +387,21 @@ err0:
 	return err;
 }
 
+/* The buffer is not owned by the lexer initialized here. */
+static
+void lexer_init(struct lexer *this,
+				const char *buffer,
+				const off_t buffer_size)
+{
+	this->file_path = NULL;
+	this->dir_path = NULL;
+	this->buffer = buffer;
+	this->buffer_size = buffer_size;
+	this->position.lex_pos = 0;
+	this->position.file_row = 0;
+	this->position.file_col = 0;
+}
+
 err_t lexer_new(const char *path,
 				const char *buffer,
 				const off_t buffer_size,
@@ -362,14 +416,7 @@ err_t lexer_new(const char *path,
 		goto err0;
 	}
 
-	this->file_path = NULL;
-	this->dir_path = NULL;
-	this->buffer = buffer;
-	this->buffer_size = buffer_size;
-	this->position.lex_pos = 0;
-	this->position.file_row = 0;
-	this->position.file_col = 0;
-
+	lexer_init(this, buffer, buffer_size);
 	err = ESUCCESS;
 	if (path)
 		err = lexer_read_file(this, path);
@@ -424,7 +471,7 @@ err_t lexer_token_resolve(struct lexer_token *this)
 	char *resolved;
 	char code_units[4];
 	const char *src;
-	struct lexer *lexer;
+	struct lexer _lexer, *lexer;
 	size_t i, src_len, size, lex_size, j;
 	struct code_point cp;
 	enum char_const_escape_type esc_type;
@@ -432,9 +479,8 @@ err_t lexer_token_resolve(struct lexer_token *this)
 
 	src = lexer_token_source(this);
 	src_len = lexer_token_source_length(this);
-	err = lexer_new(NULL, src, src_len, &lexer);
-	if (err)
-		return err;
+	lexer = &_lexer;
+	lexer_init(lexer, src, src_len);
 
 	/* Determine the size of the resolved string */
 	for (i = size = 0; i < src_len;) {
@@ -465,13 +511,11 @@ err_t lexer_token_resolve(struct lexer_token *this)
 		size += cp.cp_size;
 	}
 	this->resolved_len = size;
-	free(lexer);
-	err = lexer_new(NULL, src, src_len, &lexer);
-	if (err)
-		return err;
+	lexer_init(lexer, src, src_len);	/* Rewind */
 	resolved = malloc(size + 1);
 	if (resolved == NULL)
 		return ENOMEM;
+	stats_note_alloc(STATS_SUBSYSTEM_LEXER, size + 1);
 	resolved[size] = NULL_CHAR;
 
 	for (i = j = 0; i < src_len;) {
@@ -498,7 +542,6 @@ err_t lexer_token_resolve(struct lexer_token *this)
 		memcpy(&resolved[j], code_units, cp.cp_size);
 		j += cp.cp_size;	/* Incr. output by the utf-8 enc-size */
 	}
-	free(lexer);
 	this->resolved = resolved;
 	return ESUCCESS;
 }
@@ -561,6 +604,7 @@ sourced:
 	string = malloc(size + 1);
 	if (string == NULL)
 		return ENOMEM;
+	stats_note_alloc(STATS_SUBSYSTEM_LEXER, size + 1);
 
 	save = this->position;	/* Save the current position */
 	this->position = this->begin;	/* Rewind */
@@ -1013,6 +1057,7 @@ err_t lexer_build_token_string(struct lexer *this,
 		err = ENOMEM;
 		goto err0;
 	}
+	stats_note_alloc(STATS_SUBSYSTEM_LEXER, token->lex_size + 1);
 
 	save = this->position;	/* Save the current position */
 
@@ -1771,7 +1816,7 @@ err_t lexer_token_evaluate_char_const(const struct lexer_token *this,
 	int src_len, index;
 	enum lexer_token_type type;
 	struct code_point cp;
-	struct lexer *lexer;
+	struct lexer _lexer, *lexer;
 	enum char_const_escape_type esc_type;
 
 	assert(lexer_token_source(this));
@@ -1789,9 +1834,8 @@ err_t lexer_token_evaluate_char_const(const struct lexer_token *this,
 	src_len = (int)lexer_token_source_length(this);
 	src_len -= index;
 	src_len -= 1;	/* for the terminating delim */
-	err = lexer_new(NULL, &src[index], src_len, &lexer);
-	if (err)
-		return err;
+	lexer = &_lexer;
+	lexer_init(lexer, &src[index], src_len);
 
 	err = lexer_peek_code_point(lexer, &cp);
 	if (err)
@@ -1803,7 +1847,6 @@ err_t lexer_token_evaluate_char_const(const struct lexer_token *this,
 		err = lexer_peek_code_point(lexer, &cp);
 		if (err != EOF)
 			return EINVAL;
-		free(lexer);
 		return ESUCCESS;
 	}
 
@@ -1819,7 +1862,6 @@ err_t lexer_token_evaluate_char_const(const struct lexer_token *this,
 	err = lexer_peek_code_point(lexer, &cp);
 	if (err != EOF)
 		return EINVAL;
-	free(lexer);
 	return ESUCCESS;
 }
 
@@ -2793,6 +2835,7 @@ err_t lexer_lex_token(struct lexer *this,
 	token = malloc(sizeof(*token));
 	if (token == NULL)
 		return ENOMEM;
+	stats_note_alloc(STATS_SUBSYSTEM_LEXER, sizeof(*token));
 
 	*out = token;
 	lexer_token_init(token);
@@ -2805,3 +2848,158 @@ err_t lexer_lex_token(struct lexer *this,
 		lexer_token_deref(token);
 	return err;
 }
+
+/*
+ * Re-lex a buffer that must hold exactly one token; used for pasting and
+ * stringizing. The lexer lives on the stack, and the buffer remains owned by
+ * the caller; the token does not point into it. The buffer must end with a
+ * new-line. Returns EOF if the buffer has no token, and EINVAL if it has more
+ * than one.
+ */
+err_t lexer_lex_from_buffer(const char *buffer,
+							const off_t buffer_size,
+							struct lexer_token **out)
+{
+	err_t err;
+	struct lexer lexer;
+	struct lexer_token *token, *next;
+
+	lexer_init(&lexer, buffer, buffer_size);
+	err = lexer_lex_token(&lexer, &token);
+	if (err)
+		return err;
+	err = lexer_lex_token(&lexer, &next);
+	if (!err) {
+		lexer_token_deref(next);
+		err = EINVAL;
+	}
+	if (err != EOF) {
+		lexer_token_deref(token);
+		return err;
+	}
+	*out = token;
+	return ESUCCESS;
+}
+
+/*
+ * Paste two punctuators through g_punctuator_pastes. Returns EINVAL if the
+ * pair does not form a punctuator. As with a re-lexed token, the result is
+ * the first token on its line, without any white-space before it.
+ */
+err_t lexer_token_paste_punctuators(const struct lexer_token *left,
+									const struct lexer_token *right,
+									struct lexer_token **out)
+{
+	int i;
+	enum lexer_token_type type;
+	struct lexer_token *this;
+	const struct punctuator_paste *paste;
+
+	assert(lexer_token_is_punctuator(left));
+	assert(lexer_token_is_punctuator(right));
+	for (i = 0; i < (int)ARRAY_SIZE(g_punctuator_pastes); ++i) {
+		paste = &g_punctuator_pastes[i];
+		if (paste->left == lexer_token_type(left) &&
+			paste->right == lexer_token_type(right))
+			break;
+	}
+	if (i == (int)ARRAY_SIZE(g_punctuator_pastes))
+		return EINVAL;
+
+	this = malloc(sizeof(*this));
+	if (this == NULL)
+		return ENOMEM;
+	lexer_token_init(this);	/* ref-count == 1 */
+	type = paste->result;
+	this->type = type;
+	this->is_first = true;
+	this->source = this->resolved = g_punctuators[type - LXR_TOKEN_LEFT_BRACE];
+	this->source_len = this->resolved_len = strlen(this->source);
+	this->lex_size = this->source_len;
+	*out = this;
+	return ESUCCESS;
+}
+
+/*
+ * Build a token from its parts, without lexing; used when restoring a
+ * precompiled header. Punctuators and key-words point to the static strings,
+ * as they do when lexed; the strings of the others are copied, and nul
+ * terminated. source and resolved need not be nul terminated.
+ */
+err_t lexer_token_new(const enum lexer_token_type type,
+					  const char *source,
+					  const size_t source_len,
+					  const char *resolved,
+					  const size_t resolved_len,
+					  struct lexer_token **out)
+{
+	err_t err;
+	char *str[2];
+	const char *static_str;
+	struct lexer_token *this;
+
+	this = malloc(sizeof(*this));
+	if (this == NULL)
+		return ENOMEM;
+	lexer_token_init(this);	/* ref-count == 1 */
+	this->type = type;
+
+	if (lexer_token_is_punctuator(this) ||
+		type == LXR_TOKEN_NON_STRINGIZING_DOUBLE_HASH) {
+		if (type == LXR_TOKEN_NON_STRINGIZING_DOUBLE_HASH)
+			static_str = g_punctuators[LXR_TOKEN_DOUBLE_HASH -
+									   LXR_TOKEN_LEFT_BRACE];
+		else
+			static_str = g_punctuators[type - LXR_TOKEN_LEFT_BRACE];
+		goto sourced;
+	}
+	if (lexer_token_is_key_word(this)) {
+		static_str = g_key_words[type - LXR_TOKEN_ATOMIC];
+		goto sourced;
+	}
+
+	if (type != LXR_TOKEN_NUMBER &&
+		type != LXR_TOKEN_IDENTIFIER &&
+		!lexer_token_is_char_const(this) &&
+		!lexer_token_is_string_literal(this)) {
+		/* place-markers, etc., carry no strings */
+		err = EINVAL;
+		if (source_len || resolved_len)
+			goto err0;
+		*out = this;
+		return ESUCCESS;
+	}
+
+	err = ENOMEM;
+	str[0] = malloc(source_len + 1);
+	if (str[0] == NULL)
+		goto err0;
+	memcpy(str[0], source, source_len);
+	str[0][source_len] = NULL_CHAR;
+
+	str[1] = str[0];
+	if (resolved != source) {
+		str[1] = malloc(resolved_len + 1);
+		if (str[1] == NULL)
+			goto err1;
+		memcpy(str[1], resolved, resolved_len);
+		str[1][resolved_len] = NULL_CHAR;
+	}
+	this->source = str[0];
+	this->source_len = this->lex_size = source_len;
+	this->resolved = str[1];
+	this->resolved_len = resolved_len;
+	*out = this;
+	return ESUCCESS;
+sourced:
+	this->source = this->resolved = static_str;
+	this->source_len = this->resolved_len = strlen(static_str);
+	this->lex_size = this->source_len;
+	*out = this;
+	return ESUCCESS;
+err1:
+	free(str[0]);
+err0:
+	free(this);
+	return err;
+}
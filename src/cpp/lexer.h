@@ -6,6 +6,7 @@
 #define SRC_CPP_LEXER_H
 
 #include <inc/cpp/lexer.h>
+#include <inc/stats.h>
 
 struct code_point {
 	struct lexer_position	begin;
@@ -4,6 +4,7 @@
 
 #include "scanner.h"
 #include <inc/unicode.h>
+#include <inc/cpp/token_file.h>
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -11,14 +12,72 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <linux/limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <utime.h>
+#include <time.h>
+#include <stdarg.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 static
 err_t scanner_scan_file(struct scanner *this,
 						const char *path);
 static
+err_t scanner_lex_file(struct scanner *this,
+					   const char *path,
+					   const bool is_main);
+static
+void pch_dep_delete(void *p);
+static
+void include_recorder_delete(void *p);
+static
+void include_lookup_delete(void *p);
+static
+void if_result_delete(void *p);
+static
+void macro_profile_delete(void *p);
+static
+void include_trace_header_delete(void *p);
+static
+err_t scanner_begin_include_trace(struct scanner *this,
+								  const char *path);
+static
+err_t scanner_end_include_trace(struct scanner *this);
+static
+err_t scanner_evaluate_has_include(struct scanner *this,
+								   const enum lexer_token_type type,
+								   const bool is_next,
+								   struct cpp_tokens *line,
+								   const char *dir_path,
+								   int *out);
+static
+err_t scanner_note_file_read(struct scanner *this,
+							 const char *path);
+static
+void scanner_note_macro_read(const struct scanner *this,
+							 const char *name,
+							 const struct macro *macro);
+static
+void scanner_note_macro_write(struct scanner *this,
+							  const char *name,
+							  const struct macro *macro);
+static
+void scanner_note_if_macro_read(const struct scanner *this,
+								const char *name,
+								const struct macro *macro);
+static
+err_t scanner_scan_include_cached(struct scanner *this,
+								  const char *path);
+static
 const struct macro *scanner_find_macro(const struct scanner *this,
 									   const char *ident);
 static
+err_t scanner_serialize_cpp_token(struct scanner *this,
+								  const struct cpp_token *token);
+static
 err_t cpp_token_stream_remove_head(struct cpp_token_stream *this,
 								   struct cpp_token **out);
 static
@@ -52,6 +111,141 @@ static
 int __attribute__((noinline)) break_point_func() {return 0;}
 #endif
 /*****************************************************************************/
+static
+void token_spellings_init(struct token_spellings *this)
+{
+	this->entries = NULL;
+	this->num_entries = this->num_entries_allocated = 0;
+	this->chars = NULL;
+	this->chars_size = this->chars_allocated = 0;
+	this->position = 0;
+}
+
+static
+void token_spellings_empty(struct token_spellings *this)
+{
+	free(this->entries);
+	free(this->chars);
+	token_spellings_init(this);
+}
+
+static
+void token_spellings_reset(struct token_spellings *this,
+						   const off_t position)
+{
+	if (this->num_entries)
+		memset(this->entries, 0,
+			   this->num_entries_allocated * sizeof(*this->entries));
+	this->num_entries = 0;
+	this->chars_size = 0;
+	this->position = position;
+}
+
+static
+struct token_spelling *token_spellings_find(const struct token_spellings *this,
+											const char *str,
+											const size_t len,
+											const uint64_t hash)
+{
+	size_t i, mask;
+	struct token_spelling *entry;
+
+	mask = this->num_entries_allocated - 1;
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		entry = &this->entries[i];
+		if (entry->pos == 0)
+			return entry;
+		if (entry->hash == hash && entry->len == len &&
+			!memcmp(&this->chars[entry->offset], str, len))
+			return entry;
+	}
+}
+
+/* Keeps the load under a half. */
+static
+err_t token_spellings_grow(struct token_spellings *this)
+{
+	size_t i, num_entries;
+	struct token_spelling *entries, *entry;
+
+	num_entries = this->num_entries_allocated;
+	entries = this->entries;
+	this->num_entries_allocated = num_entries ? num_entries * 2 : 1024;
+	this->entries = calloc(this->num_entries_allocated, sizeof(*entries));
+	if (this->entries == NULL) {
+		this->entries = entries;
+		this->num_entries_allocated = num_entries;
+		return ENOMEM;
+	}
+	stats_note_alloc(STATS_SUBSYSTEM_SCANNER,
+					 this->num_entries_allocated * sizeof(*entries));
+	for (i = 0; i < num_entries; ++i) {
+		if (entries[i].pos == 0)
+			continue;
+		entry = token_spellings_find(this, &this->chars[entries[i].offset],
+									 entries[i].len, entries[i].hash);
+		*entry = entries[i];
+	}
+	free(entries);
+	return ESUCCESS;
+}
+
+/*
+ * Returns the position of the earlier definition of the spelling, or 0 after
+ * noting that it is defined at pos.
+ */
+static
+err_t token_spellings_add(struct token_spellings *this,
+						  const char *str,
+						  const size_t len,
+						  const off_t pos,
+						  off_t *out)
+{
+	err_t err;
+	size_t i, size;
+	uint64_t hash;
+	char *chars;
+	struct token_spelling *entry;
+
+	hash = 0xcbf29ce484222325ull;	/* FNV-1a */
+	for (i = 0; i < len; ++i) {
+		hash ^= (uint8_t)str[i];
+		hash *= 0x100000001b3ull;
+	}
+
+	if (2 * (this->num_entries + 1) > this->num_entries_allocated) {
+		err = token_spellings_grow(this);
+		if (err)
+			return err;
+	}
+	entry = token_spellings_find(this, str, len, hash);
+	if (entry->pos) {
+		*out = entry->pos;
+		return ESUCCESS;
+	}
+
+	if (this->chars_size + len > this->chars_allocated) {
+		size = 2 * this->chars_allocated;
+		if (size < this->chars_size + len)
+			size = this->chars_size + len + 65536;
+		chars = realloc(this->chars, size);
+		if (chars == NULL)
+			return ENOMEM;
+		stats_note_alloc(STATS_SUBSYSTEM_SCANNER, size);
+		this->chars = chars;
+		this->chars_allocated = size;
+	}
+	memcpy(&this->chars[this->chars_size], str, len);
+	entry->hash = hash;
+	entry->offset = this->chars_size;
+	entry->len = len;
+	entry->pos = pos;
+	this->chars_size += len;
+	++this->num_entries;
+	*out = 0;
+	return ESUCCESS;
+}
+/*****************************************************************************/
 err_t scanner_new(struct scanner **out)
 {
 	int i;
@@ -64,9 +258,37 @@ err_t scanner_new(struct scanner **out)
 
 	macros_init(&this->macros);
 	cond_incl_stack_init(&this->cistk);
+	lexed_files_init(&this->lexed_files);
 
 	this->cpp_tokens_path = NULL;
 	this->cpp_tokens_fd = -1;
+	token_spellings_init(&this->token_spellings);
+	this->command_line_macros = NULL;
+	this->command_line_macros_size = 0;
+	this->prefix_header_path = NULL;
+	this->pch_path = NULL;
+	ptrq_init(&this->pch_deps, pch_dep_delete);
+	this->is_recording_pch_deps = false;
+	this->include_cache_dir = NULL;
+	this->include_cache_size = 0;
+	ptrq_init(&this->include_recorders, include_recorder_delete);
+	ptrq_init(&this->include_lookups, include_lookup_delete);
+	ptrq_init(&this->if_results, if_result_delete);
+	this->if_recorder = NULL;
+	this->macros_generation = 0;
+	this->num_if_hits = this->num_if_misses = 0;
+	this->macro_profile_path = NULL;
+	ptrq_init(&this->macro_profiles, macro_profile_delete);
+	this->macro_profile_nested_cycles = 0;
+	this->include_trace_path = NULL;
+	valq_init(&this->include_trace_frames, sizeof(struct include_trace_frame),
+			  NULL);
+	ptrq_init(&this->include_trace_headers, include_trace_header_delete);
+	ptrq_init(&this->include_trace_events, free);
+	this->num_bytes_lexed = 0;
+	this->num_tokens_lexed = 0;
+	this->num_tokens_emitted = 0;
+	this->cache = NULL;
 	this->is_running_predefined_macros = true;
 
 	this->include_paths[0] = "/usr/include";
@@ -94,9 +316,24 @@ err_t scanner_delete(struct scanner *this)
 	close(this->cpp_tokens_fd);
 	/*unlink(this->cpp_tokens_path);*/
 	free((void *)this->cpp_tokens_path);
+	token_spellings_empty(&this->token_spellings);
+	free(this->command_line_macros);
+	free((void *)this->prefix_header_path);
+	free((void *)this->pch_path);
+	ptrq_empty(&this->pch_deps);
+	ptrq_empty(&this->include_lookups);
+	ptrq_empty(&this->if_results);
+	free((void *)this->macro_profile_path);
+	ptrq_empty(&this->macro_profiles);
+	free((void *)this->include_trace_path);
+	ptrq_empty(&this->include_trace_events);
+	ptrq_empty(&this->include_trace_headers);
+	free((void *)this->include_cache_dir);
+	assert(ptrq_is_empty(&this->include_recorders));
 
 	assert(cond_incl_stack_num_entries(&this->cistk) == 0);
 	macros_empty(&this->macros);
+	lexed_files_empty(&this->lexed_files);
 	free(this);
 	return ESUCCESS;
 }
@@ -106,6 +343,317 @@ const char *scanner_cpp_tokens_path(const struct scanner *this)
 	return this->cpp_tokens_path;
 }
 /*****************************************************************************/
+/* The file of cpp-tokens. See inc/cpp/token_file.h for its format. */
+static
+err_t scanner_write_cpp_tokens(struct scanner *this,
+							   const void *buf,
+							   size_t size)
+{
+	ssize_t ret;
+	const char *p = buf;
+
+	while (size) {
+		ret = write(this->cpp_tokens_fd, p, size);
+		if (ret < 0)
+			return errno;
+		this->token_spellings.position += ret;
+		p += ret;
+		size -= ret;
+	}
+	return ESUCCESS;
+}
+
+/* Called wherever the file is written or recorded other than by a record. */
+static
+err_t scanner_reset_token_spellings(struct scanner *this)
+{
+	off_t pos;
+
+	pos = lseek(this->cpp_tokens_fd, 0, SEEK_CUR);
+	if (pos < 0)
+		return errno;
+	token_spellings_reset(&this->token_spellings, pos);
+	return ESUCCESS;
+}
+
+static
+err_t scanner_write_cpp_tokens_header(struct scanner *this)
+{
+	uint32_t value;
+	char header[TOKEN_FILE_HEADER_SIZE];
+
+	memcpy(header, TOKEN_FILE_MAGIC, sizeof(TOKEN_FILE_MAGIC));
+	value = TOKEN_FILE_VERSION;
+	memcpy(&header[8], &value, sizeof(value));
+	value = TOKEN_FILE_BYTE_ORDER;
+	memcpy(&header[12], &value, sizeof(value));
+	token_spellings_reset(&this->token_spellings, 0);
+	return scanner_write_cpp_tokens(this, header, sizeof(header));
+}
+
+/*
+ * Moves *buffer past the record at it. The records may have been replayed from
+ * the include cache or the pch; one that runs into end is EINVAL.
+ */
+static
+err_t token_file_skip_record(const char **buffer,
+							 const char *end)
+{
+	err_t err;
+	uint64_t value;
+	const char *p;
+	enum lexer_token_type type;
+
+	p = *buffer;
+	type = (unsigned char)*p++;
+	if ((type >= LXR_TOKEN_ATOMIC && type <= LXR_TOKEN_DIRECTIVE_WARNING) ||
+		(type >= LXR_TOKEN_LEFT_BRACE && type <= LXR_TOKEN_ELLIPSIS)) {
+		*buffer = p;
+		return ESUCCESS;
+	}
+
+	err = token_file_get_varint(&p, end, &value);
+	if (!err && type == LXR_TOKEN_EMBED) {
+		if (value >= (uint64_t)(end - p))
+			return EINVAL;
+		p += value + 1;	/* the path and its nul */
+		err = token_file_get_varint(&p, end, &value);
+	} else if (!err && value == 0) {
+		/* Not a ref to an earlier definition */
+		err = token_file_get_varint(&p, end, &value);
+		if (!err && value >= (uint64_t)(end - p))
+			err = EINVAL;
+		if (!err)
+			p += value + 1;	/* the spelling and its nul */
+	}
+	if (!err)
+		*buffer = p;
+	return err;
+}
+
+/*
+ * Appends to out the index of the top-level declaration boundaries in the
+ * records of the buffer. A boundary follows a ; at a brace and paren depth of
+ * 0, or a } that closes a function body, i.e. a { at depth 0 after a ). The
+ * records are walked only after all of them are written, since those replayed
+ * from the include cache and the pch were never seen one by one.
+ *
+ * The ) before a body closes a parameter-list. In the head of a struct, union
+ * or enum, a ( that is followed by another ( is taken to begin an attribute,
+ * as in struct __attribute__((packed)) {; any other ( begins the parameters
+ * of a declarator, as in struct s f(void) {, and ends the head.
+ */
+static
+err_t token_file_index(const char *buffer,
+					   const size_t size,
+					   unsigned char **out,
+					   size_t *out_size,
+					   uint64_t *out_num_entries)
+{
+	err_t err;
+	size_t pos, num_allocated, index_size;
+	int num_braces, num_parens, num_brackets;
+	bool is_body, is_boundary, has_assign, is_tag_head, is_top;
+	uint64_t ordinal, prev_pos, prev_ordinal, num_entries;
+	unsigned char *index, *p;
+	const char *record;
+	enum lexer_token_type type, prev;
+
+	index = NULL;
+	index_size = num_allocated = 0;
+	num_entries = 0;
+	num_braces = num_parens = num_brackets = 0;
+	is_body = has_assign = is_tag_head = false;
+	prev = LXR_TOKEN_SEMI_COLON;
+	prev_pos = TOKEN_FILE_HEADER_SIZE;
+	prev_ordinal = 0;
+	for (pos = TOKEN_FILE_HEADER_SIZE, ordinal = 1; pos < size; ++ordinal) {
+		type = (unsigned char)buffer[pos];
+		record = &buffer[pos];
+		err = token_file_skip_record(&record, &buffer[size]);
+		if (err) {
+			free(index);
+			return err;
+		}
+		pos = record - buffer;
+
+		is_boundary = false;
+		is_top = num_braces == 0 && num_parens == 0 && num_brackets == 0;
+		if (type == LXR_TOKEN_LEFT_PAREN) {
+			if (is_top && is_tag_head &&
+				(pos == size || buffer[pos] != LXR_TOKEN_LEFT_PAREN))
+				is_tag_head = false;
+			++num_parens;
+		} else if (type == LXR_TOKEN_RIGHT_PAREN && num_parens) {
+			--num_parens;
+		} else if (type == LXR_TOKEN_LEFT_BRACKET) {
+			++num_brackets;
+		} else if (type == LXR_TOKEN_RIGHT_BRACKET && num_brackets) {
+			--num_brackets;
+		} else if (type == LXR_TOKEN_LEFT_BRACE) {
+			/*
+			 * Not the braces of an initializer, e.g. = (struct s){0}, nor of
+			 * a compound-literal within an array-bound, nor of a tag.
+			 */
+			if (num_braces++ == 0)
+				is_body = is_top && prev == LXR_TOKEN_RIGHT_PAREN &&
+					!has_assign && !is_tag_head;
+			if (is_top)
+				is_tag_head = false;
+		} else if (type == LXR_TOKEN_RIGHT_BRACE && num_braces) {
+			is_boundary = --num_braces == 0 && is_body;
+		} else if (type == LXR_TOKEN_SEMI_COLON) {
+			is_boundary = is_top;
+		} else if (type == LXR_TOKEN_ASSIGN) {
+			has_assign |= is_top;
+		} else if (type == LXR_TOKEN_STRUCT || type == LXR_TOKEN_UNION ||
+				   type == LXR_TOKEN_ENUM) {
+			is_tag_head |= is_top;
+		}
+		prev = type;
+		if (is_boundary)
+			has_assign = is_tag_head = false;
+		if (!is_boundary || pos == size)
+			continue;
+
+		if (index_size + 2 * TOKEN_FILE_VARINT_MAX > num_allocated) {
+			num_allocated = 2 * num_allocated + 4096;
+			p = realloc(index, num_allocated);
+			if (p == NULL) {
+				free(index);
+				return ENOMEM;
+			}
+			stats_note_alloc(STATS_SUBSYSTEM_SCANNER, num_allocated);
+			index = p;
+		}
+		index_size += token_file_put_varint(&index[index_size],
+											pos - prev_pos);
+		index_size += token_file_put_varint(&index[index_size],
+											ordinal - prev_ordinal);
+		prev_pos = pos;
+		prev_ordinal = ordinal;
+		++num_entries;
+	}
+	assert(pos == size);
+	*out = index;
+	*out_size = index_size;
+	*out_num_entries = num_entries;
+	return ESUCCESS;
+}
+
+static
+err_t scanner_write_cpp_tokens_end(struct scanner *this)
+{
+	err_t err;
+	off_t end;
+	size_t size, index_size;
+	uint64_t num_entries, index_pos;
+	void *buffer;
+	unsigned char *index, buf[1 + TOKEN_FILE_VARINT_MAX];
+
+	end = lseek(this->cpp_tokens_fd, 0, SEEK_CUR);
+	if (end < 0)
+		return errno;
+	buffer = mmap(NULL, end, PROT_READ, MAP_SHARED, this->cpp_tokens_fd, 0);
+	if (buffer == MAP_FAILED)
+		return errno;
+	err = token_file_index(buffer, end, &index, &index_size, &num_entries);
+	munmap(buffer, end);
+	if (err)
+		return err;
+
+	buf[0] = TOKEN_FILE_END;
+	size = 1 + token_file_put_varint(&buf[1], num_entries);
+	index_pos = end + 1;
+	err = scanner_write_cpp_tokens(this, buf, size);
+	if (!err && index_size)
+		err = scanner_write_cpp_tokens(this, index, index_size);
+	if (!err)
+		err = scanner_write_cpp_tokens(this, &index_pos, sizeof(index_pos));
+	free(index);
+	return err;
+}
+
+/* Writes the spelling as a ref; the record's type is already in buf. */
+static
+err_t scanner_write_cpp_tokens_spelling(struct scanner *this,
+										unsigned char *buf,
+										size_t size,
+										const char *str,
+										const size_t len)
+{
+	err_t err;
+	off_t pos, def_pos;
+
+	/* A ref of 0 is a single byte; the definition follows it. */
+	pos = this->token_spellings.position + size;
+	err = token_spellings_add(&this->token_spellings, str, len, pos + 1,
+							  &def_pos);
+	if (err)
+		return err;
+	if (def_pos) {
+		size += token_file_put_varint(&buf[size], pos - def_pos);
+		return scanner_write_cpp_tokens(this, buf, size);
+	}
+
+	buf[size++] = 0;
+	size += token_file_put_varint(&buf[size], len);
+	err = scanner_write_cpp_tokens(this, buf, size);
+	/* The spellings are nul-terminated, except perhaps a foreign one. */
+	if (!err && str[len] == 0)
+		return scanner_write_cpp_tokens(this, str, len + 1);
+	if (!err)
+		err = scanner_write_cpp_tokens(this, str, len);
+	if (!err)
+		err = scanner_write_cpp_tokens(this, "", 1);
+	return err;
+}
+
+/* The memoized #if/#elif conditions. */
+void scanner_if_cache_stats(const struct scanner *this,
+							size_t *out_num_hits,
+							size_t *out_num_misses)
+{
+	*out_num_hits = this->num_if_hits;
+	*out_num_misses = this->num_if_misses;
+}
+
+/* The cache is owned by the caller, and must outlive the scanner. */
+void scanner_set_cache(struct scanner *this,
+					   const struct scanner_cache *cache)
+{
+	this->cache = cache;
+}
+
+/*
+ * The paths, each nul terminated, of the files this scanner lexed and
+ * recorded itself; the compile server adds them to its cache.
+ */
+err_t scanner_write_lexed_paths(const struct scanner *this,
+								const int fd)
+{
+	int i;
+	ssize_t ret;
+	const char *str;
+	size_t size;
+	const struct lexed_file *file;
+
+	LEXED_FILES_FOR_EACH(&this->lexed_files, i, file) {
+		if (!file->is_complete)
+			continue;
+		str = file->path;
+		size = strlen(str) + 1;
+		while (size) {
+			ret = write(fd, str, size);
+			if (ret < 0)
+				return errno;
+			str += ret;
+			size -= ret;
+		}
+	}
+	return ESUCCESS;
+}
+/*****************************************************************************/
 static
 int scanner_find_macro_index(const struct scanner *this,
 							 const char *ident)
@@ -119,9 +667,13 @@ int scanner_find_macro_index(const struct scanner *this,
 		assert(macro);
 		name[1] = cpp_token_resolved(macro->identifier);
 		if (!strcmp(name[0], name[1]))
-			return i;
+			break;
 	}
-	return EOF;
+	if (!ptrq_is_empty(&this->include_recorders))
+		scanner_note_macro_read(this, ident, macro);
+	if (this->if_recorder)
+		scanner_note_if_macro_read(this, ident, macro);
+	return macro ? i : EOF;
 }
 
 static
@@ -138,6 +690,10 @@ static
 void cpp_token_delete(void *p)
 {
 	struct cpp_token *this = p;
+
+	assert(this->ref_count > 0);
+	if (--this->ref_count)
+		return;
 	lexer_token_deref(this->base);
 	free(this);
 }
@@ -152,8 +708,10 @@ err_t cpp_token_new(struct lexer_token *base,
 	this = malloc(sizeof(*this));
 	if (this == NULL)
 		return ENOMEM;
+	stats_note_alloc(STATS_SUBSYSTEM_SCANNER, sizeof(*this));
 
 	this->base = base;	/* Move lexer's ref-count into token */
+	this->ref_count = 1;
 	this->is_marked = false;
 	this->is_first = base->is_first;
 	this->has_white_space = base->has_white_space;
@@ -179,6 +737,76 @@ err_t cpp_token_copy(struct cpp_token *this,
 	return err;
 }
 
+static
+struct cpp_token *cpp_token_share(struct cpp_token *this)
+{
+	++this->ref_count;
+	return this;
+}
+
+/*
+ * Call before changing the properties of a token that may be shared. If the
+ * token is shared, *io is replaced by a private copy, and the reference to the
+ * shared token is dropped.
+ */
+static
+err_t cpp_token_make_writable(struct cpp_token **io)
+{
+	err_t err;
+	struct cpp_token *token;
+
+	if (io[0]->ref_count == 1)
+		return ESUCCESS;
+	err = cpp_token_copy(io[0], &token);
+	if (err)
+		return err;
+	cpp_token_delete(io[0]);
+	io[0] = token;
+	return ESUCCESS;
+}
+
+/*
+ * Pasting, stringizing and numbers from #if, re-lex a small buffer into a
+ * single token. Buffers that fit are built within a scratch array on the
+ * caller's stack.
+ */
+#define CPP_TOKEN_SCRATCH_SIZE	128
+
+static
+char *cpp_token_scratch_alloc(char *scratch,
+							  const size_t size)
+{
+	if (size <= CPP_TOKEN_SCRATCH_SIZE)
+		return scratch;
+	return malloc(size);
+}
+
+static
+void cpp_token_scratch_free(char *scratch,
+							char *str)
+{
+	if (str != scratch)
+		free(str);
+}
+
+/* The buffer must end with a new-line; len includes the new-line. */
+static
+err_t cpp_token_new_from_buffer(const char *buffer,
+								const int len,
+								struct cpp_token **out)
+{
+	err_t err;
+	struct lexer_token *base;
+
+	err = lexer_lex_from_buffer(buffer, len, &base);
+	if (err)
+		return err;
+	err = cpp_token_new(base, out);	/* move lexer's ref */
+	if (err)
+		lexer_token_deref(base);
+	return err;
+}
+
 /* has_white_space arrives from the token that num is supposed to replace. */
 err_t cpp_token_new_number(const int num,
 						   const bool has_white_space,
@@ -186,43 +814,17 @@ err_t cpp_token_new_number(const int num,
 						   struct cpp_token **out)
 {
 	err_t err;
-	int num_digits, n, len;
-	char *str;
-	struct lexer *lexer;
-	struct cpp_token_stream stream;
+	int len;
+	char str[CPP_TOKEN_SCRATCH_SIZE];
 	struct cpp_token *this;
 
 	assert(num >= 0);	/* For now */
 
-	num_digits = 0;
-	n = num;
-	while (n) {
-		++num_digits;
-		n /= 10;
-	}
-	if (num_digits == 0) {
-		assert(num == 0);
-		num_digits = 1;
-	}
-
-	len = num_digits + 1;	/* nl */
-	str = malloc(len + 1);	/* nul */
-	if (str == NULL)
-		return ENOMEM;
-	sprintf(str, "%d", num);
-	str[len - 1] = '\n';
-	str[len] = NULL_CHAR;
-
-	err = lexer_new(NULL, str, len, &lexer);
-	if (err)
-		return err;
-	cpp_token_stream_init(&stream, lexer);
-	err = cpp_token_stream_remove_head(&stream, &this);
+	len = sprintf(str, "%d\n", num);
+	err = cpp_token_new_from_buffer(str, len, &this);
 	if (err)
 		return err;
 	assert(cpp_token_type(this) == LXR_TOKEN_NUMBER);
-	assert(cpp_token_stream_is_empty(&stream));
-	lexer_delete(lexer);
 
 	this->is_first = is_first;
 	this->has_white_space = has_white_space;
@@ -246,22 +848,25 @@ err_t cpp_token_new_place_marker(const bool has_white_space,
 	return cpp_token_new(base, out);
 }
 /*****************************************************************************/
-/* out init by the caller */
+/*
+ * out init by the caller. The tokens are shared, not duplicated; only the
+ * tokens that are later modified get copied, by cpp_token_make_writable.
+ */
 static
 err_t cpp_tokens_copy(const struct cpp_tokens *this,
 					  struct cpp_tokens *out)
 {
 	int i;
 	err_t err;
-	struct cpp_token *t, *token;
+	struct cpp_token *t;
 
 	CPP_TOKENS_FOR_EACH(this, i, t) {
 		assert(t);
-		err = cpp_token_copy(t, &token);
-		if (!err)
-			err = cpp_tokens_add_tail(out, token);
-		if (err)
+		err = cpp_tokens_add_tail(out, cpp_token_share(t));
+		if (err) {
+			cpp_token_delete(t);
 			return err;
+		}
 	}
 	assert(i == cpp_tokens_num_entries(this));
 	return ESUCCESS;
@@ -293,41 +898,247 @@ err_t cpp_tokens_remove_place_markers(struct cpp_tokens *this)
 	return cpp_tokens_move(&out, this);
 }
 /*****************************************************************************/
-/* no ref change on base when token is placed/removed from queues, etc. */
 static
-err_t cpp_token_stream_peek_head(struct cpp_token_stream *this,
-								 struct cpp_token **out)
+void lexed_file_delete(void *p)
 {
-	err_t err;
-	struct lexer_token *base;
-	struct lexer *lexer;
-	struct cpp_token *token;
-
-	if (!cpp_token_stream_is_empty(this)) {
-		*out = cpp_tokens_peek_head(&this->tokens);
-		return ESUCCESS;
-	}
-
-	/* not having a lexer and with empty tokens, implies end-of-stream */
-	lexer = this->lexer;
-	if (lexer == NULL)
-		return EOF;
+	int i;
+	struct lexed_file *this = p;
 
-	err = lexer_lex_token(lexer, &base);	/* ref-count is 1 */
-	if (!err)
-		err = cpp_token_new(base, &token);	/* move lexer's ref */
-	if (!err)
-		err = cpp_tokens_add_tail(&this->tokens, token);
-	if (!err)
-		*out = token;
-	return err;
+	for (i = 0; i < this->num_tokens; ++i)
+		lexer_token_deref(this->tokens[i]);
+	free(this->tokens);
+	free((void *)this->path);
+	free((void *)this->dir_path);
+	free(this);
 }
 
 static
-err_t cpp_token_stream_remove_head(struct cpp_token_stream *this,
-								   struct cpp_token **out)
+err_t lexed_file_new(const struct stat *stat,
+					 const char *path,
+					 const char *dir_path,
+					 struct lexed_file **out)
 {
-	err_t err;
+	struct lexed_file *this;
+
+	this = malloc(sizeof(*this));
+	if (this == NULL)
+		return ENOMEM;
+	this->dir_path = NULL;
+	this->path = strdup(path);
+	if (this->path == NULL) {
+		free(this);
+		return ENOMEM;
+	}
+	if (dir_path) {
+		this->dir_path = strdup(dir_path);
+		if (this->dir_path == NULL) {
+			free((void *)this->path);
+			free(this);
+			return ENOMEM;
+		}
+	}
+	this->dev = stat->st_dev;
+	this->ino = stat->st_ino;
+	this->size = stat->st_size;
+	this->mtime = stat->st_mtime;
+	this->tokens = NULL;
+	this->num_tokens = this->num_tokens_allocated = 0;
+	this->is_complete = false;
+	*out = this;
+	return ESUCCESS;
+}
+
+/* The file takes its own ref on the token. */
+static
+err_t lexed_file_add_token(struct lexed_file *this,
+						   struct lexer_token *token)
+{
+	int num;
+	struct lexer_token **tokens;
+
+	if (this->num_tokens == this->num_tokens_allocated) {
+		num = this->num_tokens_allocated ? 2 * this->num_tokens_allocated : 64;
+		tokens = realloc(this->tokens, num * sizeof(*tokens));
+		if (tokens == NULL)
+			return ENOMEM;
+		this->tokens = tokens;
+		this->num_tokens_allocated = num;
+	}
+	lexer_token_ref(token);
+	this->tokens[this->num_tokens++] = token;
+	return ESUCCESS;
+}
+
+static
+struct lexed_file *scanner_find_lexed_file(const struct scanner *this,
+										   const struct stat *stat)
+{
+	int i;
+	struct lexed_file *file;
+
+	LEXED_FILES_FOR_EACH(&this->lexed_files, i, file) {
+		if (file->dev == stat->st_dev && file->ino == stat->st_ino)
+			return file;
+	}
+	if (this->cache == NULL)
+		return NULL;
+
+	/* The server's files may have changed since they were lexed. */
+	LEXED_FILES_FOR_EACH(&this->cache->lexed_files, i, file) {
+		if (file->dev == stat->st_dev && file->ino == stat->st_ino &&
+			file->size == stat->st_size && file->mtime == stat->st_mtime)
+			return file;
+	}
+	return NULL;
+}
+/*****************************************************************************/
+err_t scanner_cache_new(struct scanner_cache **out)
+{
+	struct scanner_cache *this;
+
+	this = malloc(sizeof(*this));
+	if (this == NULL)
+		return ENOMEM;
+	lexed_files_init(&this->lexed_files);
+	*out = this;
+	return ESUCCESS;
+}
+
+void scanner_cache_delete(struct scanner_cache *this)
+{
+	lexed_files_empty(&this->lexed_files);
+	free(this);
+}
+
+static
+bool lexed_file_is_stale(const struct lexed_file *this,
+						 const struct stat *stat)
+{
+	return (this->dev != stat->st_dev || this->ino != stat->st_ino ||
+			this->size != stat->st_size || this->mtime != stat->st_mtime);
+}
+
+/*
+ * Lex the whole file ahead of its inclusion. As lexing does not depend on the
+ * macro state, the tokens are those that a scanner would have recorded. The
+ * path must be absolute, for the dir_path to hold in any working directory.
+ */
+err_t scanner_cache_add_file(struct scanner_cache *this,
+							 const char *path)
+{
+	int i;
+	err_t err;
+	struct stat stat_buf;
+	struct lexer *lexer;
+	struct lexer_token *token;
+	struct lexed_file *file;
+
+	if (path[0] != '/')
+		return EINVAL;
+	if (stat(path, &stat_buf) < 0)
+		return errno;
+	LEXED_FILES_FOR_EACH(&this->lexed_files, i, file) {
+		if (!lexed_file_is_stale(file, &stat_buf))
+			return ESUCCESS;
+	}
+
+	err = lexer_new(path, NULL, 0, &lexer);
+	if (err)
+		return err;
+	err = lexed_file_new(&stat_buf, path, lexer->dir_path, &file);
+	if (err)
+		goto err0;
+	while (true) {
+		err = lexer_lex_token(lexer, &token);	/* ref-count is 1 */
+		if (err)
+			break;
+		err = lexed_file_add_token(file, token);
+		lexer_token_deref(token);
+		if (err)
+			break;
+	}
+	if (err == EOF) {
+		file->is_complete = true;
+		err = lexed_files_add_tail(&this->lexed_files, file);
+	}
+	if (err)
+		lexed_file_delete(file);
+err0:
+	lexer_delete(lexer);
+	return err;
+}
+
+/* Drop the files that changed, or were removed, since they were lexed. */
+void scanner_cache_prune(struct scanner_cache *this)
+{
+	int i;
+	struct stat stat_buf;
+	struct lexed_file *file;
+
+	for (i = 0; i < ptrq_num_entries(&this->lexed_files.q);) {
+		file = ptrq_peek_entry(&this->lexed_files.q, i);
+		if (stat(file->path, &stat_buf) == 0 &&
+			!lexed_file_is_stale(file, &stat_buf)) {
+			++i;
+			continue;
+		}
+		ptrq_remove_entry(&this->lexed_files.q, i);
+		lexed_file_delete(file);
+	}
+}
+/*****************************************************************************/
+/* no ref change on base when token is placed/removed from queues, etc. */
+static
+err_t cpp_token_stream_peek_head(struct cpp_token_stream *this,
+								 struct cpp_token **out)
+{
+	err_t err;
+	enum stats_phase phase;
+	struct lexer_token *base;
+	struct lexer *lexer;
+	struct lexed_file *file;
+	struct cpp_token *token;
+
+	if (!cpp_token_stream_is_empty(this)) {
+		*out = cpp_tokens_peek_head(&this->tokens);
+		return ESUCCESS;
+	}
+
+	/*
+	 * not having a lexer, or a file left to replay, and with empty tokens,
+	 * implies end-of-stream
+	 */
+	lexer = this->lexer;
+	file = this->file;
+	if (lexer) {
+		phase = stats_enter(STATS_PHASE_LEX);
+		err = lexer_lex_token(lexer, &base);	/* ref-count is 1 */
+		stats_leave(phase);
+		if (!err)
+			++this->num_lexed;
+		if (!err && file)
+			err = lexed_file_add_token(file, base);	/* record */
+	} else if (file && this->file_pos < file->num_tokens) {
+		base = file->tokens[this->file_pos++];
+		lexer_token_ref(base);
+		err = ESUCCESS;
+	} else {
+		return EOF;
+	}
+	if (!err)
+		err = cpp_token_new(base, &token);	/* move lexer's ref */
+	if (!err)
+		err = cpp_tokens_add_tail(&this->tokens, token);
+	if (!err)
+		*out = token;
+	return err;
+}
+
+static
+err_t cpp_token_stream_remove_head(struct cpp_token_stream *this,
+								   struct cpp_token **out)
+{
+	err_t err;
 	struct cpp_token *token;
 
 	err = cpp_token_stream_peek_head(this, out);
@@ -581,16 +1392,91 @@ int macro_find_parameter(const struct macro *this,
 }
 /*****************************************************************************/
 static
-err_t scanner_include_hseq(struct scanner *this,
-						   const char *name)
+void include_lookup_delete(void *p)
+{
+	struct include_lookup *this = p;
+	free((void *)this->name);
+	free((void *)this->dir_path);
+	free((void *)this->path);
+	free(this);
+}
+
+/* dir_path is NULL for a <name>. */
+static
+struct include_lookup *scanner_find_include_lookup(const struct scanner *this,
+												   const char *name,
+												   const char *dir_path,
+												   const int start)
+{
+	int i;
+	struct include_lookup *lookup;
+
+	PTRQ_FOR_EACH(&this->include_lookups, i, lookup) {
+		if (lookup->start != start || strcmp(lookup->name, name))
+			continue;
+		if ((lookup->dir_path == NULL) != (dir_path == NULL))
+			continue;
+		if (dir_path && strcmp(lookup->dir_path, dir_path))
+			continue;
+		return lookup;
+	}
+	return NULL;
+}
+
+/* Memoizes the lookup. path, if not NULL, is moved into the lookup. */
+static
+err_t scanner_add_include_lookup(struct scanner *this,
+								 const char *name,
+								 const char *dir_path,
+								 const int start,
+								 char *path)
+{
+	err_t err;
+	struct include_lookup *lookup;
+
+	lookup = malloc(sizeof(*lookup));
+	if (lookup == NULL) {
+		free(path);
+		return ENOMEM;
+	}
+	lookup->name = strdup(name);
+	lookup->dir_path = dir_path ? strdup(dir_path) : NULL;
+	lookup->start = start;
+	lookup->path = path;
+	err = ESUCCESS;
+	if (lookup->name == NULL || (dir_path && lookup->dir_path == NULL))
+		err = ENOMEM;
+	if (!err)
+		err = ptrq_add_tail(&this->include_lookups, lookup);
+	if (err)
+		include_lookup_delete(lookup);
+	return err;
+}
+
+/*
+ * Returns, in out, the path of the first <name> that exists, searching the
+ * include paths from start onwards. The path is owned by the lookup.
+ */
+static
+err_t scanner_find_hseq(struct scanner *this,
+						const char *name,
+						const int start,
+						const char **out)
 {
 	err_t err;
 	int i, fd, name_len;
 	char *path;
+	const struct include_lookup *lookup;
 
-	err = ENOENT;
+	lookup = scanner_find_include_lookup(this, name, NULL, start);
+	if (lookup) {
+		*out = lookup->path;
+		return lookup->path ? ESUCCESS : ENOENT;
+	}
+
+	path = NULL;
 	name_len = strlen(name);
-	for (i = 0; i < 4; ++i) {
+	for (i = start; i < 4; ++i) {
 		if (this->include_paths[i] == NULL)
 			continue;
 
@@ -604,27 +1490,43 @@ err_t scanner_include_hseq(struct scanner *this,
 
 		/* Check if the file exists */
 		fd = open(path, O_RDONLY);
-		if (fd < 0) {
-			free(path);
-			continue;
+		if (fd >= 0) {
+			close(fd);
+			break;
 		}
-		err = scanner_scan_file(this, path);
-		close(fd);
 		free(path);
-		break;
+		path = NULL;
 	}
-	return err;
+	err = scanner_add_include_lookup(this, name, NULL, start, path);
+	if (err)
+		return err;
+	*out = path;
+	return path ? ESUCCESS : ENOENT;
 }
 
+/*
+ * in_name is a cpp string; it contains the delimiters. It is looked up
+ * relative to dir_path, and then as a <name>, from start onwards. The
+ * __has_include_next probe, with a non-zero start, skips dir_path.
+ */
 static
-err_t scanner_include_qseq(struct scanner *this,
-						   const char *dir_path,
-						   const char *in_name)
+err_t scanner_find_qseq(struct scanner *this,
+						const char *dir_path,
+						const char *in_name,
+						const int start,
+						const char **out)
 {
 	err_t err;
 	int path_len, fd, name_len;
 	char *path;
 	char *name;
+	const struct include_lookup *lookup;
+
+	lookup = scanner_find_include_lookup(this, in_name, dir_path, start);
+	if (lookup) {
+		*out = lookup->path;
+		return lookup->path ? ESUCCESS : ENOENT;
+	}
 
 	/* file-name is a cpp string - it contains delimiters. Strip them */
 	name_len = strlen(in_name);
@@ -638,62 +1540,161 @@ err_t scanner_include_qseq(struct scanner *this,
 	strncpy(name, &in_name[1], name_len);
 	name[name_len] = 0;	/* To silence valgrind uninit-use warning. */
 
-	path_len = strlen(dir_path) + name_len + 1;	/* + 1 for / */
-	path = malloc(path_len + 1);
-	if (path == NULL)
-		return ENOMEM;
+	path = NULL;
+	err = ENOENT;
+	if (start == 0) {
+		path_len = strlen(dir_path) + name_len + 1;	/* + 1 for / */
+		path = malloc(path_len + 1);
+		if (path == NULL) {
+			err = ENOMEM;
+			goto err0;
+		}
 
-	strcpy(path, dir_path);
-	strcat(path, "/");
-	strcat(path, name);
-	free(name);
+		strcpy(path, dir_path);
+		strcat(path, "/");
+		strcat(path, name);
 
-	/* Check if the file exists */
-	fd = open(path, O_RDONLY);
-	if (fd >= 0) {
-		err = scanner_scan_file(this, path);
-		close(fd);
-		goto err0;
+		/* Check if the file exists */
+		fd = open(path, O_RDONLY);
+		err = ESUCCESS;
+		if (fd < 0) {
+			err = errno;
+			free(path);
+			path = NULL;
+		}
+		if (fd >= 0)
+			close(fd);
 	}
-	err = errno;
-	if (err == ENOENT)	/* file not found. Try <...> */
-		err = scanner_include_hseq(this, in_name);
+	if (err == ENOENT) {	/* file not found. Try <...> */
+		err = scanner_find_hseq(this, name, start, out);
+		if (err == ESUCCESS) {
+			path = strdup(*out);
+			if (path == NULL)
+				err = ENOMEM;
+		}
+	}
+
+	/* Other errors, such as EACCES, are not memoized. */
+	if (err == ESUCCESS || err == ENOENT)
+		err = scanner_add_include_lookup(this, in_name, dir_path, start, path);
+	else
+		free(path);
+	if (err == ESUCCESS)
+		*out = path;
+	if (err == ESUCCESS && path == NULL)
+		err = ENOENT;
 err0:
-	free(path);
+	free(name);
 	return err;
 }
 
 static
-err_t scanner_scan_directive_include(struct scanner *this,
-									 struct cpp_tokens *line,
-									 const char *dir_path)
+err_t scanner_include_hseq(struct scanner *this,
+						   const char *name)
+{
+	err_t err;
+	const char *path;
+
+	err = scanner_find_hseq(this, name, 0, &path);
+	if (err)
+		return err;
+	return scanner_scan_file(this, path);
+}
+
+static
+err_t scanner_include_qseq(struct scanner *this,
+						   const char *dir_path,
+						   const char *in_name)
+{
+	err_t err;
+	const char *path;
+
+	err = scanner_find_qseq(this, dir_path, in_name, 0, &path);
+	if (err)
+		return err;
+	return scanner_scan_file(this, path);
+}
+
+/*
+ * Removes the tokens of a <...> header-name, after the <, from the line, and
+ * returns the name they spell, in out.
+ */
+static
+err_t cpp_tokens_remove_h_name(struct cpp_tokens *line,
+							   char **out)
 {
 	err_t err;
 	bool closed;
 	int name_len;
-	const char *name;
 	char *str;
 	struct cpp_token *token;
 	struct cpp_tokens tokens;
-	struct cpp_tokens exp_line;
-	enum lexer_token_type type;
 
-	if (cpp_tokens_is_empty(line))	/* no file-name */
-		return EINVAL;
-
-	cpp_tokens_init(&exp_line);
 	cpp_tokens_init(&tokens);
 
-	token = cpp_tokens_peek_head(line);
-	type = cpp_token_type(token);
-	if (type == LXR_TOKEN_CHAR_STRING_LITERAL) {
-		name = cpp_token_source(token);
-		/* TODO: If the string has embedded nul chars? */
-		err = scanner_include_qseq(this, dir_path, name);
-		cpp_tokens_delete_head(line);
-		return err;
+	/* Form the path from tokens. maintain ws */
+	closed = false;
+	name_len = 0;
+	while (!cpp_tokens_is_empty(line)) {
+		token = cpp_tokens_remove_head(line);
+		if (cpp_token_type(token) == LXR_TOKEN_GREATER_THAN) {
+			closed = true;
+			cpp_token_delete(token);
+			break;
+		}
+		name_len += cpp_token_has_white_space(token) ? 1 : 0;
+		name_len += cpp_token_source_length(token);
+		err = cpp_tokens_add_tail(&tokens, token);
+		if (err)
+			return err;
 	}
-
+	if (closed == false)
+		return EINVAL;	/* closing > not found */
+
+	str = malloc(name_len + 1);
+	if (str == NULL)
+		return ENOMEM;
+
+	str[0] = 0;
+	while (!cpp_tokens_is_empty(&tokens)) {
+		token = cpp_tokens_remove_head(&tokens);
+		assert(cpp_token_type(token) != LXR_TOKEN_GREATER_THAN);
+		if (cpp_token_has_white_space(token))
+			strcat(str, " ");
+		strcat(str, cpp_token_source(token));
+		cpp_token_delete(token);
+	}
+	*out = str;
+	return ESUCCESS;
+}
+
+static
+err_t scanner_scan_directive_include(struct scanner *this,
+									 struct cpp_tokens *line,
+									 const char *dir_path)
+{
+	err_t err;
+	const char *name;
+	char *str;
+	struct cpp_token *token;
+	struct cpp_tokens exp_line;
+	enum lexer_token_type type;
+
+	if (cpp_tokens_is_empty(line))	/* no file-name */
+		return EINVAL;
+
+	cpp_tokens_init(&exp_line);
+
+	token = cpp_tokens_peek_head(line);
+	type = cpp_token_type(token);
+	if (type == LXR_TOKEN_CHAR_STRING_LITERAL) {
+		name = cpp_token_source(token);
+		/* TODO: If the string has embedded nul chars? */
+		err = scanner_include_qseq(this, dir_path, name);
+		cpp_tokens_delete_head(line);
+		return err;
+	}
+
 	if (type != LXR_TOKEN_LESS_THAN) {
 		/* repurpose expand_argument function */
 		err =  scanner_expand_argument(this, line, &exp_line);
@@ -715,40 +1716,10 @@ err_t scanner_scan_directive_include(struct scanner *this,
 
 	assert(type == LXR_TOKEN_LESS_THAN);
 	cpp_tokens_delete_head(line);
-
-	/* Form the path from tokens. maintain ws */
-	closed = false;
-	name_len = 0;
-	while (!cpp_tokens_is_empty(line)) {
-		token = cpp_tokens_remove_head(line);
-		if (cpp_token_type(token) == LXR_TOKEN_GREATER_THAN) {
-			closed = true;
-			cpp_token_delete(token);
-			break;
-		}
-		name_len += cpp_token_has_white_space(token) ? 1 : 0;
-		name_len += cpp_token_source_length(token);
-		err = cpp_tokens_add_tail(&tokens, token);
-		if (err)
-			return err;
-	}
-	if (closed == false)
-		return EINVAL;	/* closing > not found */
-
-	name = str = malloc(name_len + 1);
-	if (name == NULL)
-		return ENOMEM;
-
-	str[0] = 0;
-	while (!cpp_tokens_is_empty(&tokens)) {
-		token = cpp_tokens_remove_head(&tokens);
-		assert(cpp_token_type(token) != LXR_TOKEN_GREATER_THAN);
-		if (cpp_token_has_white_space(token))
-			strcat(str, " ");
-		strcat(str, cpp_token_source(token));
-		cpp_token_delete(token);
-	}
-	err = scanner_include_hseq(this, name);
+	err = cpp_tokens_remove_h_name(line, &str);
+	if (err)
+		return err;
+	err = scanner_include_hseq(this, str);
 	free(str);
 	return err;
 }
@@ -792,6 +1763,20 @@ err_t scanner_check_macro_redefine(const struct scanner *this,
 	return EINVAL;
 }
 
+static
+err_t scanner_add_macro(struct scanner *this,
+						struct macro *macro)
+{
+	err_t err;
+
+	macro->generation = ++this->macros_generation;
+	err = macros_add_tail(&this->macros, macro);
+	if (!err)
+		scanner_note_macro_write(this, cpp_token_resolved(macro->identifier),
+								 macro);
+	return err;
+}
+
 static
 err_t scanner_scan_directive_undef(struct scanner *this,
 								   struct cpp_tokens *line)
@@ -810,10 +1795,13 @@ err_t scanner_scan_directive_undef(struct scanner *this,
 
 	name = cpp_token_resolved(ident);
 	i = scanner_find_macro_index(this, name);
+	if (i >= 0)
+		scanner_note_macro_write(this, name, NULL);
 	cpp_token_delete(ident);
 	if (i < 0)
 		return ESUCCESS;	/* Not defined */
 	macros_delete_entry(&this->macros, i);
+	++this->macros_generation;
 	return ESUCCESS;
 }
 
@@ -836,11 +1824,14 @@ err_t scanner_scan_directive_define(struct scanner *this,
 	macro = malloc(sizeof(*macro));
 	if (macro == NULL)
 		return ENOMEM;
+	stats_note_alloc(STATS_SUBSYSTEM_SCANNER, sizeof(*macro));
 
 	/* No need to delete ident right-now */
 	macro->identifier = ident;
 	macro->is_function_like = false;
 	macro->is_variadic = false;
+	macro->generation = 0;
+	macro->profile = NULL;
 	cpp_tokens_init(&macro->parameters);
 	cpp_tokens_init(&macro->replacement_list);
 
@@ -873,18 +1864,28 @@ err_t scanner_scan_directive_define(struct scanner *this,
 		return err;
 	}
 	assert(err == ENOENT);
-	return macros_add_tail(&this->macros, macro);
+	return scanner_add_macro(this, macro);
 }
 /*****************************************************************************/
 static
-bool rpn_stack_entry_sign(const struct rpn_stack_entry *this)
+bool expr_stack_entry_sign(const struct expr_stack_entry *this)
 {
-	assert(this->type != RPN_STACK_ENTRY_OPERATOR);
-	if (this->type == RPN_STACK_ENTRY_UNSIGNED)
-		return false;	/* +ve */
-	if ((intmax_t)this->u.value < 0)
-		return true;
-	return false;
+	/* false == +ve, true == -ve */
+	return this->is_signed && (intmax_t)this->u.value < 0;
+}
+
+/* The precedence of a binary operator, or EOF if the token isn't one. */
+static
+int expr_binary_operator_precedence(const enum lexer_token_type operator)
+{
+	int i;
+
+	/* first 3 are unary ops */
+	for (i = 3; i < (int)ARRAY_SIZE(g_rpn_operator_precedence); ++i) {
+		if (g_rpn_operator_precedence[i].operator == operator)
+			return g_rpn_operator_precedence[i].precedence;
+	}
+	return EOF;
 }
 
 /*
@@ -894,331 +1895,273 @@ bool rpn_stack_entry_sign(const struct rpn_stack_entry *this)
  *    |      ^~~~~~~~~~~~~~~~~~~
  */
 
+/*
+ * operand[0] is the left operand. The result takes on the type of the left
+ * operand, except for the relational/logical operators, which result in an
+ * unsigned 0/1. When the operation is dead, i.e. on the unevaluated side of
+ * a &&, || or ?:, a division by zero is not an error.
+ */
 static
-err_t rpn_stack_evaluate(struct rpn_stack *this,
-						 struct rpn_stack_entry *out)
+err_t expr_apply_binary_operator(const enum lexer_token_type operator,
+								 const bool is_live,
+								 struct expr_stack_entry *operand)
 {
-	err_t err;
-	bool empty;
-	int num_question_marks;
 	bool sign[2];	/* false == +ve, true == -ve */
 	uintmax_t value[2];
-	struct rpn_stack result, stk;
-	struct rpn_stack_entry entry;
-	struct rpn_stack_entry operand[2];
-	enum lexer_token_type operator;
-
-	/*
-	 * Reverse the stack so that we can use stack routines.
-	 * a > b is represented as: 'a b > top'.
-	 * But the processing of rpn starts at the bottom of this representation.
-	 * So, reverse the stack.
-	 */
-	rpn_stack_init(&stk);
-	rpn_stack_init(&result);
-	RPN_STACK_FOR_EACH_WITH_REMOVE_REVERSE(this, entry) {
-		err = rpn_stack_push(&stk, &entry);
-		if (err)
-			return err;
-	}
-	assert(rpn_stack_is_empty(this));
-
-	/* Set this to rev(this) */
-	*this = stk;
-	rpn_stack_init(&stk);
-
-	/* Default is false/0 */
-	out->type = RPN_STACK_ENTRY_UNSIGNED;
-	out->u.value = 0;
-
-	while (!rpn_stack_is_empty(this)) {
-		entry = rpn_stack_pop(this);
-
-		/* Push non-operatror values on the stack. */
-		if (entry.type == RPN_STACK_ENTRY_SIGNED ||
-			entry.type == RPN_STACK_ENTRY_UNSIGNED) {
-			err = rpn_stack_push(&result, &entry);
-			if (err)
-				return err;
-			continue;
-		}
-
-		operator = entry.u.operator;
 
-		assert(!rpn_stack_is_empty(&result));
-		operand[1] = rpn_stack_pop(&result);
-		value[1] = operand[1].u.value;
-		sign[1] = rpn_stack_entry_sign(&operand[1]);
-
-		/* unary op? */
-		switch (operator) {
-		case LXR_TOKEN_UNARY_MINUS:
-			value[1] = -(intmax_t)value[1];
-			operand[1].type = RPN_STACK_ENTRY_SIGNED;
-			break;
-		case LXR_TOKEN_LOGICAL_NOT:
-			value[1] = !value[1];
-			operand[1].type = RPN_STACK_ENTRY_UNSIGNED;
-			break;
-		case LXR_TOKEN_BITWISE_NOT:
-			value[1] = ~value[1];
-			operand[1].type = RPN_STACK_ENTRY_SIGNED;
-			break;
-		default:
-			break;
-		}
+	value[0] = operand[0].u.value;
+	value[1] = operand[1].u.value;
+	sign[0] = expr_stack_entry_sign(&operand[0]);
+	sign[1] = expr_stack_entry_sign(&operand[1]);
 
-		switch (operator) {
-		case LXR_TOKEN_UNARY_MINUS:
-		case LXR_TOKEN_LOGICAL_NOT:
-		case LXR_TOKEN_BITWISE_NOT:
-			operand[1].u.value = value[1];
-			err = rpn_stack_push(&result, &operand[1]);
-			if (err)
-				return err;
-			continue;
-		default:
+	switch (operator) {
+	case LXR_TOKEN_LOGICAL_OR:
+		value[0] = value[0] || value[1];
+		operand[0].is_signed = false;
+		break;
+	case LXR_TOKEN_LOGICAL_AND:
+		value[0] = value[0] && value[1];
+		operand[0].is_signed = false;
+		break;
+	case LXR_TOKEN_BITWISE_OR:
+		value[0] = value[0] | value[1];
+		break;
+	case LXR_TOKEN_BITWISE_XOR:
+		value[0] = value[0] ^ value[1];
+		break;
+	case LXR_TOKEN_BITWISE_AND:
+		value[0] = value[0] & value[1];
+		break;
+	case LXR_TOKEN_EQUALS:
+		value[0] = value[0] == value[1];
+		operand[0].is_signed = false;
+		break;
+	case LXR_TOKEN_NOT_EQUALS:
+		value[0] = value[0] != value[1];
+		operand[0].is_signed = false;
+		break;
+	case LXR_TOKEN_LESS_THAN:
+		/*
+		 * if both are +ve: i.e. both are unsigned, or both are signed but
+		 * +ve, then usual.
+		 * if both are -ve: i.e. both are signed, and both have msb set,
+		 * then usual.
+		 * if one of them is -ve, then usual.
+		 */
+		if (sign[0] == sign[1])
+			value[0] = value[0] < value[1];
+		else if (sign[0])	/* -ve < +ve is true */
+			value[0] = 1;
+		else
+			value[0] = 0;	/* +ve < -ve is false */
+		operand[0].is_signed = false;
+		break;
+	case LXR_TOKEN_LESS_THAN_EQUALS:
+		if (sign[0] == sign[1])
+			value[0] = value[0] <= value[1];
+		else if (sign[0])	/* -ve <= +ve is true */
+			value[0] = 1;
+		else
+			value[0] = 0;	/* +ve <= -ve is false */
+		operand[0].is_signed = false;
+		break;
+	case LXR_TOKEN_GREATER_THAN:
+		if (sign[0] == sign[1])
+			value[0] = value[0] > value[1];
+		else if (sign[0])	/* -ve > +ve is false */
+			value[0] = 0;
+		else
+			value[0] = 1;	/* +ve > -ve is true */
+		operand[0].is_signed = false;
+		break;
+	case LXR_TOKEN_GREATER_THAN_EQUALS:
+		if (sign[0] == sign[1])
+			value[0] = value[0] >= value[1];
+		else if (sign[0])	/* -ve >= +ve is false */
+			value[0] = 0;
+		else
+			value[0] = 1;	/* +ve >= -ve is true */
+		operand[0].is_signed = false;
+		break;
+	case LXR_TOKEN_SHIFT_LEFT:
+		if (value[1] > 63)
+			value[0] = 0;
+		else
+			value[0] <<= value[1];	/* signed may conver to unsinged */
+		break;
+	case LXR_TOKEN_SHIFT_RIGHT:
+		if (value[1] > 63) {
+			value[0] = 0;
+			if (sign[0])
+				value[0] = (uintmax_t)-1;
 			break;
 		}
+		if (sign[0])
+			value[0] = (uintmax_t)((intmax_t)value[0] >> value[1]);
+		else
+			value[0] >>= value[1];
+		break;
+	case LXR_TOKEN_PLUS:
+		value[0] += value[1];
+		break;
+	case LXR_TOKEN_MINUS:
+		value[0] -= value[1];
+		break;
+	case LXR_TOKEN_MUL:
+		value[0] *= value[1];
+		break;
+	case LXR_TOKEN_DIV:
+		if (value[1] == 0 && is_live)
+			return EINVAL;
+		value[0] = value[1] ? value[0] / value[1] : 0;
+		break;
+	case LXR_TOKEN_MOD:
+		if (value[1] == 0 && is_live)
+			return EINVAL;
+		value[0] = value[1] ? value[0] % value[1] : 0;
+		break;
+	default:
+		assert(0);
+		return EINVAL;
+	}	/* switch */
+	operand[0].u.value = value[0];
+	return ESUCCESS;
+}
 
-		assert(!rpn_stack_is_empty(&result));
-		operand[0] = rpn_stack_pop(&result);
-		value[0] = operand[0].u.value;
-		sign[0] = rpn_stack_entry_sign(&operand[0]);
-
-		if (operator == LXR_TOKEN_CONDITIONAL) {
-			num_question_marks = 1;
-			/*
-			 * op[0] has the initial condition, op[1] has the value when op[0]
-			 * is true. rest, until the corresponding colon has the value of
-			 * op[1] is false.
-			 */
-			empty = false;
-			if (value[0]) {
-				/* intiial cond is true. result is op[1], and free the rest */
-				operand[0] = operand[1];
-				empty = true;	/* empty the false part of the conditional */
-			} else {
-				/* initial cond is false. free op[1], and eval the rest */
-			}
-
-			/* Create a sub-stack, until the corresponding : */
-			while (!rpn_stack_is_empty(this)) {
-				entry = rpn_stack_peek(this);
-				if (entry.u.operator == LXR_TOKEN_COLON &&
-					num_question_marks == 1)
-					break;
-				rpn_stack_pop(this);
-				if (entry.u.operator == LXR_TOKEN_CONDITIONAL)
-					++num_question_marks;
-				else if (entry.u.operator == LXR_TOKEN_COLON)
-					--num_question_marks;
-				if (empty)
-					continue;
-				err = rpn_stack_push(&stk, &entry);
-				if (err)
-					return err;
-			}
-			if (rpn_stack_is_empty(this))
-				return EINVAL;
-			rpn_stack_pop(this);	/* pop the corresponding colon */
+/*
+ * Pop the operator on the top of the operators stack, pop its operands off of
+ * the operands stack, and push the result onto the operands stack.
+ * num_dead is the number of operators on the stack whose right operand is
+ * dead; the operator being reduced is live only if none of the operators
+ * below it is making it dead.
+ */
+static
+err_t expr_stack_reduce(struct expr_stack *operators,
+						struct expr_stack *operands,
+						int *num_dead)
+{
+	err_t err;
+	int num_operands;
+	enum lexer_token_type operator;
+	struct expr_stack_entry entry;
+	struct expr_stack_entry operand[3];
+
+	entry = expr_stack_pop(operators);
+	operator = entry.u.operator;
+	if (operator == LXR_TOKEN_LEFT_PAREN ||
+		operator == LXR_TOKEN_CONDITIONAL)
+		return EINVAL;	/* unbalanced ( or ? */
+	if (entry.is_dead)
+		--*num_dead;
+
+	switch (operator) {
+	case LXR_TOKEN_UNARY_MINUS:
+	case LXR_TOKEN_LOGICAL_NOT:
+	case LXR_TOKEN_BITWISE_NOT:
+		num_operands = 1;
+		break;
+	case LXR_TOKEN_COLON:
+		num_operands = 3;
+		break;
+	default:
+		num_operands = 2;
+		break;
+	}
+	if (expr_stack_num_entries(operands) < num_operands)
+		return EINVAL;
+	operand[num_operands - 1] = expr_stack_pop(operands);
+	if (num_operands > 1)
+		operand[num_operands - 2] = expr_stack_pop(operands);
+	if (num_operands > 2)
+		operand[0] = expr_stack_pop(operands);
+
+	switch (operator) {
+	case LXR_TOKEN_UNARY_MINUS:
+		operand[0].u.value = -(intmax_t)operand[0].u.value;
+		operand[0].is_signed = true;
+		break;
+	case LXR_TOKEN_LOGICAL_NOT:
+		operand[0].u.value = !operand[0].u.value;
+		operand[0].is_signed = false;
+		break;
+	case LXR_TOKEN_BITWISE_NOT:
+		operand[0].u.value = ~operand[0].u.value;
+		operand[0].is_signed = true;
+		break;
+	case LXR_TOKEN_COLON:
+		/* operand[0] is the condition, the others are the results. */
+		operand[0] = operand[0].u.value ? operand[1] : operand[2];
+		break;
+	default:
+		err = expr_apply_binary_operator(operator, *num_dead == 0, operand);
+		if (err)
+			return err;
+		break;
+	}
+	return expr_stack_push(operands, &operand[0]);
+}
 
-			if (!empty)	/* evaluate the false part of the ?: conditional */
-				err = rpn_stack_evaluate(&stk, &operand[0]);
-			if (!err)
-				err = rpn_stack_push(&result, &operand[0]);
-			if (err)
-				return err;
-			assert(rpn_stack_is_empty(&stk));
-			continue;
-		}
+/*
+ * Reduce the operators on the stack for as long as they bind tighter than an
+ * incoming binary operator of the given precedence. All binary operators are
+ * left-associative, except ? which is right-associative.
+ */
+static
+err_t expr_stack_reduce_tighter(struct expr_stack *operators,
+								struct expr_stack *operands,
+								const int precedence,
+								int *num_dead)
+{
+	err_t err;
+	const struct expr_stack_entry *top;
 
-		switch (operator) {
-		case LXR_TOKEN_LOGICAL_OR:
-			value[0] = value[0] || value[1];
-			operand[0].type = RPN_STACK_ENTRY_UNSIGNED;
-			break;
-		case LXR_TOKEN_LOGICAL_AND:
-			value[0] = value[0] && value[1];
-			operand[0].type = RPN_STACK_ENTRY_UNSIGNED;
-			break;
-		case LXR_TOKEN_BITWISE_OR:
-			value[0] = value[0] | value[1];
-			break;
-		case LXR_TOKEN_BITWISE_XOR:
-			value[0] = value[0] ^ value[1];
-			break;
-		case LXR_TOKEN_BITWISE_AND:
-			value[0] = value[0] & value[1];
-			break;
-		case LXR_TOKEN_EQUALS:
-			value[0] = value[0] == value[1];
-			operand[0].type = RPN_STACK_ENTRY_UNSIGNED;
-			break;
-		case LXR_TOKEN_NOT_EQUALS:
-			value[0] = value[0] != value[1];
-			operand[0].type = RPN_STACK_ENTRY_UNSIGNED;
-			break;
-		case LXR_TOKEN_LESS_THAN:
-			/*
-			 * if both are +ve: i.e. both are unsigned, or both are signed but
-			 * +ve, then usual.
-			 * if both are -ve: i.e. both are signed, and both have msb set,
-			 * then usual.
-			 * if one of them is -ve, then usual.
-			 */
-			if (sign[0] == sign[1])
-				value[0] = value[0] < value[1];
-			else if (sign[0])	/* -ve < +ve is true */
-				value[0] = 1;
-			else
-				value[0] = 0;	/* +ve < -ve is false */
-			operand[0].type = RPN_STACK_ENTRY_UNSIGNED;
-			break;
-		case LXR_TOKEN_LESS_THAN_EQUALS:
-			if (sign[0] == sign[1])
-				value[0] = value[0] <= value[1];
-			else if (sign[0])	/* -ve <= +ve is true */
-				value[0] = 1;
-			else
-				value[0] = 0;	/* +ve <= -ve is false */
-			operand[0].type = RPN_STACK_ENTRY_UNSIGNED;
-			break;
-		case LXR_TOKEN_GREATER_THAN:
-			if (sign[0] == sign[1])
-				value[0] = value[0] > value[1];
-			else if (sign[0])	/* -ve > +ve is false */
-				value[0] = 0;
-			else
-				value[0] = 1;	/* +ve > -ve is true */
-			operand[0].type = RPN_STACK_ENTRY_UNSIGNED;
+	while (!expr_stack_is_empty(operators)) {
+		top = expr_stack_peek(operators, 0);
+		if (top->u.operator == LXR_TOKEN_LEFT_PAREN)
 			break;
-		case LXR_TOKEN_GREATER_THAN_EQUALS:
-			if (sign[0] == sign[1])
-				value[0] = value[0] >= value[1];
-			else if (sign[0])	/* -ve >= +ve is false */
-				value[0] = 0;
-			else
-				value[0] = 1;	/* +ve >= -ve is true */
-			operand[0].type = RPN_STACK_ENTRY_UNSIGNED;
-			break;
-		case LXR_TOKEN_SHIFT_LEFT:
-			if (value[1] > 63)
-				value[0] = 0;
-			value[0] <<= value[1];	/* signed may conver to unsinged */
-			break;
-		case LXR_TOKEN_SHIFT_RIGHT:
-			if (value[1] > 63) {
-				value[0] = 0;
-				if (sign[0])
-					value[0] = (uintmax_t)-1;
-				break;
-			}
-			if (sign[0])
-				value[0] = (uintmax_t)((intmax_t)value[0] >> value[1]);
-			else
-				value[0] >>= value[1];
+		if (top->precedence > precedence)
 			break;
-		case LXR_TOKEN_PLUS:
-			value[0] += value[1];
+		if (top->precedence == precedence &&
+			top->u.operator == LXR_TOKEN_CONDITIONAL)
 			break;
-		case LXR_TOKEN_MINUS:
-			value[0] -= value[1];
-			break;
-		case LXR_TOKEN_MUL:
-			value[0] *= value[1];
-			break;
-		case LXR_TOKEN_DIV:
-			if (value[1] == 0)
-				return EINVAL;
-			value[0] /= value[1];
-			break;
-		case LXR_TOKEN_MOD:
-			if (value[1] == 0)
-				return EINVAL;
-			value[0] %= value[1];
-			break;
-		default:
-			assert(0);
-			return EINVAL;
-		}	/* switch */
-		operand[0].u.value = value[0];
-		err = rpn_stack_push(&result, &operand[0]);
+		err = expr_stack_reduce(operators, operands, num_dead);
 		if (err)
 			return err;
-	}	/* for */
-
-	assert(!rpn_stack_is_empty(&result));
-	*out = rpn_stack_pop(&result);
-	assert(rpn_stack_is_empty(&result));
-	return err;
+	}
+	return ESUCCESS;
 }
 
-/* this == operator stack */
+/*
+ * Reduce the operators on the stack until the given operator, a ( or a ?, is
+ * on the top. Running into the other one fails the reduction.
+ */
 static
-err_t rpn_stack_push_operator(struct rpn_stack *this,
-							  struct rpn_stack *out,
-							  const enum lexer_token_type operator)
+err_t expr_stack_reduce_until(struct expr_stack *operators,
+							  struct expr_stack *operands,
+							  const enum lexer_token_type operator,
+							  int *num_dead)
 {
 	err_t err;
-	int priorities[2];
-	struct rpn_stack_entry entry, top_entry;
-
-	/*
-	 * If opstk is empty, or has left-paren on tos, push.
-	 * else if the tos has lower-priority operator, push
-	 * else if the tos has the same priority operator, pop.
-	 * Note all our operators are left-assoc.
-	 */
-	entry.type = RPN_STACK_ENTRY_OPERATOR;
-	entry.u.operator = operator;
-
-	/* If the stack is empty, it will push the new entry and return */
-	while (!rpn_stack_is_empty(this)) {
-		top_entry = rpn_stack_peek(this);
-		assert(top_entry.type == RPN_STACK_ENTRY_OPERATOR);
-
-		/* If we hit a left-paren, push on top of it */
-		if (top_entry.u.operator == LXR_TOKEN_LEFT_PAREN)
-			return rpn_stack_push(this, &entry);
-
-		priorities[0] = rpn_operator_precedence(top_entry.u.operator);
-		priorities[1] = rpn_operator_precedence(operator);
-
-		/* the new op has higher prio than onstk-entry */
-		if (priorities[0] > priorities[1])
-			return rpn_stack_push(this, &entry);
-
-		/*
-		 * only colon has the prio 12. if operator == colon, the
-		 * on-stk-operator is also colon. note that : is right-assoc.
-		 */
-		if (priorities[0] == priorities[1] && operator == LXR_TOKEN_COLON)
-			return rpn_stack_push(this, &entry);
 
-		/*
-		 * same prior non-colons, or new-op has lower prio than on-stk.
-		 * pop the top_entry and push it onto the output stack, and then
-		 * recheck.
-		 */
-		rpn_stack_pop(this);	/* same prio => left-asocc behaviour */
-		err = rpn_stack_push(out, &top_entry);
+	while (!expr_stack_is_empty(operators)) {
+		if (expr_stack_peek(operators, 0)->u.operator == operator)
+			return ESUCCESS;
+		err = expr_stack_reduce(operators, operands, num_dead);
 		if (err)
 			return err;
-		/* recheck */
 	}
-	return rpn_stack_push(this, &entry);
+	return EINVAL;
 }
 
 static
-err_t cpp_token_scan_rpn_integer(const struct cpp_token *this,
-								 struct rpn_stack_entry *out)
+err_t cpp_token_scan_integer(const struct cpp_token *this,
+							 struct expr_stack_entry *out)
 {
 	int i, len;
 	const char *str;
 	uintmax_t value;
 
-	out->type = RPN_STACK_ENTRY_UNSIGNED;	/* starts off as unsigned */
+	out->is_signed = false;	/* starts off as unsigned */
 	str = cpp_token_source(this);
 	len = strlen(str);
 
@@ -1239,32 +2182,31 @@ err_t cpp_token_scan_rpn_integer(const struct cpp_token *this,
 }
 
 /*
- * We have cpp_token_type to represent operations, and
- * intmax_t, uintmax_t to represent signed/unsigned numbers.
- * all our binary operators are left-associative. i.e. when an operator is
- * being pushed on to the opstk and there already is another/same operator of
- * the same precedence on the opstk, that operator is popped off of the stack
- * and pushed on to the output.
- *
- * The precedence is given in the c2x standard by the way of arranging higher
- * precedence ops at a deeper depth in the grammar.
+ * A precedence-climbing evaluator, run directly over the tokens.
  *
  * state-machine.
- * state 0 == expecting_operand. for now we support unary-expr. We
- * also have to support char-constant and their conversion to exec-char-set.
- * state 1 == expecting_operator. binary operator.
+ * is_operand == expecting an operand. i.e. a unary-expr, or a (.
+ * !is_operand == expecting a binary operator, or a ).
+ *
+ * When a &&, || or ? is pushed, its left operand is already known. If that
+ * makes the right operand irrelevant, the operator is marked dead; the
+ * operators parsed while num_dead > 0 are still reduced, to keep the stacks
+ * in shape, but their results are discarded, and they do not fail.
+ * The common case performs no allocations.
  */
-/* this is the tokens, out is the stack. out init by the caller */
+/* this is the tokens */
 static
-err_t cpp_tokens_to_rpn_stack(struct cpp_tokens *this,
-							  struct rpn_stack *out)
+err_t cpp_tokens_evaluate_expression(struct cpp_tokens *this,
+									 uintmax_t *out)
 {
 	err_t err;
-	int state, i, num_left_parens, num_question_marks;
-	enum lexer_token_type type, operator;
+	int i, num_dead;
+	bool is_operand;
+	uintmax_t value;
+	enum lexer_token_type type;
 	struct cpp_token *token;
-	struct rpn_stack op_stk;
-	struct rpn_stack_entry entry;
+	struct expr_stack operators, operands;
+	struct expr_stack_entry entry, *top;
 
 #if 1
 	CPP_TOKENS_FOR_EACH(this, i, token) {
@@ -1274,146 +2216,117 @@ err_t cpp_tokens_to_rpn_stack(struct cpp_tokens *this,
 	}
 	printf("\n");
 #endif
-	rpn_stack_init(&op_stk);
-	state = num_left_parens = num_question_marks = 0;
-	while (!cpp_tokens_is_empty(this)) {
+	expr_stack_init(&operators);
+	expr_stack_init(&operands);
+	err = ESUCCESS;
+	num_dead = 0;
+	is_operand = true;
+	while (!err && !cpp_tokens_is_empty(this)) {
 		token = cpp_tokens_remove_head(this);
-		type = operator = cpp_token_type(token);
+		type = cpp_token_type(token);
+
+		entry.u.operator = type;
+		entry.is_signed = entry.is_dead = false;
+		entry.precedence = 0;
 
 		/* if expecting operand, then scan a unary-expression. */
-		if (state == 0) {
-			/* left-paren is allowed only in state 0 */
-			if (type == LXR_TOKEN_LEFT_PAREN) {
-				cpp_token_delete(token);
-				entry.type = RPN_STACK_ENTRY_OPERATOR;
-				entry.u.operator = operator;
-				err = rpn_stack_push(&op_stk, &entry);
-				if (err)
-					return err;
-				++num_left_parens;
-				continue;
-			}
-
-			/* delete the token for non-numbers */
-			if (type != LXR_TOKEN_NUMBER)
-				cpp_token_delete(token);
-
-			/* If this is a + unary op, ignore */
-			if (type == LXR_TOKEN_PLUS)
-				continue;
-
-			/* Unary operators */
-			if (operator == LXR_TOKEN_MINUS ||
-				operator == LXR_TOKEN_LOGICAL_NOT ||
-				operator == LXR_TOKEN_BITWISE_NOT) {
-				if (operator == LXR_TOKEN_MINUS)
-					operator = LXR_TOKEN_UNARY_MINUS;
-				err = rpn_stack_push_operator(&op_stk, out, operator);
-				if (err)
-					return err;
+		if (is_operand) {
+			switch (type) {
+			case LXR_TOKEN_PLUS:	/* If this is a + unary op, ignore */
+				break;
+			case LXR_TOKEN_MINUS:
+				entry.u.operator = LXR_TOKEN_UNARY_MINUS;
+				/* fall through */
+			case LXR_TOKEN_LOGICAL_NOT:
+			case LXR_TOKEN_BITWISE_NOT:
+			case LXR_TOKEN_LEFT_PAREN:
 				/* stay in the same state for more unary-op, etc. */
-				continue;
+				err = expr_stack_push(&operators, &entry);
+				break;
+			case LXR_TOKEN_NUMBER:
+				err = cpp_token_scan_integer(token, &entry);
+				if (!err)
+					err = expr_stack_push(&operands, &entry);
+				is_operand = false;	/* change state to expect a binary op */
+				break;
+			default:
+				err = EINVAL;
+				break;
 			}
-
-			/*
-			 * Scan an operand, and push on to the output stack.
-			 * Change the state to expecting a binary operand.
-			 */
-			if (type != LXR_TOKEN_NUMBER)
-				return EINVAL;
-
-			err = cpp_token_scan_rpn_integer(token, &entry);
 			cpp_token_delete(token);
-			if (!err)
-				err = rpn_stack_push(out, &entry);
-			if (err)
-				return err;
-			state = 1;	/* change state to expect a binary op */
 			continue;
-		}	/* state == 0 */
-
-		assert(state == 1);
+		}
 		cpp_token_delete(token);
 
-		/* We expect right-paren after reading a number. i.e. in state = 1*/
+		/* after reading a right-paren, we stay in the same state. */
 		if (type == LXR_TOKEN_RIGHT_PAREN) {
-			assert(num_left_parens);
-			/*
-			 * as long as we do not see a left-paren, pop entries off of the
-			 * op_stk and push them onto the out stack
-			 */
-			while (!rpn_stack_is_empty(&op_stk)) {
-				entry = rpn_stack_peek(&op_stk);
-				if (entry.type == RPN_STACK_ENTRY_OPERATOR &&
-					entry.u.operator == LXR_TOKEN_LEFT_PAREN)
-					break;
-				rpn_stack_pop(&op_stk);
-				err = rpn_stack_push(out, &entry);
-				if (err)
-					return err;
-			}
-			if (rpn_stack_is_empty(&op_stk))
-				return EINVAL;
-			rpn_stack_pop(&op_stk);	/* pop the left-paren */
-			/* after reading a right-paren, we stay in the same state. */
-			--num_left_parens;
+			err = expr_stack_reduce_until(&operators, &operands,
+										  LXR_TOKEN_LEFT_PAREN, &num_dead);
+			if (!err)
+				expr_stack_pop(&operators);	/* pop the left-paren */
 			continue;
 		}
 
-		/* first 3 are unary ops */
-		for (i = 3; i < (int)ARRAY_SIZE(g_rpn_operator_precedence); ++i) {
-			if (operator == g_rpn_operator_precedence[i].operator)
-				break;
+		/*
+		 * The colon completes the middle operand of the corresponding ?.
+		 * Turn the ? into a :, whose right operand is dead if the condition
+		 * was true. The condition is below the middle operand.
+		 */
+		if (type == LXR_TOKEN_COLON) {
+			err = expr_stack_reduce_until(&operators, &operands,
+										  LXR_TOKEN_CONDITIONAL, &num_dead);
+			if (!err && expr_stack_num_entries(&operands) < 2)
+				err = EINVAL;
+			if (err)
+				continue;
+			top = expr_stack_peek(&operators, 0);
+			if (top->is_dead)
+				--num_dead;
+			top->u.operator = type;
+			top->precedence = expr_binary_operator_precedence(type);
+			top->is_dead = expr_stack_peek(&operands, 1)->u.value != 0;
+			if (top->is_dead)
+				++num_dead;
+			is_operand = true;
+			continue;
 		}
-		/* invalid binary op */
-		if (i == (int)ARRAY_SIZE(g_rpn_operator_precedence))
-			return EINVAL;
-		/* The colon for question-mark is expected when in state 1 */
-		if (operator == LXR_TOKEN_CONDITIONAL) {
-			++num_question_marks;
-		} else if (operator == LXR_TOKEN_COLON) {
-			assert(num_question_marks);
-			--num_question_marks;
-		}
-		err = rpn_stack_push_operator(&op_stk, out, operator);
-		if (err)
-			return err;
-		state = 0;	/* after binary op, go back to wanting operands. */
-	}
-	if (err)
-		return err;
 
-	/* If there's entries in the op_stk, push them onto the out */
-	while (!rpn_stack_is_empty(&op_stk)) {
-		entry = rpn_stack_pop(&op_stk);
-		err = rpn_stack_push(out, &entry);
+		entry.precedence = expr_binary_operator_precedence(type);
+		if (entry.precedence == EOF) {
+			err = EINVAL;	/* invalid binary op */
+			continue;
+		}
+		err = expr_stack_reduce_tighter(&operators, &operands,
+										entry.precedence, &num_dead);
 		if (err)
-			return err;
-	}
-	return err;
-}
+			continue;
 
-/* this is the tokens */
-static
-err_t cpp_tokens_evaluate_expression(struct cpp_tokens *this,
-									 int *out)
-{
-	err_t err;
-	struct rpn_stack stk;
-	struct rpn_stack_entry result;
+		/* The left operand is complete; check if it decides the result. */
+		if (type == LXR_TOKEN_LOGICAL_AND ||
+			type == LXR_TOKEN_LOGICAL_OR ||
+			type == LXR_TOKEN_CONDITIONAL) {
+			value = expr_stack_peek(&operands, 0)->u.value;
+			entry.is_dead = type == LXR_TOKEN_LOGICAL_OR ? value != 0 :
+				value == 0;
+			if (entry.is_dead)
+				++num_dead;
+		}
+		err = expr_stack_push(&operators, &entry);
+		is_operand = true;	/* after binary op, go back to wanting operands. */
+	}
 
-	rpn_stack_init(&stk);
-	err = cpp_tokens_to_rpn_stack(this, &stk);
-	if (err)
-		return err;
-	assert(cpp_tokens_is_empty(this));
-	assert(!rpn_stack_is_empty(&stk));
-	err = rpn_stack_evaluate(&stk, &result);
-	if (err)
-		return err;
-	assert(rpn_stack_is_empty(&stk));
-	assert(result.type != RPN_STACK_ENTRY_OPERATOR);
-	*out = result.u.value ? 1 : 0;
+	/* An expression can't end while expecting an operand. */
+	if (!err && is_operand)
+		err = EINVAL;
+	while (!err && !expr_stack_is_empty(&operators))
+		err = expr_stack_reduce(&operators, &operands, &num_dead);
+	if (!err && expr_stack_num_entries(&operands) != 1)
+		err = EINVAL;
+	if (!err)
+		*out = expr_stack_peek(&operands, 0)->u.value;
+	expr_stack_empty(&operators);
+	expr_stack_empty(&operands);
+	cpp_tokens_empty(this);
 	return err;
 }
 
@@ -1438,96 +2351,35 @@ bool cond_incl_stack_in_skip_zone(const struct cond_incl_stack *this)
 	return false;
 }
 
-/* line has tokens after #if */
+/*
+ * Expands the tokens of a constant expression, and evaluates them. Used by
+ * #if, after it replaces the defined operators, and by #embed limit.
+ */
 static
-err_t scanner_scan_directive_if(struct scanner *this,
-								struct cpp_tokens *line)
+err_t scanner_evaluate_expression(struct scanner *this,
+								  struct cpp_tokens *tokens,
+								  uintmax_t *out)
 {
 	err_t err;
 	int num;
 	bool has_white_space, is_first;
 	enum lexer_token_type type;
-	bool has_left_paren;
-	const char *name, *str;
-	struct cpp_token *token, *ident;
-	struct cpp_tokens tokens, exp_line;
-	struct cond_incl_stack_entry entry;
-	struct cond_incl_stack *cistk;
+	const char *str;
+	struct cpp_token *token;
+	struct cpp_tokens exp_line;
 	char32_t cp;
 
-	/* There should be tokens */
-	if (cpp_tokens_is_empty(line))
-		return EINVAL;
-
-	cpp_tokens_init(&tokens);
 	cpp_tokens_init(&exp_line);
 
-	cistk = &this->cistk;
-	entry.type = LXR_TOKEN_DIRECTIVE_IF;
-
-	/* If we are already inside a skip zone, just place done */
-	if (cond_incl_stack_in_skip_zone(cistk)) {
-		entry.state = COND_INCL_STATE_DONE;
-		return cond_incl_stack_push(cistk, &entry);
-	}
-
-	/* Scan defined ident, defined(ident) first. */
-	while (!cpp_tokens_is_empty(line)) {
-		token = cpp_tokens_remove_head(line);
-		if (cpp_token_type(token) != LXR_TOKEN_DEFINED) {
-			err = cpp_tokens_add_tail(&tokens, token);
-			if (err)
-				return err;
-			continue;
-		}
-
-		/* Found a defined. Save its props. */
-		has_white_space = cpp_token_has_white_space(token);
-		is_first = cpp_token_is_first(token);
-		cpp_token_delete(token);
-		if (cpp_tokens_is_empty(line))
-			return EINVAL;
-
-		has_left_paren = false;
-		token = cpp_tokens_remove_head(line);
-		if (cpp_token_type(token) == LXR_TOKEN_LEFT_PAREN) {
-			if (cpp_tokens_is_empty(line))
-				return EINVAL;
-			cpp_token_delete(token);
-			has_left_paren = true;
-			token = cpp_tokens_remove_head(line);
-		}
-		if (!cpp_token_is_identifier(token))
-			return EINVAL;
-		ident = token;
-		if (has_left_paren) {
-			if (cpp_tokens_is_empty(line))
-				return EINVAL;
-			token = cpp_tokens_remove_head(line);
-			if (cpp_token_type(token) != LXR_TOKEN_RIGHT_PAREN)
-				return EINVAL;
-			cpp_token_delete(token);
-		}
-		name = cpp_token_resolved(ident);
-		num = scanner_find_macro(this, name) ? 1 : 0;
-		cpp_token_delete(ident);
-		err = cpp_token_new_number(num, has_white_space, is_first, &token);
-		if (!err)
-			err = cpp_tokens_add_tail(&tokens, token);
-		if (err)
-			return err;
-	}
-	assert(cpp_tokens_is_empty(line));
-	assert(!cpp_tokens_is_empty(&tokens));
-
 	/* Now expand. repurpose expand_argument function */
-	err = scanner_expand_argument(this, &tokens, &exp_line);
-	cpp_tokens_empty(&tokens);
+	err = scanner_expand_argument(this, tokens, &exp_line);
+	cpp_tokens_empty(tokens);
 	if (err)
 		return err;
 
 	/* true is replaced with 1, all other identifiers are replaced with 0 */
-	assert(!cpp_tokens_is_empty(&exp_line));
+	if (cpp_tokens_is_empty(&exp_line))
+		return EINVAL;	/* Expanded into nothing */
 	while (!cpp_tokens_is_empty(&exp_line)) {
 		token = cpp_tokens_remove_head(&exp_line);
 		type = cpp_token_type(token);
@@ -1550,7 +2402,7 @@ err_t scanner_scan_directive_if(struct scanner *this,
 		 */
 		if (!cpp_token_is_identifier(token) &&
 			!cpp_token_is_char_const(token)) {
-			err = cpp_tokens_add_tail(&tokens, token);
+			err = cpp_tokens_add_tail(tokens, token);
 			if (err)
 				return err;
 			continue;
@@ -1584,74 +2436,444 @@ err_t scanner_scan_directive_if(struct scanner *this,
 		assert(num >= 0);
 		err = cpp_token_new_number(num, has_white_space, is_first, &token);
 		if (!err)
-			err = cpp_tokens_add_tail(&tokens, token);
+			err = cpp_tokens_add_tail(tokens, token);
 		if (err)
 			return err;
 	}
 	assert(cpp_tokens_is_empty(&exp_line));
-	assert(!cpp_tokens_is_empty(&tokens));
+	assert(!cpp_tokens_is_empty(tokens));
+	return cpp_tokens_evaluate_expression(tokens, out);
+}
 
-	err = cpp_tokens_evaluate_expression(&tokens, &num);
-	if (err)
-		return err;
-	assert(cpp_tokens_is_empty(&tokens));
+/* __has_include_next is not a lexer key-word */
+static
+bool cpp_token_is_has_include_next(const struct cpp_token *this)
+{
+	return (cpp_token_type(this) == LXR_TOKEN_IDENTIFIER &&
+			!strcmp(cpp_token_resolved(this), "__has_include_next"));
+}
 
-	/* Default is to wait */
-	entry.state = COND_INCL_STATE_WAIT;
-	if (num)
-		entry.state = COND_INCL_STATE_SCAN;
-	return cond_incl_stack_push(cistk, &entry);
+/*
+ * For defined, #ifdef, #ifndef, #elifdef and #elifndef. The __has_ probes are
+ * defined, as macros would be.
+ */
+static
+bool scanner_is_defined(const struct scanner *this,
+						const struct cpp_token *ident)
+{
+	enum lexer_token_type type;
+
+	type = cpp_token_type(ident);
+	if (type == LXR_TOKEN_HAS_INCLUDE || type == LXR_TOKEN_HAS_EMBED ||
+		cpp_token_is_has_include_next(ident))
+		return true;
+	return scanner_find_macro(this, cpp_token_resolved(ident)) != NULL;
 }
 
-/* line has tokens after #elif */
+/*
+ * line has the tokens after #if/#elif. Evaluate the defined operators and the
+ * __has_ probes, and then the expression.
+ */
 static
-err_t scanner_scan_directive_elif(struct scanner *this,
-								  struct cpp_tokens *line)
+err_t scanner_evaluate_condition(struct scanner *this,
+								 struct cpp_tokens *line,
+								 const char *dir_path,	/* for __has_include */
+								 uintmax_t *out)
 {
-	struct cond_incl_stack *cistk;
-	struct cond_incl_stack_entry entry;
+	err_t err;
+	int num;
+	bool has_white_space, is_first, is_next;
+	bool has_left_paren;
+	enum lexer_token_type type;
+	struct cpp_token *token, *ident;
+	struct cpp_tokens tokens;
 
-	/* empty #elif is invalid */
-	if (cpp_tokens_is_empty(line))
-		return EINVAL;
+	cpp_tokens_init(&tokens);
 
-	cistk = &this->cistk;
-	assert(!cond_incl_stack_is_empty(cistk));
+	/* Scan defined ident, defined(ident), and the __has_ probes first. */
+	while (!cpp_tokens_is_empty(line)) {
+		token = cpp_tokens_remove_head(line);
+		type = cpp_token_type(token);
+		is_next = cpp_token_is_has_include_next(token);
+		if (type == LXR_TOKEN_HAS_INCLUDE || type == LXR_TOKEN_HAS_EMBED ||
+			is_next) {
+			has_white_space = cpp_token_has_white_space(token);
+			is_first = cpp_token_is_first(token);
+			cpp_token_delete(token);
+			err = scanner_evaluate_has_include(this, type, is_next, line,
+											   dir_path, &num);
+			if (!err)
+				err = cpp_token_new_number(num, has_white_space, is_first,
+										   &token);
+			if (!err)
+				err = cpp_tokens_add_tail(&tokens, token);
+			if (err)
+				return err;
+			continue;
+		}
+		if (type != LXR_TOKEN_DEFINED) {
+			err = cpp_tokens_add_tail(&tokens, token);
+			if (err)
+				return err;
+			continue;
+		}
 
-	/* We must pop as the later in_skip_zone calc works with a stale value. */
-	/* If the tos has else, invalid */
-	entry = cond_incl_stack_pop(cistk);
-	if (entry.type == LXR_TOKEN_DIRECTIVE_ELSE)
-		return EINVAL;
-	assert(entry.type == LXR_TOKEN_DIRECTIVE_IF);
+		/* Found a defined. Save its props. */
+		has_white_space = cpp_token_has_white_space(token);
+		is_first = cpp_token_is_first(token);
+		cpp_token_delete(token);
+		if (cpp_tokens_is_empty(line))
+			return EINVAL;
 
-	/* If the if was in scan/done state, or we are in skip-zone, done */
-	if (entry.state == COND_INCL_STATE_SCAN ||
-		entry.state == COND_INCL_STATE_DONE ||
-		cond_incl_stack_in_skip_zone(cistk)) {
-		entry.state = COND_INCL_STATE_DONE;
-		return cond_incl_stack_push(cistk, &entry);
+		has_left_paren = false;
+		token = cpp_tokens_remove_head(line);
+		if (cpp_token_type(token) == LXR_TOKEN_LEFT_PAREN) {
+			if (cpp_tokens_is_empty(line))
+				return EINVAL;
+			cpp_token_delete(token);
+			has_left_paren = true;
+			token = cpp_tokens_remove_head(line);
+		}
+		if (!cpp_token_is_identifier(token))
+			return EINVAL;
+		ident = token;
+		if (has_left_paren) {
+			if (cpp_tokens_is_empty(line))
+				return EINVAL;
+			token = cpp_tokens_remove_head(line);
+			if (cpp_token_type(token) != LXR_TOKEN_RIGHT_PAREN)
+				return EINVAL;
+			cpp_token_delete(token);
+		}
+		num = scanner_is_defined(this, ident) ? 1 : 0;
+		cpp_token_delete(ident);
+		err = cpp_token_new_number(num, has_white_space, is_first, &token);
+		if (!err)
+			err = cpp_tokens_add_tail(&tokens, token);
+		if (err)
+			return err;
 	}
-	/* We aren't in a skip-zone. Place appropriate state. */
-	return scanner_scan_directive_if(this, line);
+	assert(cpp_tokens_is_empty(line));
+	assert(!cpp_tokens_is_empty(&tokens));
+
+	return scanner_evaluate_expression(this, &tokens, out);
 }
 
-static inline
-err_t scanner_scan_directive_end_if(struct scanner *this)
+/*****************************************************************************/
+static
+void if_dep_delete(void *p)
 {
-	struct cond_incl_stack *cistk;
-
-	cistk = &this->cistk;
-	assert(!cond_incl_stack_is_empty(cistk));
-	cond_incl_stack_pop(cistk);
-	return ESUCCESS;
+	struct if_dep *this = p;
+	free((void *)this->name);
+	free(this);
 }
 
 static
-err_t scanner_scan_directive_else(struct scanner *this)
+void if_result_delete(void *p)
 {
-	struct cond_incl_stack *cistk;
-	struct cond_incl_stack_entry entry;
+	struct if_result *this = p;
+	ptrq_empty(&this->deps);
+	free(this->key);
+	free(this);
+}
+
+/*
+ * The FNV-1a hash of the sources of the tokens. Conditions with the __has_
+ * probes depend on the includer and the file-system, and are not memoized.
+ */
+static
+bool cpp_tokens_if_result_hash(const struct cpp_tokens *this,
+							   uint64_t *out,
+							   size_t *out_size)
+{
+	int i;
+	size_t size;
+	uint64_t hash;
+	enum lexer_token_type type;
+	const char *str;
+	const struct cpp_token *token;
+
+	hash = 0xcbf29ce484222325ull;
+	size = 0;
+	CPP_TOKENS_FOR_EACH(this, i, token) {
+		type = cpp_token_type(token);
+		if (type == LXR_TOKEN_HAS_INCLUDE || type == LXR_TOKEN_HAS_EMBED ||
+			cpp_token_is_has_include_next(token))
+			return false;
+		/* Include the NUL, so that "a b" and "ab" differ. */
+		str = cpp_token_source(token);
+		do {
+			hash ^= (uint8_t)*str;
+			hash *= 0x100000001b3ull;
+			++size;
+		} while (*str++);
+	}
+	*out = hash;
+	*out_size = size;
+	return true;
+}
+
+static
+bool if_result_key_equals(const struct if_result *this,
+						  const struct cpp_tokens *line)
+{
+	int i;
+	size_t len, pos;
+	const char *str;
+	const struct cpp_token *token;
+
+	pos = 0;
+	CPP_TOKENS_FOR_EACH(line, i, token) {
+		str = cpp_token_source(token);
+		len = strlen(str) + 1;
+		if (pos + len > this->key_size || memcmp(this->key + pos, str, len))
+			return false;
+		pos += len;
+	}
+	return pos == this->key_size;
+}
+
+static
+err_t if_result_new(const struct cpp_tokens *line,
+					const uint64_t hash,
+					const size_t key_size,
+					struct if_result **out)
+{
+	int i;
+	size_t len, pos;
+	const char *str;
+	const struct cpp_token *token;
+	struct if_result *this;
+
+	this = malloc(sizeof(*this));
+	if (this == NULL)
+		return ENOMEM;
+	this->key = malloc(key_size);
+	if (this->key == NULL) {
+		free(this);
+		return ENOMEM;
+	}
+	pos = 0;
+	CPP_TOKENS_FOR_EACH(line, i, token) {
+		str = cpp_token_source(token);
+		len = strlen(str) + 1;
+		memcpy(this->key + pos, str, len);
+		pos += len;
+	}
+	assert(pos == key_size);
+	this->hash = hash;
+	this->key_size = key_size;
+	ptrq_init(&this->deps, if_dep_delete);
+	this->generation = 0;
+	this->is_invalid = false;
+	this->value = 0;
+	*out = this;
+	return ESUCCESS;
+}
+
+/* Called on each lookup of a macro, while evaluating a condition. */
+static
+void scanner_note_if_macro_read(const struct scanner *this,
+								const char *name,
+								const struct macro *macro)
+{
+	int i;
+	err_t err;
+	struct if_dep *dep;
+	struct if_result *result;
+
+	result = this->if_recorder;
+	PTRQ_FOR_EACH(&result->deps, i, dep) {
+		if (!strcmp(dep->name, name))
+			return;
+	}
+
+	err = ENOMEM;
+	dep = malloc(sizeof(*dep));
+	if (dep) {
+		dep->name = strdup(name);
+		dep->generation = macro ? macro->generation : 0;
+		err = dep->name ? ptrq_add_tail(&result->deps, dep) : ENOMEM;
+		if (err)
+			if_dep_delete(dep);
+	}
+	/* A result with missing deps can't be trusted. */
+	if (err)
+		result->is_invalid = true;
+}
+
+/*
+ * If no macro was (un)defined since the result was last found valid, it is
+ * still valid. Else, look up each dep again. The lookups are also needed if an
+ * include is being recorded, for it depends on these macros too.
+ */
+static
+bool scanner_check_if_result(const struct scanner *this,
+							 struct if_result *result)
+{
+	int i;
+	uint64_t generation;
+	const struct if_dep *dep;
+	const struct macro *macro;
+
+	if (result->generation == this->macros_generation &&
+		ptrq_is_empty(&this->include_recorders))
+		return true;
+
+	PTRQ_FOR_EACH(&result->deps, i, dep) {
+		macro = scanner_find_macro(this, dep->name);
+		generation = macro ? macro->generation : 0;
+		if (generation != dep->generation)
+			return false;
+	}
+	result->generation = this->macros_generation;
+	return true;
+}
+
+/*
+ * glibc and the kernel headers test the same conditions, e.g.
+ * __GNUC_PREREQ (4, 8), many times over. Memoize their values.
+ */
+static
+err_t scanner_evaluate_condition_cached(struct scanner *this,
+										struct cpp_tokens *line,
+										const char *dir_path,
+										uintmax_t *out)
+{
+	int i;
+	err_t err;
+	size_t key_size;
+	uint64_t hash;
+	struct if_result *result;
+
+	if (!cpp_tokens_if_result_hash(line, &hash, &key_size))
+		return scanner_evaluate_condition(this, line, dir_path, out);
+
+	PTRQ_FOR_EACH(&this->if_results, i, result) {
+		if (result->hash != hash || !if_result_key_equals(result, line))
+			continue;
+		if (!scanner_check_if_result(this, result))
+			break;
+		++this->num_if_hits;
+		cpp_tokens_empty(line);
+		*out = result->value;
+		return ESUCCESS;
+	}
+	/* Found a stale result. */
+	if (result)
+		ptrq_delete_entry(&this->if_results, i);
+	++this->num_if_misses;
+
+	err = if_result_new(line, hash, key_size, &result);
+	if (err)
+		return err;
+
+	assert(this->if_recorder == NULL);
+	this->if_recorder = result;
+	err = scanner_evaluate_condition(this, line, dir_path, out);
+	this->if_recorder = NULL;
+
+	if (err || result->is_invalid) {
+		if_result_delete(result);
+		return err;
+	}
+	result->value = *out;
+	result->generation = this->macros_generation;
+	if (ptrq_num_entries(&this->if_results) == IF_RESULTS_MAX)
+		ptrq_delete_head(&this->if_results);
+	err = ptrq_add_tail(&this->if_results, result);
+	if (err)
+		if_result_delete(result);
+	return err;
+}
+/*****************************************************************************/
+/* line has tokens after #if */
+static
+err_t scanner_scan_directive_if(struct scanner *this,
+								struct cpp_tokens *line,
+								const char *dir_path)	/* for __has_include */
+{
+	err_t err;
+	uintmax_t value;
+	struct cond_incl_stack_entry entry;
+	struct cond_incl_stack *cistk;
+
+	/* There should be tokens */
+	if (cpp_tokens_is_empty(line))
+		return EINVAL;
+
+	cistk = &this->cistk;
+	entry.type = LXR_TOKEN_DIRECTIVE_IF;
+
+	/* If we are already inside a skip zone, just place done */
+	if (cond_incl_stack_in_skip_zone(cistk)) {
+		entry.state = COND_INCL_STATE_DONE;
+		return cond_incl_stack_push(cistk, &entry);
+	}
+
+	value = 0;
+	err = scanner_evaluate_condition_cached(this, line, dir_path, &value);
+	if (err)
+		return err;
+	assert(cpp_tokens_is_empty(line));
+
+	/* Default is to wait */
+	entry.state = COND_INCL_STATE_WAIT;
+	if (value)
+		entry.state = COND_INCL_STATE_SCAN;
+	return cond_incl_stack_push(cistk, &entry);
+}
+
+/* line has tokens after #elif */
+static
+err_t scanner_scan_directive_elif(struct scanner *this,
+								  struct cpp_tokens *line,
+								  const char *dir_path)
+{
+	struct cond_incl_stack *cistk;
+	struct cond_incl_stack_entry entry;
+
+	/* empty #elif is invalid */
+	if (cpp_tokens_is_empty(line))
+		return EINVAL;
+
+	cistk = &this->cistk;
+	assert(!cond_incl_stack_is_empty(cistk));
+
+	/* We must pop as the later in_skip_zone calc works with a stale value. */
+	/* If the tos has else, invalid */
+	entry = cond_incl_stack_pop(cistk);
+	if (entry.type == LXR_TOKEN_DIRECTIVE_ELSE)
+		return EINVAL;
+	assert(entry.type == LXR_TOKEN_DIRECTIVE_IF);
+
+	/* If the if was in scan/done state, or we are in skip-zone, done */
+	if (entry.state == COND_INCL_STATE_SCAN ||
+		entry.state == COND_INCL_STATE_DONE ||
+		cond_incl_stack_in_skip_zone(cistk)) {
+		entry.state = COND_INCL_STATE_DONE;
+		return cond_incl_stack_push(cistk, &entry);
+	}
+	/* We aren't in a skip-zone. Place appropriate state. */
+	return scanner_scan_directive_if(this, line, dir_path);
+}
+
+static inline
+err_t scanner_scan_directive_end_if(struct scanner *this)
+{
+	struct cond_incl_stack *cistk;
+
+	cistk = &this->cistk;
+	assert(!cond_incl_stack_is_empty(cistk));
+	cond_incl_stack_pop(cistk);
+	return ESUCCESS;
+}
+
+static
+err_t scanner_scan_directive_else(struct scanner *this)
+{
+	struct cond_incl_stack *cistk;
+	struct cond_incl_stack_entry entry;
 
 	cistk = &this->cistk;
 	assert(!cond_incl_stack_is_empty(cistk));
@@ -1685,11 +2907,10 @@ err_t scanner_scan_directive_elifdef(struct scanner *this,
 									 const bool is_ndef,
 									 struct cpp_tokens *line)
 {
+	bool is_defined;
 	struct cond_incl_stack *cistk;
 	struct cond_incl_stack_entry entry;
-	const char *name;
 	struct cpp_token *token;
-	const struct macro *macro;
 
 	/* #ifndef without identifier is invalid. */
 	if (cpp_tokens_is_empty(line))
@@ -1712,6 +2933,7 @@ err_t scanner_scan_directive_elifdef(struct scanner *this,
 	if (entry.state == COND_INCL_STATE_SCAN ||
 		entry.state == COND_INCL_STATE_DONE ||
 		cond_incl_stack_in_skip_zone(cistk)) {
+		cpp_token_delete(token);
 		entry.state = COND_INCL_STATE_DONE;
 		return cond_incl_stack_push(cistk, &entry);
 	}
@@ -1719,9 +2941,9 @@ err_t scanner_scan_directive_elifdef(struct scanner *this,
 	/* We aren't in a skip-zone. Place appropriate state. */
 	/* Default is to wait */
 	entry.state = COND_INCL_STATE_WAIT;
-	name = cpp_token_resolved(token);
-	macro = scanner_find_macro(this, name);
-	if ((is_ndef && macro == NULL) || (!is_ndef && macro))
+	is_defined = scanner_is_defined(this, token);
+	cpp_token_delete(token);
+	if (is_ndef != is_defined)
 		entry.state = COND_INCL_STATE_SCAN;	/* true. */
 	return cond_incl_stack_push(cistk, &entry);
 }
@@ -1732,11 +2954,10 @@ err_t scanner_scan_directive_ifdef(struct scanner *this,
 								   const bool is_ndef,
 								   struct cpp_tokens *line)
 {
+	bool is_defined;
 	struct cond_incl_stack_entry entry;
 	struct cond_incl_stack *cistk;
-	const char *name;
 	struct cpp_token *token;
-	const struct macro *macro;
 
 	/* #if[n]def without identifier is invalid. */
 	if (cpp_tokens_is_empty(line))
@@ -1759,59 +2980,455 @@ err_t scanner_scan_directive_ifdef(struct scanner *this,
 
 	/* Default is to wait */
 	entry.state = COND_INCL_STATE_WAIT;
-	name = cpp_token_resolved(token);
-	macro = scanner_find_macro(this, name);
+	is_defined = scanner_is_defined(this, token);
 	cpp_token_delete(token);
-	if ((is_ndef && macro == NULL) || (!is_ndef && macro))
+	if (is_ndef != is_defined)
 		entry.state = COND_INCL_STATE_SCAN;	/* true. */
 	return cond_incl_stack_push(cistk, &entry);
 }
 /*****************************************************************************/
-/* line starts after # */
+/*
+ * #embed writes the resource as a single LXR_TOKEN_EMBED record: the path of
+ * the resource, and the number of its leading bytes to embed. The bytes are
+ * not read here; the parser maps the file and expands the record into the
+ * comma-separated byte-list only as it consumes the tokens.
+ */
+struct embed_params {
+	bool	has_limit;
+	uintmax_t	limit;
+	struct cpp_tokens	prefix;
+	struct cpp_tokens	suffix;
+	struct cpp_tokens	if_empty;
+};
+
 static
-err_t scanner_scan_directive(struct scanner *this,
-							 struct cpp_tokens *line,
-							 const char *lexer_dir_path)	/* for includes */
+void embed_params_init(struct embed_params *this)
 {
-	enum lexer_token_type type;
-	struct cond_incl_stack *cistk;
-	struct cpp_token *token;
+	this->has_limit = false;
+	this->limit = 0;
+	cpp_tokens_init(&this->prefix);
+	cpp_tokens_init(&this->suffix);
+	cpp_tokens_init(&this->if_empty);
+}
 
-	if (cpp_tokens_is_empty(line))	/* # new-line. no effect. */
-		return ESUCCESS;
+static
+void embed_params_empty(struct embed_params *this)
+{
+	cpp_tokens_empty(&this->prefix);
+	cpp_tokens_empty(&this->suffix);
+	cpp_tokens_empty(&this->if_empty);
+}
 
-	cistk = &this->cistk;
+/*
+ * The line begins with a (. Moves the tokens within it, up to the matching ),
+ * into out. The parentheses are deleted.
+ */
+static
+err_t cpp_tokens_remove_parenthesized(struct cpp_tokens *line,
+									  struct cpp_tokens *out)
+{
+	err_t err;
+	int depth;
+	struct cpp_token *token;
+	enum lexer_token_type type;
+
+	if (cpp_tokens_is_empty(line))
+		return EINVAL;
 	token = cpp_tokens_remove_head(line);
 	type = cpp_token_type(token);
 	cpp_token_delete(token);
+	if (type != LXR_TOKEN_LEFT_PAREN)
+		return EINVAL;
 
-	/* if/else when scanning directives are actually #if and #else */
-	if (type == LXR_TOKEN_IF)
-		type = LXR_TOKEN_DIRECTIVE_IF;
-	if (type == LXR_TOKEN_ELSE)
-		type = LXR_TOKEN_DIRECTIVE_ELSE;
+	depth = 1;
+	while (!cpp_tokens_is_empty(line)) {
+		token = cpp_tokens_remove_head(line);
+		type = cpp_token_type(token);
+		if (type == LXR_TOKEN_LEFT_PAREN)
+			++depth;
+		else if (type == LXR_TOKEN_RIGHT_PAREN)
+			--depth;
+		if (depth == 0) {
+			cpp_token_delete(token);
+			return ESUCCESS;
+		}
+		err = cpp_tokens_add_tail(out, token);
+		if (err)
+			return err;
+	}
+	return EINVAL;	/* closing ) not found */
+}
 
-	/* These constructs are peers to #if constructs. Handle them first. */
-	switch (type) {
-	case LXR_TOKEN_DIRECTIVE_ELSE_IF_DEFINED:
-	case LXR_TOKEN_DIRECTIVE_ELSE_IF_NOT_DEFINED:
-	case LXR_TOKEN_DIRECTIVE_ELSE_IF:
-	case LXR_TOKEN_DIRECTIVE_ELSE:
-	case LXR_TOKEN_DIRECTIVE_END_IF:
-		/* The cistk shouldn't be empty */
-		if (cond_incl_stack_is_empty(cistk))
+/* limit(expr), prefix(...), suffix(...), if_empty(...), or __limit__ etc. */
+static
+err_t scanner_scan_embed_params(struct scanner *this,
+								struct cpp_tokens *line,
+								struct embed_params *out)
+{
+	err_t err;
+	size_t len;
+	const char *name;
+	struct cpp_token *token;
+	struct cpp_tokens tokens, *param;
+
+	while (!cpp_tokens_is_empty(line)) {
+		token = cpp_tokens_remove_head(line);
+		if (!cpp_token_is_identifier(token)) {
+			cpp_token_delete(token);
 			return EINVAL;
-		break;
-	default:
-		break;
-	}
+		}
+
+		/* __name__ is the same as name */
+		name = cpp_token_resolved(token);
+		len = strlen(name);
+		if (len > 4 && !strncmp(name, "__", 2) &&
+			!strcmp(&name[len - 2], "__")) {
+			name += 2;
+			len -= 4;
+		}
+
+		param = NULL;
+		err = ESUCCESS;
+		if (len == 6 && !strncmp(name, "prefix", len))
+			param = &out->prefix;
+		else if (len == 6 && !strncmp(name, "suffix", len))
+			param = &out->suffix;
+		else if (len == 8 && !strncmp(name, "if_empty", len))
+			param = &out->if_empty;
+		else if (len != 5 || strncmp(name, "limit", len))
+			err = ENOTSUP;	/* Unknown, or vendor::param */
+		cpp_token_delete(token);
+		if (err)
+			return err;
+
+		if (param) {
+			if (!cpp_tokens_is_empty(param))
+				return EINVAL;	/* Repeated */
+			err = cpp_tokens_remove_parenthesized(line, param);
+			if (err)
+				return err;
+			continue;
+		}
+
+		if (out->has_limit)
+			return EINVAL;
+		cpp_tokens_init(&tokens);
+		err = cpp_tokens_remove_parenthesized(line, &tokens);
+		if (!err && cpp_tokens_is_empty(&tokens))
+			err = EINVAL;
+		if (!err)
+			err = scanner_evaluate_expression(this, &tokens, &out->limit);
+		cpp_tokens_empty(&tokens);
+		if (err)
+			return err;
+		out->has_limit = true;
+	}
+	return ESUCCESS;
+}
+
+/*
+ * The line begins with a "..." or a < header-name. Removes its tokens, and
+ * looks it up. The path is owned by the memoized lookup.
+ */
+static
+err_t scanner_find_header(struct scanner *this,
+						  struct cpp_tokens *line,
+						  const char *dir_path,
+						  const int start,
+						  const char **out)
+{
+	err_t err;
+	char *name;
+	struct cpp_token *token;
+
+	token = cpp_tokens_remove_head(line);
+	if (cpp_token_type(token) == LXR_TOKEN_CHAR_STRING_LITERAL) {
+		err = scanner_find_qseq(this, dir_path, cpp_token_source(token),
+								start, out);
+		cpp_token_delete(token);
+		return err;
+	}
+	assert(cpp_token_type(token) == LXR_TOKEN_LESS_THAN);
+	cpp_token_delete(token);
+	err = cpp_tokens_remove_h_name(line, &name);
+	if (err)
+		return err;
+	err = scanner_find_hseq(this, name, start, out);
+	free(name);
+	return err;
+}
+
+/* The number of bytes to embed. ENOTSUP if the resource can't be mapped. */
+static
+err_t embed_params_size(const struct embed_params *this,
+						const char *path,
+						size_t *out)
+{
+	int ret;
+	size_t size;
+	struct stat stat_buf;
+
+	*out = 0;
+	ret = stat(path, &stat_buf);
+	if (ret < 0)
+		return errno;
+	if (!S_ISREG(stat_buf.st_mode))
+		return ENOTSUP;
+	size = stat_buf.st_size;
+	if (this->has_limit && this->limit < size)
+		size = this->limit;
+	*out = size;
+	return ESUCCESS;
+}
+
+/* prefix, suffix and if_empty are written as they are; not expanded. */
+static
+err_t scanner_serialize_embed_tokens(struct scanner *this,
+									 struct cpp_tokens *tokens)
+{
+	err_t err;
+	struct cpp_token *token;
+
+	err = ESUCCESS;
+	CPP_TOKENS_FOR_EACH_WITH_REMOVE(tokens, token) {
+		if (!err)
+			err = scanner_serialize_cpp_token(this, token);
+		cpp_token_delete(token);
+	}
+	return err;
+}
+
+/* type, path_len, path, nul, size */
+static
+err_t scanner_serialize_embed(struct scanner *this,
+							  const char *path,
+							  const size_t size)
+{
+	err_t err;
+	size_t len, path_len;
+	unsigned char buf[1 + TOKEN_FILE_VARINT_MAX];
+
+	path_len = strlen(path);
+	buf[0] = LXR_TOKEN_EMBED;
+	len = 1 + token_file_put_varint(&buf[1], path_len);
+	err = scanner_write_cpp_tokens(this, buf, len);
+	if (!err)
+		err = scanner_write_cpp_tokens(this, path, path_len + 1);
+	len = token_file_put_varint(buf, size);
+	if (!err)
+		err = scanner_write_cpp_tokens(this, buf, len);
+	return err;
+}
+
+static
+err_t scanner_scan_directive_embed(struct scanner *this,
+								   struct cpp_tokens *line,
+								   const char *dir_path)
+{
+	err_t err;
+	size_t size;
+	const char *path;
+	struct cpp_token *token;
+	struct cpp_tokens exp_line;
+	struct embed_params params;
+	enum lexer_token_type type;
+
+	if (cpp_tokens_is_empty(line))	/* no file-name */
+		return EINVAL;
+
+	token = cpp_tokens_peek_head(line);
+	type = cpp_token_type(token);
+	if (type != LXR_TOKEN_CHAR_STRING_LITERAL &&
+		type != LXR_TOKEN_LESS_THAN) {
+		/* The whole line is macro-expanded; repurpose expand_argument */
+		cpp_tokens_init(&exp_line);
+		err = scanner_expand_argument(this, line, &exp_line);
+		cpp_tokens_empty(line);
+		if (err)
+			return err;
+		if (cpp_tokens_is_empty(&exp_line))
+			return EINVAL;
+		token = cpp_tokens_peek_head(&exp_line);
+		type = cpp_token_type(token);
+		err = EINVAL;
+		if (type == LXR_TOKEN_CHAR_STRING_LITERAL ||
+			type == LXR_TOKEN_LESS_THAN)
+			err = scanner_scan_directive_embed(this, &exp_line, dir_path);
+		cpp_tokens_empty(&exp_line);
+		return err;
+	}
+
+	err = scanner_find_header(this, line, dir_path, 0, &path);
+	if (err)
+		return err;
+
+	embed_params_init(&params);
+	err = scanner_scan_embed_params(this, line, &params);
+	if (!err)
+		err = embed_params_size(&params, path, &size);
+	if (err)
+		goto err0;
+
+	/* The include cache, and the pch, depend on the size of the resource. */
+	err = scanner_note_file_read(this, path);
+	if (err)
+		goto err0;
+
+	if (size == 0) {
+		err = scanner_serialize_embed_tokens(this, &params.if_empty);
+		goto err0;
+	}
+	err = scanner_serialize_embed_tokens(this, &params.prefix);
+	if (!err)
+		err = scanner_serialize_embed(this, path, size);
+	if (!err)
+		err = scanner_serialize_embed_tokens(this, &params.suffix);
+err0:
+	embed_params_empty(&params);
+	return err;
+}
+
+/*
+ * The index of the include path after the one that holds the directory of
+ * the current file; 0 if none holds it.
+ */
+static
+int scanner_include_next_start(const struct scanner *this,
+							   const char *dir_path)
+{
+	int i, len;
+
+	for (i = 0; i < 4; ++i) {
+		if (this->include_paths[i] == NULL)
+			continue;
+		len = this->include_path_lens[i];
+		if (strncmp(dir_path, this->include_paths[i], len))
+			continue;
+		if (dir_path[len] == NULL_CHAR || dir_path[len] == '/')
+			return i + 1;
+	}
+	return 0;
+}
+
+/*
+ * __has_include(header-name), __has_include_next(header-name), and
+ * __has_embed(header-name embed-params), within #if. The line begins after
+ * the operator. The lookups are memoized, and shared with #include.
+ */
+static
+err_t scanner_evaluate_has_include(struct scanner *this,
+								   const enum lexer_token_type type,
+								   const bool is_next,
+								   struct cpp_tokens *line,
+								   const char *dir_path,
+								   int *out)
+{
+	err_t err;
+	int start;
+	size_t size;
+	const char *path;
+	struct cpp_tokens operand, exp_operand;
+	struct embed_params params;
+	enum lexer_token_type head;
+
+	*out = 0;	/* Not found; also __STDC_EMBED_NOT_FOUND__ */
+	cpp_tokens_init(&operand);
+	cpp_tokens_init(&exp_operand);
+	err = cpp_tokens_remove_parenthesized(line, &operand);
+	if (!err && cpp_tokens_is_empty(&operand))
+		err = EINVAL;
+	if (err)
+		goto err0;
+
+	/* Neither "..." nor <...>; expand */
+	head = cpp_token_type(cpp_tokens_peek_head(&operand));
+	if (head != LXR_TOKEN_CHAR_STRING_LITERAL && head != LXR_TOKEN_LESS_THAN) {
+		err = scanner_expand_argument(this, &operand, &exp_operand);
+		cpp_tokens_empty(&operand);
+		if (!err)
+			err = cpp_tokens_move(&exp_operand, &operand);
+		if (!err && cpp_tokens_is_empty(&operand))
+			err = EINVAL;
+		if (err)
+			goto err0;
+	}
+
+	path = NULL;
+	start = is_next ? scanner_include_next_start(this, dir_path) : 0;
+	err = scanner_find_header(this, &operand, dir_path, start, &path);
+	if (err == ENOENT)
+		err = ESUCCESS;
+	if (err || path == NULL)
+		goto err0;
+
+	if (type != LXR_TOKEN_HAS_EMBED) {
+		*out = 1;
+		if (!cpp_tokens_is_empty(&operand))
+			err = EINVAL;
+		goto err0;
+	}
+
+	/* An unsupported param, or a resource that can't be embedded, is 0. */
+	embed_params_init(&params);
+	err = scanner_scan_embed_params(this, &operand, &params);
+	if (!err)
+		err = embed_params_size(&params, path, &size);
+	embed_params_empty(&params);
+	if (err == ENOTSUP)
+		err = ESUCCESS;
+	else if (!err)
+		*out = size ? 1 : 2;	/* __STDC_EMBED_FOUND__, __STDC_EMBED_EMPTY__ */
+err0:
+	cpp_tokens_empty(&operand);
+	cpp_tokens_empty(&exp_operand);
+	return err;
+}
+/*****************************************************************************/
+/* line starts after # */
+static
+err_t scanner_scan_directive(struct scanner *this,
+							 struct cpp_tokens *line,
+							 const char *lexer_dir_path)	/* for includes, probes */
+{
+	enum lexer_token_type type;
+	struct cond_incl_stack *cistk;
+	struct cpp_token *token;
+
+	if (cpp_tokens_is_empty(line))	/* # new-line. no effect. */
+		return ESUCCESS;
+
+	cistk = &this->cistk;
+	token = cpp_tokens_remove_head(line);
+	type = cpp_token_type(token);
+	cpp_token_delete(token);
+
+	/* if/else when scanning directives are actually #if and #else */
+	if (type == LXR_TOKEN_IF)
+		type = LXR_TOKEN_DIRECTIVE_IF;
+	if (type == LXR_TOKEN_ELSE)
+		type = LXR_TOKEN_DIRECTIVE_ELSE;
+
+	/* These constructs are peers to #if constructs. Handle them first. */
+	switch (type) {
+	case LXR_TOKEN_DIRECTIVE_ELSE_IF_DEFINED:
+	case LXR_TOKEN_DIRECTIVE_ELSE_IF_NOT_DEFINED:
+	case LXR_TOKEN_DIRECTIVE_ELSE_IF:
+	case LXR_TOKEN_DIRECTIVE_ELSE:
+	case LXR_TOKEN_DIRECTIVE_END_IF:
+		/* The cistk shouldn't be empty */
+		if (cond_incl_stack_is_empty(cistk))
+			return EINVAL;
+		break;
+	default:
+		break;
+	}
 
 	if (type == LXR_TOKEN_DIRECTIVE_ELSE_IF_DEFINED)
 		return scanner_scan_directive_elifdef(this, false, line);
 	if (type == LXR_TOKEN_DIRECTIVE_ELSE_IF_NOT_DEFINED)
 		return scanner_scan_directive_elifdef(this, true, line);
 	if (type == LXR_TOKEN_DIRECTIVE_ELSE_IF)
-		return scanner_scan_directive_elif(this, line);
+		return scanner_scan_directive_elif(this, line, lexer_dir_path);
 	if (type == LXR_TOKEN_DIRECTIVE_ELSE)
 		return scanner_scan_directive_else(this);
 	if (type == LXR_TOKEN_DIRECTIVE_END_IF)
@@ -1828,7 +3445,7 @@ err_t scanner_scan_directive(struct scanner *this,
 	if (type == LXR_TOKEN_DIRECTIVE_IF_NOT_DEFINED)
 		return scanner_scan_directive_ifdef(this, true, line);
 	if (type == LXR_TOKEN_DIRECTIVE_IF)
-		return scanner_scan_directive_if(this, line);
+		return scanner_scan_directive_if(this, line, lexer_dir_path);
 
 	/* type isn't one of if,elif,else,endif. should skip these? */
 	if (cond_incl_stack_in_skip_zone(cistk))
@@ -1837,11 +3454,50 @@ err_t scanner_scan_directive(struct scanner *this,
 		return scanner_scan_directive_define(this, line);
 	if (type == LXR_TOKEN_DIRECTIVE_INCLUDE)
 		return scanner_scan_directive_include(this, line, lexer_dir_path);
+	if (type == LXR_TOKEN_DIRECTIVE_EMBED)
+		return scanner_scan_directive_embed(this, line, lexer_dir_path);
 	if (type == LXR_TOKEN_DIRECTIVE_UNDEF)
 		return scanner_scan_directive_undef(this, line);
 	return ENOTSUP;
 }
 /*****************************************************************************/
+/*
+ * Paste two tokens, neither a place-marker, into a new token. The caller
+ * still owns left and right. Two punctuators are pasted through a table;
+ * anything else is re-lexed from a buffer that usually fits on the stack.
+ */
+static
+err_t cpp_tokens_paste_pair(const struct cpp_token *left,
+							const struct cpp_token *right,
+							struct cpp_token **out)
+{
+	err_t err;
+	int len;
+	char *str;
+	char scratch[CPP_TOKEN_SCRATCH_SIZE];
+	struct lexer_token *base;
+
+	if (cpp_token_is_punctuator(left) && cpp_token_is_punctuator(right)) {
+		err = lexer_token_paste_punctuators(left->base, right->base, &base);
+		if (!err)
+			err = cpp_token_new(base, out);	/* move the ref */
+		return err;
+	}
+
+	len = 1;	/* nl */
+	len += cpp_token_source_length(left);
+	len += cpp_token_source_length(right);
+	str = cpp_token_scratch_alloc(scratch, len + 1);
+	if (str == NULL)
+		return ENOMEM;
+	strcpy(str, cpp_token_source(left));
+	strcat(str, cpp_token_source(right));
+	strcat(str, "\n");
+	err = cpp_token_new_from_buffer(str, len, out);
+	cpp_token_scratch_free(scratch, str);
+	return err;
+}
+
 /* this == copy of repl. out init by caller */
 static
 err_t cpp_tokens_paste_object_like(struct cpp_tokens *this,
@@ -1849,10 +3505,6 @@ err_t cpp_tokens_paste_object_like(struct cpp_tokens *this,
 {
 	err_t err;
 	bool is_non_str_double_hash;
-	struct cpp_token_stream stream;
-	char *str;
-	struct lexer *lexer;
-	int len;
 	struct cpp_token *next, *prev, *curr;
 
 	err = ESUCCESS;
@@ -1884,40 +3536,14 @@ err_t cpp_tokens_paste_object_like(struct cpp_tokens *this,
 			cpp_token_type(next) == LXR_TOKEN_HASH)
 			is_non_str_double_hash = true;
 
-		len = 0;
-		len += cpp_token_source_length(prev);
-		len += cpp_token_source_length(next);
-		str = malloc(len + 1 + 1);
-		if (str == NULL)
-			return ENOMEM;
-		strcpy(str, cpp_token_source(prev));
-		strcat(str, cpp_token_source(next));
-		strcat(str, "\n");
-
 		cpp_token_delete(curr);
+		err = cpp_tokens_paste_pair(prev, next, &curr);
 		cpp_token_delete(prev);
 		cpp_token_delete(next);
 		prev = NULL;
-
-		err = lexer_new(NULL, str, len, &lexer);
 		if (err)
 			return err;
-		cpp_token_stream_init(&stream, lexer);
-		err = cpp_token_stream_remove_head(&stream, &curr);
-		if (err)
-			return err;
-		err = cpp_token_stream_remove_head(&stream, &next);
-		if (!err) {
-			/* Successfully lexed another token. Fail */
-			cpp_token_delete(curr);
-			cpp_token_delete(next);
-			err = EINVAL;
-		}
-		if (err != EOF)	/* Error isn't EEOF. Fail */
-			return err;
 
-		assert(cpp_token_stream_is_empty(&stream));
-		lexer_delete(lexer);	/* deletes str also */
 		if (is_non_str_double_hash) {
 			assert(cpp_token_type(curr) == LXR_TOKEN_DOUBLE_HASH);
 			curr->base->type = LXR_TOKEN_NON_STRINGIZING_DOUBLE_HASH;
@@ -1969,16 +3595,13 @@ err_t cpp_tokens_stringize(const struct cpp_tokens *this,
 	int i, len, j, k, src_len;
 	const char *src;
 	char *str;
-	struct cpp_token_stream stream;
-	struct lexer *lexer;
+	char scratch[CPP_TOKEN_SCRATCH_SIZE];
 	struct cpp_token *token;
 	const struct cpp_token *t;
 
 	/* Empty string */
 	if (this == NULL || cpp_tokens_is_empty(this)) {
-		str = malloc(4);
-		if (str == NULL)
-			return ENOMEM;
+		str = scratch;
 		str[0] = str[1] = '\"';
 		str[2] = '\n';
 		str[3] = NULL_CHAR;
@@ -2002,7 +3625,7 @@ err_t cpp_tokens_stringize(const struct cpp_tokens *this,
 			++len;
 		}
 	}
-	str = malloc(len + 1);
+	str = cpp_token_scratch_alloc(scratch, len + 1);
 	if (str == NULL)
 		return ENOMEM;
 	str[len - 1] = '\n';
@@ -2025,14 +3648,10 @@ err_t cpp_tokens_stringize(const struct cpp_tokens *this,
 	str[k++] = '\"';
 	assert(k == len - 1);
 build:
-	err = lexer_new(NULL, str, len, &lexer);
+	err = cpp_token_new_from_buffer(str, len, &token);
+	cpp_token_scratch_free(scratch, str);
 	if (err)
 		return err;
-	cpp_token_stream_init(&stream, lexer);
-	err = cpp_token_stream_remove_head(&stream, &token);
-	if (err)
-		return err;
-	lexer_delete(lexer);
 	assert(cpp_token_is_string_literal(token));
 	assert(cpp_token_type(token) == LXR_TOKEN_CHAR_STRING_LITERAL);
 	token->has_white_space = has_white_space;
@@ -2109,13 +3728,8 @@ err_t cpp_token_paste(struct cpp_token *left,
 					  struct cpp_token *right,
 					  struct cpp_token **out)
 {
-	int len;
-	bool is_left_place_marker, is_right_place_marker;
-	char *str;
 	err_t err;
-	struct cpp_token *curr, *next;
-	struct lexer *lexer;
-	struct cpp_token_stream stream;
+	bool is_left_place_marker, is_right_place_marker;
 
 	is_right_place_marker = is_left_place_marker = false;
 	if (cpp_token_type(left) == LXR_TOKEN_PLACE_MARKER)
@@ -2138,41 +3752,9 @@ err_t cpp_token_paste(struct cpp_token *left,
 	}
 
 	/* none of them is a place-marker. */
-	len = 1;	/* nl */
-	len += cpp_token_source_length(left);
-	len += cpp_token_source_length(right);
-	str = malloc(len + 1);
-	if (str == NULL)
-		return ENOMEM;
-
-	strcpy(str, cpp_token_source(left));
-	strcat(str, cpp_token_source(right));
-	strcat(str, "\n");
+	err = cpp_tokens_paste_pair(left, right, out);
 	cpp_token_delete(left);
 	cpp_token_delete(right);
-
-	err = lexer_new(NULL, str, len, &lexer);
-	if (err)
-		return err;
-
-	cpp_token_stream_init(&stream, lexer);
-	err = cpp_token_stream_remove_head(&stream, &curr);
-	if (err)
-		goto err0;
-	err = cpp_token_stream_remove_head(&stream, &next);
-	if (!err) {
-		cpp_token_delete(curr);
-		cpp_token_delete(next);
-		err = EINVAL;
-		goto err0;
-	}
-	if (err != EOF)
-		goto err0;
-	*out = curr;
-	err = ESUCCESS;
-	assert(cpp_token_stream_is_empty(&stream));
-err0:
-	lexer_delete(lexer);
 	return err;
 }
 /*
@@ -2602,7 +4184,8 @@ err_t scanner_expand_argument(struct scanner *this,
 
 	/* repl-list-end-marker */
 	lexer_token_init(&_repl_list_end);
-	repl_list_end.base = &_repl_list_end;;
+	repl_list_end.base = &_repl_list_end;
+	repl_list_end.ref_count = 1;
 	repl_list_end.base->type = LXR_TOKEN_REPL_LIST_END;
 
 	cpp_tokens_init(&exp_arg);
@@ -2741,17 +4324,13 @@ err_t cpp_token_stream_collect_arguments(struct cpp_token_stream *stream,
 
 		/* Reconstruct the stream */
 		assert(!cpp_tokens_is_empty(&tokens));
-		CPP_TOKENS_FOR_EACH_WITH_REMOVE_REVERSE(&tokens, token) {
-			err = cpp_token_stream_add_head(stream, token);
-			if (err)
-				return err;
-		}
+		err = cpp_tokens_add_head(&tokens, left_paren);
 		if (!err)
-			assert(cpp_tokens_is_empty(&tokens));
+			err = cpp_tokens_add_head(&tokens, ident);
 		if (!err)
-			err = cpp_token_stream_add_head(stream, left_paren);
+			err = cpp_token_stream_move_to_head(stream, &tokens);
 		if (!err)
-			err = cpp_token_stream_add_head(stream, ident);
+			assert(cpp_tokens_is_empty(&tokens));
 		if (!err)
 			err = EPARTIAL;	/* If stream rebuilt, return the orig err. */
 		return err;
@@ -2811,6 +4390,9 @@ err_t cpp_token_stream_collect_arguments(struct cpp_token_stream *stream,
 		 * This straightens the arg-list.
 		 */
 		if (cpp_token_is_first(token) && !cpp_token_has_white_space(token)) {
+			err = cpp_token_make_writable(&token);
+			if (err)
+				return err;
 			token->is_first = false;
 			token->has_white_space = true;
 		}
@@ -2846,6 +4428,190 @@ err_t cpp_token_stream_collect_arguments(struct cpp_token_stream *stream,
 	return ESUCCESS;
 }
 
+/*****************************************************************************/
+static
+void macro_profile_delete(void *p)
+{
+	struct macro_profile *this = p;
+	free((void *)this->name);
+	free(this);
+}
+
+/* rdtsc, where available. */
+static inline
+uint64_t macro_profile_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	timespec_get(&ts, TIME_UTC);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+/* The profile is found by name once per definition, and cached in it. */
+static
+err_t scanner_find_macro_profile(struct scanner *this,
+								 const struct macro *macro,
+								 struct macro_profile **out)
+{
+	int i;
+	err_t err;
+	const char *name;
+	struct macro_profile *profile;
+
+	if (macro->profile) {
+		*out = macro->profile;
+		return ESUCCESS;
+	}
+
+	name = cpp_token_resolved(macro->identifier);
+	PTRQ_FOR_EACH(&this->macro_profiles, i, profile) {
+		if (!strcmp(profile->name, name))
+			break;
+	}
+	if (profile == NULL) {
+		profile = calloc(1, sizeof(*profile));
+		if (profile == NULL)
+			return ENOMEM;
+		profile->name = strdup(name);
+		err = profile->name ? ptrq_add_tail(&this->macro_profiles, profile) :
+			ENOMEM;
+		if (err) {
+			macro_profile_delete(profile);
+			return err;
+		}
+	}
+	((struct macro *)macro)->profile = profile;
+	*out = profile;
+	return ESUCCESS;
+}
+
+/*
+ * nested_cycles accumulates the total cycles of the expansions nested within
+ * the current one. Begin saves the outer value, and end restores it, adding
+ * this expansion's total.
+ */
+static
+err_t scanner_begin_macro_profile(struct scanner *this,
+								  const struct macro *macro,
+								  struct macro_profile **out,
+								  uint64_t *out_start,
+								  uint64_t *out_nested_cycles)
+{
+	err_t err;
+
+	err = scanner_find_macro_profile(this, macro, out);
+	if (err)
+		return err;
+	*out_nested_cycles = this->macro_profile_nested_cycles;
+	this->macro_profile_nested_cycles = 0;
+	*out_start = macro_profile_cycles();
+	return ESUCCESS;
+}
+
+static
+void scanner_end_macro_profile(struct scanner *this,
+							   struct macro_profile *profile,
+							   const uint64_t start,
+							   const uint64_t nested_cycles)
+{
+	uint64_t cycles;
+
+	cycles = macro_profile_cycles() - start;
+	++profile->num_expansions;
+	profile->total_cycles += cycles;
+	profile->cycles += cycles - this->macro_profile_nested_cycles;
+	this->macro_profile_nested_cycles = nested_cycles + cycles;
+}
+
+/* Most expensive first. */
+static
+int macro_profile_compare(const void *a,
+						  const void *b)
+{
+	const struct macro_profile *profile[2];
+
+	profile[0] = *(const struct macro_profile **)a;
+	profile[1] = *(const struct macro_profile **)b;
+	if (profile[0]->cycles != profile[1]->cycles)
+		return profile[0]->cycles < profile[1]->cycles ? 1 : -1;
+	return strcmp(profile[0]->name, profile[1]->name);
+}
+
+/* A path ending in .json gets JSON, else a table. - is stderr. */
+static
+err_t scanner_write_macro_profile(const struct scanner *this)
+{
+	int i, fd, num, len;
+	err_t err;
+	bool is_json;
+	ssize_t ret;
+	const char *path, *format;
+	char line[512];
+	struct macro_profile *profile, **profiles;
+
+	num = ptrq_num_entries(&this->macro_profiles);
+	profiles = malloc((num + 1) * sizeof(profiles[0]));
+	if (profiles == NULL)
+		return ENOMEM;
+	PTRQ_FOR_EACH(&this->macro_profiles, i, profile)
+		profiles[i] = profile;
+	qsort(profiles, num, sizeof(profiles[0]), macro_profile_compare);
+
+	path = this->macro_profile_path;
+	len = strlen(path);
+	is_json = len >= 5 && !strcmp(path + len - 5, ".json");
+	fd = STDERR_FILENO;
+	if (strcmp(path, "-")) {
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		if (fd < 0) {
+			err = errno;
+			goto err0;
+		}
+	}
+
+	format = "%-32s %10s %10s %10s %14s %14s %14s\n";
+	if (is_json)
+		format = "[\n";
+	len = snprintf(line, sizeof(line), format, "macro", "expansions",
+				   "tokens", "arg-tokens", "arg-cycles", "cycles",
+				   "total-cycles");
+	format = "%-32s %10llu %10llu %10llu %14llu %14llu %14llu%s\n";
+	if (is_json)
+		format = "\t{\"name\": \"%s\", \"expansions\": %llu, "
+			"\"tokens\": %llu, \"arg_tokens\": %llu, \"arg_cycles\": %llu, "
+			"\"cycles\": %llu, \"total_cycles\": %llu}%s\n";
+	err = ESUCCESS;
+	for (i = 0; i <= num; ++i) {
+		ret = write(fd, line, len < (int)sizeof(line) ? len : (int)sizeof(line));
+		if (ret < 0) {
+			err = errno;
+			break;
+		}
+		if (i == num)
+			break;
+		profile = profiles[i];
+		len = snprintf(line, sizeof(line), format, profile->name,
+					   (unsigned long long)profile->num_expansions,
+					   (unsigned long long)profile->num_tokens,
+					   (unsigned long long)profile->num_arg_tokens,
+					   (unsigned long long)profile->arg_cycles,
+					   (unsigned long long)profile->cycles,
+					   (unsigned long long)profile->total_cycles,
+					   is_json && i < num - 1 ? "," : "");
+	}
+	if (!err && is_json && write(fd, "]\n", 2) < 0)
+		err = errno;
+	if (fd != STDERR_FILENO)
+		close(fd);
+err0:
+	free(profiles);
+	return err;
+}
+
 /*
  * As long as there are tokens to the left of the repl-end-marker, continue
  * processing the stream. out is init by caller.
@@ -2867,16 +4633,21 @@ err_t scanner_process_one(struct scanner *this,
 	struct lexer_token _repl_list_end;
 	bool is_ident, is_marked, is_macro, is_active, has_white_space;
 	struct cpp_tokens exp_repl, result;
+	struct macro_profile *profile;
+	uint64_t start, arg_start, nested_cycles;
 
 	args = exp_args = NULL;
 	num_args = 0;
+	profile = NULL;
+	start = nested_cycles = 0;
 
 	cpp_tokens_init(&exp_repl);
 	cpp_tokens_init(&result);
 
 	/* repl-list-end-marker */
 	lexer_token_init(&_repl_list_end);
-	repl_list_end.base = &_repl_list_end;;
+	repl_list_end.base = &_repl_list_end;
+	repl_list_end.ref_count = 1;
 	repl_list_end.base->type = LXR_TOKEN_REPL_LIST_END;
 
 	err = cpp_token_stream_remove_head(stream, &ident);
@@ -2899,8 +4670,12 @@ err_t scanner_process_one(struct scanner *this,
 	macro = scanner_find_macro(this, name);
 	is_macro = macro != NULL;
 	is_active = is_macro && macro_stack_find(mstk, macro);
-	if (is_active)
+	if (is_active) {
+		err = cpp_token_make_writable(&ident);
+		if (err)
+			return err;
 		ident->is_marked = true;
+	}
 	if (!is_macro || is_active)
 		return cpp_tokens_add_tail(out, ident);
 
@@ -2909,7 +4684,11 @@ err_t scanner_process_one(struct scanner *this,
 	/* object-like. */
 	if (macro->is_function_like == false) {
 		cpp_token_delete(ident);
-		err = cpp_tokens_expand_object_like(repl, &exp_repl);
+		if (this->macro_profile_path)
+			err = scanner_begin_macro_profile(this, macro, &profile, &start,
+											  &nested_cycles);
+		if (!err)
+			err = cpp_tokens_expand_object_like(repl, &exp_repl);
 		goto rescan;
 	}
 
@@ -2965,11 +4744,18 @@ err_t scanner_process_one(struct scanner *this,
 	 * If no error in collecting, the ident, left-paren, args and right-paren
 	 * are all consumed.
 	 */
+	if (this->macro_profile_path) {
+		err = scanner_begin_macro_profile(this, macro, &profile, &start,
+										  &nested_cycles);
+		if (err)
+			return err;
+	}
 	if (num_args) {
 		exp_args = malloc(num_args * sizeof(exp_args[0]));
 		if (exp_args == NULL)
 			return ENOMEM;
 
+		arg_start = profile ? macro_profile_cycles() : 0;
 		for (i = 0; i < num_args; ++i) {
 			cpp_tokens_init(&exp_args[i]);
 
@@ -2981,7 +4767,11 @@ err_t scanner_process_one(struct scanner *this,
 			assert(err == ESUCCESS);
 			if (err)
 				return err;
+			if (profile)
+				profile->num_arg_tokens += cpp_tokens_num_entries(&exp_args[i]);
 		}
+		if (profile)
+			profile->arg_cycles += macro_profile_cycles() - arg_start;
 	}
 
 	/* need to send all, since va_opt may require */
@@ -3002,9 +4792,20 @@ rescan:
 	 */
 	if (!cpp_tokens_is_empty(&exp_repl)) {
 		token = cpp_tokens_peek_head(&exp_repl);
-		token->has_white_space = has_white_space;
+		if (cpp_token_has_white_space(token) != has_white_space) {
+			token = cpp_tokens_remove_head(&exp_repl);
+			err = cpp_token_make_writable(&token);
+			if (!err)
+				token->has_white_space = has_white_space;
+			if (!err)
+				err = cpp_tokens_add_head(&exp_repl, token);
+			if (err)
+				return err;
+		}
 		cpp_tokens_remove_place_markers(&exp_repl);
 	}
+	if (profile)
+		profile->num_tokens += cpp_tokens_num_entries(&exp_repl);
 
 	if (cpp_tokens_is_empty(&exp_repl))
 		goto done;
@@ -3013,16 +4814,13 @@ rescan:
 	if (err)
 		return err;
 
-	/* Add exp-repl + repl-end-marker tokens to the stream's front */
-	err = cpp_token_stream_add_head(stream, &repl_list_end);
+	/* Splice exp-repl + repl-end-marker tokens to the stream's front */
+	err = cpp_tokens_add_tail(&exp_repl, &repl_list_end);
+	if (!err)
+		err = cpp_token_stream_move_to_head(stream, &exp_repl);
 	if (err)
 		return err;
-
-	CPP_TOKENS_FOR_EACH_WITH_REMOVE_REVERSE(&exp_repl, token) {
-		err = cpp_token_stream_add_head(stream, token);
-		if (err)
-			return err;
-	}
+	assert(cpp_tokens_is_empty(&exp_repl));
 
 	while (true) {
 		/* We do not expect an error reading from the stream */
@@ -3054,6 +4852,8 @@ rescan:
 	m = macro_stack_pop(mstk);
 	assert(m == macro);
 done:
+	if (profile)
+		scanner_end_macro_profile(this, profile, start, nested_cycles);
 	for (i = 0; i < num_args; ++i) {
 		cpp_tokens_empty(&args[i]);
 		cpp_tokens_empty(&exp_args[i]);
@@ -3197,45 +4997,21 @@ err_t scanner_serialize_cpp_token(struct scanner *this,
 								  const struct cpp_token *token)
 {
 	size_t src_len;
-	int ret;
-	size_t size;
-	const void *buf;
+	const char *src;
 	enum lexer_token_type type;
+	unsigned char buf[1 + 2 * TOKEN_FILE_VARINT_MAX];
 
 	type = cpp_token_type(token);
+	assert(type < TOKEN_FILE_END);
+	buf[0] = type;
 
 	/*
 	 * Do not write source for punctuators and lexer-key-words.
 	 * This helps keep the output-file-size small.
 	 */
-
-	/* First write the lexer_token type */
-	buf = &type;
-	size = sizeof(type);
-	ret = write(this->cpp_tokens_fd, buf, size);
-	if (ret < 0)
-		return errno;
-
-	/* Write nothing more for lexer keywords and punctuators */
 	if (cpp_token_is_key_word(token) ||
 		cpp_token_is_punctuator(token))
-		return ESUCCESS;
-
-	src_len = cpp_token_source_length(token);
-	assert(src_len);
-
-	/* Write source_len. */
-	buf = &src_len;
-	size = sizeof(src_len);
-	ret = write(this->cpp_tokens_fd, buf, size);
-	if (ret < 0)
-		return errno;
-
-	/* If the source_len is not 0, then write the source. */
-#if 0
-	if (src_len == 0)
-		return ESUCCESS;
-#endif
+		return scanner_write_cpp_tokens(this, buf, 1);
 
 	/*
 	 * If the type is identifier, write its resolved source.
@@ -3244,19 +5020,16 @@ err_t scanner_serialize_cpp_token(struct scanner *this,
 	 * to #if constructs are evaluated, but otherwise the char-consts are not
 	 * resolved.
 	 */
-
-	size = src_len;
-	buf = cpp_token_source(token);
+	src_len = cpp_token_source_length(token);
+	src = cpp_token_source(token);
 	if (type == LXR_TOKEN_IDENTIFIER &&
 		cpp_token_resolved(token) != cpp_token_source(token)) {
 		src_len = cpp_token_resolved_length(token);
-		buf = cpp_token_resolved(token);
+		src = cpp_token_resolved(token);
 	}
-	assert(buf);
-	ret = write(this->cpp_tokens_fd, buf, size);
-	if (ret < 0)
-		return errno;
-	return ESUCCESS;
+	assert(src);
+	assert(src_len);
+	return scanner_write_cpp_tokens_spelling(this, buf, 1, src, src_len);
 }
 
 /* out is initialized by the caller */
@@ -3266,19 +5039,20 @@ err_t cpp_token_stream_scan_line(struct cpp_token_stream *this,
 {
 	err_t err;
 	struct cpp_token *token;
-	struct lexer_position save;
 
-	assert(this->lexer);
+	assert(this->lexer || this->file);
 	while (true) {
-		save = lexer_position(this->lexer);
 		err = cpp_token_stream_remove_head(this, &token);
 		if (err)
 			break;
 
-		/* We have reached a token on the next line. push it back. */
+		/*
+		 * We have reached a token on the next line. push it back. The token
+		 * is put back into the stream, instead of rewinding the lexer, so
+		 * that it is not lexed, and recorded, twice.
+		 */
 		if (cpp_token_is_first(token)) {
-			cpp_token_delete(token);
-			lexer_set_position(this->lexer, save);
+			err = cpp_token_stream_add_head(this, token);
 			break;
 		}
 		err = cpp_tokens_add_tail(out, token);
@@ -3305,39 +5079,24 @@ err_t cpp_token_stream_scan_line(struct cpp_token_stream *this,
 	return err;
 }
 
+/* dir_path is the directory of the file being scanned, for #include "..." */
 static
-err_t scanner_scan_file(struct scanner *this,
-						const char *path)
+err_t scanner_scan_stream(struct scanner *this,
+						  struct cpp_token_stream *stream,
+						  const char *dir_path)
 {
 	int i;
 	err_t err;
+	enum stats_phase phase;
 	struct cpp_tokens output, line;
 	struct macro_stack mstk;
-	struct cpp_token_stream stream;
-	struct lexer *lexer;
 	struct cpp_token *token;
-	static int depth = -1;	/* file inclusion depth */
-
-	++depth;
-	printf("%s[%d]: %s\n", __func__, depth, path);
-
-	/* path instead of buf/buf-size */
-	err = lexer_new(path, NULL, 0, &lexer);
-	if (err)
-		goto err0;
-
-	if (depth == 0 && lexer_buffer_size(lexer) == 0) {
-		/* The src file to compile must not be empty */
-		err = EINVAL;
-		goto err1;
-	}
 
 	macro_stack_init(&mstk);
-	cpp_token_stream_init(&stream, lexer);
 	cpp_tokens_init(&line);
 	cpp_tokens_init(&output);
 	while (true) {
-		err = cpp_token_stream_remove_head(&stream, &token);
+		err = cpp_token_stream_remove_head(stream, &token);
 		if (err) {
 			if (err == EOF)
 				err = ESUCCESS;
@@ -3350,10 +5109,12 @@ err_t scanner_scan_file(struct scanner *this,
 		if (cpp_token_type(token) == LXR_TOKEN_HASH &&
 			cpp_token_is_first(token)) {
 			cpp_token_delete(token);
+			phase = stats_enter(STATS_PHASE_DIRECTIVE);
 			if (!err)
-				err = cpp_token_stream_scan_line(&stream, &line);
+				err = cpp_token_stream_scan_line(stream, &line);
 			if (!err)
-				err = scanner_scan_directive(this, &line, lexer->dir_path);
+				err = scanner_scan_directive(this, &line, dir_path);
+			stats_leave(phase);
 			cpp_tokens_empty(&line);
 			if (err)
 				break;
@@ -3366,7 +5127,7 @@ err_t scanner_scan_file(struct scanner *this,
 		}
 
 		/* add potential identifier back into the stream */
-		err = cpp_token_stream_add_head(&stream, token);
+		err = cpp_token_stream_add_head(stream, token);
 		if (err)
 			break;
 
@@ -3374,13 +5135,15 @@ err_t scanner_scan_file(struct scanner *this,
 		 * We do not add a barrier here after the token. Hence we do not expect
 		 * to see a EPARTIAL error.
 		 */
+		phase = stats_enter(STATS_PHASE_EXPAND);
 		do {
-			err = scanner_process_one(this, &mstk, &stream, &output);
+			err = scanner_process_one(this, &mstk, stream, &output);
 			assert(err != EPARTIAL);
-		} while (!err && !cpp_token_stream_is_empty(&stream));
+		} while (!err && !cpp_token_stream_is_empty(stream));
+		stats_leave(phase);
 		if (err)
 			break;
-		assert(cpp_token_stream_is_empty(&stream));
+		assert(cpp_token_stream_is_empty(stream));
 
 		/*
 		 * Note that some tokens may have no whitespace preceding it. In that
@@ -3395,36 +5158,143 @@ err_t scanner_scan_file(struct scanner *this,
 			printf("%s", cpp_token_source(token));
 		}
 		printf("\n");
+		phase = stats_enter(STATS_PHASE_SERIALIZE);
 		CPP_TOKENS_FOR_EACH_WITH_REMOVE(&output, token) {
 			err = scanner_serialize_cpp_token(this, token);
 			if (err)
 				break;
 			cpp_token_delete(token);
+			++this->num_tokens_emitted;
 		}
+		stats_leave(phase);
 		/*cpp_tokens_empty(&output);*/
 		assert(cpp_tokens_is_empty(&output));
 	}
-#if 0
-	if (!err && prev) {
-		err = scanner_serialize_cpp_token(this, prev);
-		cpp_token_delete(prev);
+	return err;
+}
+
+/*
+ * Included files are looked up, by dev/ino, within lexed_files. A file
+ * lexed before is replayed. Otherwise, its tokens are recorded as they are
+ * lexed. A file that is still being recorded (it includes itself) is lexed
+ * again, but not recorded. The main file is not recorded.
+ */
+static
+err_t scanner_lex_file(struct scanner *this,
+					   const char *path,
+					   const bool is_main)
+{
+	err_t err;
+	int ret;
+	struct stat stat_buf;
+	struct lexer *lexer;
+	struct lexed_file *file;
+	struct cpp_token_stream stream;
+
+	file = NULL;
+	ret = -1;	/* The main file is not looked up */
+	if (!is_main)
+		ret = stat(path, &stat_buf);
+	if (ret == 0)
+		file = scanner_find_lexed_file(this, &stat_buf);
+
+	if (file && file->is_complete) {
+		cpp_token_stream_init(&stream, NULL);
+		cpp_token_stream_set_file(&stream, file);
+		return scanner_scan_stream(this, &stream, file->dir_path);
 	}
-#endif
-	printf("%s[%d]: %s ends with %d\n", __func__, depth, path, err);
-err1:
-	lexer_delete(lexer);
+
+	/* path instead of buf/buf-size */
+	err = lexer_new(path, NULL, 0, &lexer);
+	if (err)
+		return err;
+
+	if (is_main && lexer_buffer_size(lexer) == 0) {
+		/* The src file to compile must not be empty */
+		err = EINVAL;
+		goto err0;
+	}
+	this->num_bytes_lexed += lexer_buffer_size(lexer);
+
+	cpp_token_stream_init(&stream, lexer);
+	if (ret == 0 && file == NULL) {
+		err = lexed_file_new(&stat_buf, path, lexer->dir_path, &file);
+		if (!err)
+			err = lexed_files_add_tail(&this->lexed_files, file);
+		if (err)
+			goto err0;
+		cpp_token_stream_set_file(&stream, file);	/* record */
+	} else {
+		file = NULL;
+	}
+
+	err = scanner_scan_stream(this, &stream, lexer->dir_path);
+	this->num_tokens_lexed += stream.num_lexed;
+	if (!err && file)
+		file->is_complete = true;
 err0:
+	lexer_delete(lexer);
+	return err;
+}
+
+/* Included files go through the include cache, when there is one. */
+static
+err_t scanner_scan_file(struct scanner *this,
+						const char *path)
+{
+	err_t err;
+	enum stats_phase phase;
+	static int depth = -1;	/* file inclusion depth */
+
+	/* The file is not charged to the #include that scans it. */
+	phase = stats_enter(STATS_PHASE_OTHER);
+	++depth;
+	printf("%s[%d]: %s\n", __func__, depth, path);
+
+	err = scanner_note_file_read(this, path);
+	if (!err && this->include_trace_path)
+		err = scanner_begin_include_trace(this, path);
+	if (!err && depth && this->include_cache_dir)
+		err = scanner_scan_include_cached(this, path);
+	else if (!err)
+		err = scanner_lex_file(this, path, depth == 0);
+	if (!err && this->include_trace_path)
+		err = scanner_end_include_trace(this);
+	printf("%s[%d]: %s ends with %d\n", __func__, depth, path, err);
 	--depth;
+	stats_leave(phase);
 	assert(!err);
 	return err;
 }
 
-err_t scanner_scan_predefined_macros(struct scanner *this)
+/* The buffer is moved into the lexer, which frees it. */
+static
+err_t scanner_scan_buffer(struct scanner *this,
+						  char *buffer,
+						  const size_t size)
 {
-	int fd, ret;
-	const char *path;
 	err_t err;
-	static const char *macros =
+	struct lexer *lexer;
+	struct cpp_token_stream stream;
+
+	err = lexer_new(NULL, buffer, size, &lexer);
+	if (err) {
+		free(buffer);
+		return err;
+	}
+	cpp_token_stream_init(&stream, lexer);
+	err = scanner_scan_stream(this, &stream, lexer->dir_path);
+	lexer_delete(lexer);
+	return err;
+}
+
+/* Lexed from memory; no temporary file. */
+static
+err_t scanner_scan_predefined_macros(struct scanner *this)
+{
+	char *buffer;
+	size_t size;
+	static const char macros[] =
 		"#define __STDC__ 1\n"
 		"#define __STDC_EMBED_NOT_FOUND__ 0\n"
 		"#define __STDC_EMBED_FOUND__ 1\n"
@@ -3465,32 +5335,2046 @@ err_t scanner_scan_predefined_macros(struct scanner *this)
 		"#define __x86_64__ 1\n"
 		"#define __STRICT_ANSI__ 1\n";
 
-	err = mkstemp(&fd, &path);
-	if (err)
-		goto err0;
-
-	ret = write(fd, macros, strlen(macros));
-	if (ret < 0) {
-		err = errno;
-		goto err1;
-	}
-	err = scanner_scan_file(this, path);
-err1:
-	close(fd);
-	unlink(path);
-	free((void *)path);
-err0:
-	return err;
+	/* The lexer owns, and frees, its buffer. */
+	size = sizeof(macros) - 1;
+	buffer = malloc(size + 1);
+	if (buffer == NULL)
+		return ENOMEM;
+	memcpy(buffer, macros, size + 1);
+	return scanner_scan_buffer(this, buffer, size);
 }
 
-err_t scanner_scan(struct scanner *this,
-				   const char *path)
+/*
+ * The -D and -U options are queued up as #define and #undef lines, in the
+ * order given, and scanned after the predefined macros.
+ */
+static
+err_t scanner_add_command_line_macro(struct scanner *this,
+									 const char *directive,
+									 const char *name,
+									 const size_t name_len,
+									 const char *value)
 {
-	err_t err;
+	char *buffer;
+	size_t size;
 
+	size = this->command_line_macros_size;
+	size += strlen(directive) + 1 + name_len + 1;	/* sp + nl */
+	if (value)
+		size += 1 + strlen(value);	/* sp */
+	buffer = realloc(this->command_line_macros, size + 1);	/* nul */
+	if (buffer == NULL)
+		return ENOMEM;
+	buffer[this->command_line_macros_size] = NULL_CHAR;
+	strcat(buffer, directive);
+	strcat(buffer, " ");
+	strncat(buffer, name, name_len);
+	if (value) {
+		strcat(buffer, " ");
+		strcat(buffer, value);
+	}
+	strcat(buffer, "\n");
+	assert(strlen(buffer) == size);
+	this->command_line_macros = buffer;
+	this->command_line_macros_size = size;
+	return ESUCCESS;
+}
+
+/* -D name, -D name=value */
+err_t scanner_define(struct scanner *this,
+					 const char *definition)
+{
+	const char *value;
+	size_t name_len;
+
+	value = strchr(definition, '=');
+	name_len = value ? (size_t)(value - definition) : strlen(definition);
+	if (name_len == 0)
+		return EINVAL;
+	if (value)
+		++value;	/* skip = */
+	else
+		value = "1";
+	return scanner_add_command_line_macro(this, "#define", definition,
+										  name_len, value);
+}
+
+/* -U name */
+err_t scanner_undefine(struct scanner *this,
+					   const char *name)
+{
+	if (name[0] == NULL_CHAR)
+		return EINVAL;
+	return scanner_add_command_line_macro(this, "#undef", name, strlen(name),
+										  NULL);
+}
+
+/*****************************************************************************/
+/*
+ * Precompiled header.
+ *
+ * After the prefix header (-include) is scanned, the macro table, and the
+ * tokens that were serialized while scanning the prefix, are written to the
+ * file named by -include-pch, along with the identity of each file that
+ * contributed to them. A later run maps that file, checks the contributing
+ * files, and restores the macros and the output, without lexing the
+ * predefined macros, the -D/-U lines, or the prefix header.
+ *
+ * The layout is in host byte order. A string is a u32 length followed by the
+ * bytes, without a nul.
+ *	magic[8], u32 version, u32 byte-order mark
+ *	string prefix-header path, string -D/-U lines
+ *	u32 num-deps; for each: string path, u64 size, u64 mtime, u64 hash
+ *	u32 num-macros; for each: u8 is_function_like, u8 is_variadic,
+ *		token identifier, u32 num-params, tokens, u32 num-repl, tokens
+ *	u64 output size, output bytes
+ * A token is a u32 type, a u8 of pch_token_flags, the string source, and a
+ * u32 resolved length followed by the resolved bytes. The length is
+ * PCH_SAME_AS_SOURCE, without any bytes, if resolved is the source.
+ */
+#define PCH_MAGIC			"x24-pch"	/* 8 bytes, with the nul */
+#define PCH_VERSION			3
+#define PCH_BYTE_ORDER		0x01020304
+#define PCH_SAME_AS_SOURCE	UINT32_MAX
+
+enum pch_token_flags {
+	PCH_TOKEN_HAS_WHITE_SPACE		= 1 << 0,
+	PCH_TOKEN_IS_FIRST				= 1 << 1,
+	PCH_TOKEN_IS_MARKED				= 1 << 2,
+	PCH_TOKEN_BASE_HAS_WHITE_SPACE	= 1 << 3,
+	PCH_TOKEN_BASE_IS_FIRST			= 1 << 4,
+};
+
+struct pch_writer {
+	char	*buffer;
+	size_t	size;
+	size_t	num_allocated;
+};
+
+/* A failed read, past the end, implies a truncated, i.e. stale, file. */
+struct pch_reader {
+	const char	*buffer;
+	size_t		size;
+	size_t		pos;
+};
+
+static
+uint64_t pch_hash(const void *p,
+				  const size_t size)
+{
+	size_t i;
+	uint64_t hash;
+	const unsigned char *bytes = p;
+
+	hash = 0xcbf29ce484222325ull;	/* FNV-1a */
+	for (i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+/* An empty file is returned as NULL, with size 0. */
+static
+err_t pch_map_file(const char *path,
+				   const char **out,
+				   size_t *out_size)
+{
+	err_t err;
+	int fd, ret;
+	void *p;
+	struct stat stat;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return errno;
+	ret = fstat(fd, &stat);
+	if (ret < 0) {
+		err = errno;
+		goto err0;
+	}
+	p = NULL;
+	if (stat.st_size) {
+		p = mmap(NULL, stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED) {
+			err = errno;
+			goto err0;
+		}
+	}
+	*out = p;
+	*out_size = stat.st_size;
+	err = ESUCCESS;
+err0:
+	close(fd);
+	return err;
+}
+
+static
+void pch_unmap_file(const char *p,
+					const size_t size)
+{
+	if (p)
+		munmap((void *)p, size);
+}
+/*****************************************************************************/
+static
+void pch_dep_delete(void *p)
+{
+	struct pch_dep *this = p;
+	free((void *)this->path);
+	free(this);
+}
+
+static
+err_t pch_dep_hash(const char *path,
+				   uint64_t *out)
+{
+	err_t err;
+	size_t size;
+	const char *p;
+
+	err = pch_map_file(path, &p, &size);
+	if (err)
+		return err;
+	*out = pch_hash(p, size);
+	pch_unmap_file(p, size);
+	return ESUCCESS;
+}
+
+/* deps is a queue of pch_dep; same path once. */
+static
+err_t pch_deps_add(struct ptr_queue *deps,
+				   const char *path)
+{
+	err_t err;
+	int i, ret;
+	struct stat stat_buf;
+	struct pch_dep *dep;
+
+	PTRQ_FOR_EACH(deps, i, dep) {
+		if (!strcmp(dep->path, path))
+			return ESUCCESS;
+	}
+
+	ret = stat(path, &stat_buf);
+	if (ret < 0)
+		return errno;
+
+	dep = malloc(sizeof(*dep));
+	if (dep == NULL)
+		return ENOMEM;
+	dep->path = strdup(path);
+	if (dep->path == NULL) {
+		err = ENOMEM;
+		goto err0;
+	}
+	dep->size = stat_buf.st_size;
+	dep->mtime = stat_buf.st_mtime;
+	err = pch_dep_hash(path, &dep->hash);
+	if (!err)
+		err = ptrq_add_tail(deps, dep);
+	if (!err)
+		return err;
+	free((void *)dep->path);
+err0:
+	free(dep);
+	return err;
+}
+
+/* Returns ESTALE if the file changed since the pch was written. */
+static
+err_t pch_dep_check(const struct pch_dep *this)
+{
+	err_t err;
+	int ret;
+	uint64_t hash;
+	struct stat stat_buf;
+
+	ret = stat(this->path, &stat_buf);
+	if (ret < 0)
+		return ESTALE;
+	if (stat_buf.st_size != this->size)
+		return ESTALE;
+	if (stat_buf.st_mtime == this->mtime)
+		return ESUCCESS;
+
+	/* Touched; see if the contents changed. */
+	err = pch_dep_hash(this->path, &hash);
+	if (err)
+		return ESTALE;
+	return hash == this->hash ? ESUCCESS : ESTALE;
+}
+/*****************************************************************************/
+/* Makes room for size more bytes. */
+static
+err_t pch_reserve(struct pch_writer *this,
+				  const size_t size)
+{
+	size_t num;
+	char *buffer;
+
+	if (this->size + size <= this->num_allocated)
+		return ESUCCESS;
+	num = this->num_allocated ? this->num_allocated : 4096;
+	while (this->size + size > num)
+		num *= 2;
+	buffer = realloc(this->buffer, num);
+	if (buffer == NULL)
+		return ENOMEM;
+	this->buffer = buffer;
+	this->num_allocated = num;
+	return ESUCCESS;
+}
+
+static
+err_t pch_write(struct pch_writer *this,
+				const void *p,
+				const size_t size)
+{
+	err_t err;
+
+	err = pch_reserve(this, size);
+	if (err)
+		return err;
+	memcpy(this->buffer + this->size, p, size);
+	this->size += size;
+	return ESUCCESS;
+}
+
+static
+err_t pch_write_u32(struct pch_writer *this,
+					const uint32_t value)
+{
+	return pch_write(this, &value, sizeof(value));
+}
+
+static
+err_t pch_write_u64(struct pch_writer *this,
+					const uint64_t value)
+{
+	return pch_write(this, &value, sizeof(value));
+}
+
+static
+err_t pch_write_string(struct pch_writer *this,
+					   const char *str,
+					   const size_t len)
+{
+	err_t err;
+
+	err = pch_write_u32(this, len);
+	if (!err && len)
+		err = pch_write(this, str, len);
+	return err;
+}
+
+static
+err_t pch_write_token(struct pch_writer *this,
+					  const struct cpp_token *token)
+{
+	err_t err;
+	uint8_t flags;
+	const struct lexer_token *base = token->base;
+
+	flags = 0;
+	if (token->has_white_space)
+		flags |= PCH_TOKEN_HAS_WHITE_SPACE;
+	if (token->is_first)
+		flags |= PCH_TOKEN_IS_FIRST;
+	if (token->is_marked)
+		flags |= PCH_TOKEN_IS_MARKED;
+	if (base->has_white_space)
+		flags |= PCH_TOKEN_BASE_HAS_WHITE_SPACE;
+	if (base->is_first)
+		flags |= PCH_TOKEN_BASE_IS_FIRST;
+
+	err = pch_write_u32(this, base->type);
+	if (!err)
+		err = pch_write(this, &flags, sizeof(flags));
+	if (!err)
+		err = pch_write_string(this, base->source, base->source_len);
+	if (err)
+		return err;
+	if (base->resolved == base->source)
+		return pch_write_u32(this, PCH_SAME_AS_SOURCE);
+	return pch_write_string(this, base->resolved, base->resolved_len);
+}
+
+static
+err_t pch_write_tokens(struct pch_writer *this,
+					   const struct cpp_tokens *tokens)
+{
+	int i;
+	err_t err;
+	struct cpp_token *token;
+
+	err = pch_write_u32(this, cpp_tokens_num_entries(tokens));
+	CPP_TOKENS_FOR_EACH(tokens, i, token) {
+		if (err)
+			break;
+		err = pch_write_token(this, token);
+	}
+	return err;
+}
+
+static
+err_t pch_write_macro(struct pch_writer *this,
+					  const struct macro *macro)
+{
+	err_t err;
+	uint8_t flags[2];
+
+	flags[0] = macro->is_function_like;
+	flags[1] = macro->is_variadic;
+	err = pch_write(this, flags, sizeof(flags));
+	if (!err)
+		err = pch_write_token(this, macro->identifier);
+	if (!err)
+		err = pch_write_tokens(this, &macro->parameters);
+	if (!err)
+		err = pch_write_tokens(this, &macro->replacement_list);
+	return err;
+}
+
+/* Appends [begin, end) of the cpp_tokens file. */
+static
+err_t pch_write_output(struct pch_writer *this,
+					   const int fd,
+					   const off_t begin,
+					   const off_t end)
+{
+	err_t err;
+	ssize_t ret;
+	size_t size;
+
+	size = end - begin;
+	err = pch_write_u64(this, size);
+	if (err || size == 0)
+		return err;
+
+	err = pch_reserve(this, size);
+	if (err)
+		return err;
+	if (lseek(fd, begin, SEEK_SET) < 0)
+		return errno;
+	while (size) {
+		ret = read(fd, this->buffer + this->size, size);
+		if (ret <= 0) {
+			err = ret < 0 ? errno : EIO;
+			break;
+		}
+		this->size += ret;
+		size -= ret;
+	}
+	if (lseek(fd, end, SEEK_SET) < 0 && !err)
+		err = errno;
+	return err;
+}
+/*****************************************************************************/
+static
+err_t pch_read(struct pch_reader *this,
+			   void *out,
+			   const size_t size)
+{
+	if (size > this->size - this->pos)
+		return ESTALE;
+	memcpy(out, this->buffer + this->pos, size);
+	this->pos += size;
+	return ESUCCESS;
+}
+
+static
+err_t pch_read_u32(struct pch_reader *this,
+				   uint32_t *out)
+{
+	return pch_read(this, out, sizeof(*out));
+}
+
+static
+err_t pch_read_u64(struct pch_reader *this,
+				   uint64_t *out)
+{
+	return pch_read(this, out, sizeof(*out));
+}
+
+/* The string points into the mapped file. */
+static
+err_t pch_read_string(struct pch_reader *this,
+					  const char **out,
+					  uint32_t *out_len)
+{
+	err_t err;
+	uint32_t len;
+
+	err = pch_read_u32(this, &len);
+	if (err)
+		return err;
+	if (len > this->size - this->pos)
+		return ESTALE;
+	*out = this->buffer + this->pos;
+	*out_len = len;
+	this->pos += len;
+	return ESUCCESS;
+}
+
+static
+err_t pch_read_token(struct pch_reader *this,
+					 struct cpp_token **out)
+{
+	err_t err;
+	uint8_t flags;
+	uint32_t type, len[2];
+	const char *str[2];
+	struct lexer_token *base;
+	struct cpp_token *token;
+
+	err = pch_read_u32(this, &type);
+	if (!err)
+		err = pch_read(this, &flags, sizeof(flags));
+	if (!err)
+		err = pch_read_string(this, &str[0], &len[0]);
+	if (!err)
+		err = pch_read_u32(this, &len[1]);
+	if (err)
+		return err;
+	str[1] = str[0];
+	if (len[1] == PCH_SAME_AS_SOURCE) {
+		len[1] = len[0];
+	} else {
+		this->pos -= sizeof(len[1]);
+		err = pch_read_string(this, &str[1], &len[1]);
+		if (err)
+			return err;
+	}
+
+	err = lexer_token_new(type, str[0], len[0], str[1], len[1], &base);
+	if (err)
+		return err == EINVAL ? ESTALE : err;
+	base->has_white_space = flags & PCH_TOKEN_BASE_HAS_WHITE_SPACE;
+	base->is_first = flags & PCH_TOKEN_BASE_IS_FIRST;
+	err = cpp_token_new(base, &token);	/* move lexer's ref */
+	if (err) {
+		lexer_token_deref(base);
+		return err;
+	}
+	token->has_white_space = flags & PCH_TOKEN_HAS_WHITE_SPACE;
+	token->is_first = flags & PCH_TOKEN_IS_FIRST;
+	token->is_marked = flags & PCH_TOKEN_IS_MARKED;
+	*out = token;
+	return ESUCCESS;
+}
+
+/* out is initialized by the caller. */
+static
+err_t pch_read_tokens(struct pch_reader *this,
+					  struct cpp_tokens *out)
+{
+	err_t err;
+	uint32_t i, num;
+	struct cpp_token *token;
+
+	err = pch_read_u32(this, &num);
+	for (i = 0; !err && i < num; ++i) {
+		err = pch_read_token(this, &token);
+		if (err)
+			break;
+		err = cpp_tokens_add_tail(out, token);
+		if (err)
+			cpp_token_delete(token);
+	}
+	return err;
+}
+
+static
+err_t pch_read_macro(struct pch_reader *this,
+					 struct macro **out)
+{
+	err_t err;
+	uint8_t flags[2];
+	struct macro *macro;
+
+	err = pch_read(this, flags, sizeof(flags));
+	if (err)
+		return err;
+
+	macro = malloc(sizeof(*macro));
+	if (macro == NULL)
+		return ENOMEM;
+	stats_note_alloc(STATS_SUBSYSTEM_SCANNER, sizeof(*macro));
+	macro->is_function_like = flags[0];
+	macro->is_variadic = flags[1];
+	macro->generation = 0;
+	macro->profile = NULL;
+	cpp_tokens_init(&macro->parameters);
+	cpp_tokens_init(&macro->replacement_list);
+	err = pch_read_token(this, &macro->identifier);
+	if (err) {
+		free(macro);
+		return err;
+	}
+	err = pch_read_tokens(this, &macro->parameters);
+	if (!err)
+		err = pch_read_tokens(this, &macro->replacement_list);
+	if (err) {
+		macro_delete(macro);
+		return err;
+	}
+	*out = macro;
+	return ESUCCESS;
+}
+/*****************************************************************************/
+static
+err_t scanner_write_pch(struct scanner *this,
+						const off_t output_begin,
+						const off_t output_end)
+{
+	err_t err;
+	int i, fd;
+	ssize_t ret;
+	size_t size, path_len;
+	char *tmp_path;
+	const char *p;
+	struct pch_writer writer;
+	const struct pch_dep *dep;
+	const struct macro *macro;
+	static const char magic[8] = PCH_MAGIC;
+
+	writer.buffer = NULL;
+	writer.size = writer.num_allocated = 0;
+
+	err = pch_write(&writer, magic, sizeof(magic));
+	if (!err)
+		err = pch_write_u32(&writer, PCH_VERSION);
+	if (!err)
+		err = pch_write_u32(&writer, PCH_BYTE_ORDER);
+	if (!err)
+		err = pch_write_string(&writer, this->prefix_header_path,
+							   strlen(this->prefix_header_path));
+	if (!err)
+		err = pch_write_string(&writer, this->command_line_macros,
+							   this->command_line_macros_size);
+
+	if (!err)
+		err = pch_write_u32(&writer, ptrq_num_entries(&this->pch_deps));
+	PTRQ_FOR_EACH(&this->pch_deps, i, dep) {
+		if (!err)
+			err = pch_write_string(&writer, dep->path, strlen(dep->path));
+		if (!err)
+			err = pch_write_u64(&writer, dep->size);
+		if (!err)
+			err = pch_write_u64(&writer, dep->mtime);
+		if (!err)
+			err = pch_write_u64(&writer, dep->hash);
+	}
+
+	if (!err)
+		err = pch_write_u32(&writer, ptrq_num_entries(&this->macros.q));
+	MACROS_FOR_EACH(&this->macros, i, macro) {
+		if (!err)
+			err = pch_write_macro(&writer, macro);
+	}
+	if (!err)
+		err = pch_write_output(&writer, this->cpp_tokens_fd, output_begin,
+							   output_end);
+	if (err)
+		goto err0;
+
+	/* Write to a temporary name, and rename, so that readers see it whole. */
+	path_len = strlen(this->pch_path);
+	tmp_path = malloc(path_len + sizeof(".tmp"));
+	if (tmp_path == NULL) {
+		err = ENOMEM;
+		goto err0;
+	}
+	strcpy(tmp_path, this->pch_path);
+	strcat(tmp_path, ".tmp");
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		err = errno;
+		goto err1;
+	}
+	p = writer.buffer;
+	size = writer.size;
+	while (size) {
+		ret = write(fd, p, size);
+		if (ret < 0) {
+			err = errno;
+			break;
+		}
+		p += ret;
+		size -= ret;
+	}
+	close(fd);
+	if (!err && rename(tmp_path, this->pch_path) < 0)
+		err = errno;
+	if (err)
+		unlink(tmp_path);
+err1:
+	free(tmp_path);
+err0:
+	free(writer.buffer);
+	return err;
+}
+
+/*
+ * Returns ENOENT if there is no pch, and ESTALE if it cannot be used; the
+ * scanner state is unchanged in both cases.
+ */
+static
+err_t scanner_load_pch(struct scanner *this)
+{
+	err_t err;
+	int ret;
+	uint32_t i, num, version, byte_order, len;
+	uint64_t size, value[3];
+	char magic[8];
+	char path[PATH_MAX];
+	const char *str;
+	struct pch_reader reader;
+	struct pch_dep dep;
+	struct macros macros;
+	struct macro *macro;
+
+	err = pch_map_file(this->pch_path, &reader.buffer, &reader.size);
+	if (err)
+		return err;
+	reader.pos = 0;
+	macros_init(&macros);
+
+	err = pch_read(&reader, magic, sizeof(magic));
+	if (!err)
+		err = pch_read_u32(&reader, &version);
+	if (!err)
+		err = pch_read_u32(&reader, &byte_order);
+	if (err)
+		goto err0;
+	err = ESTALE;
+	if (memcmp(magic, PCH_MAGIC, sizeof(magic)) ||
+		version != PCH_VERSION ||
+		byte_order != PCH_BYTE_ORDER)
+		goto err0;
+
+	/* Built from the same prefix, and under the same -D/-U? */
+	err = pch_read_string(&reader, &str, &len);
+	if (err)
+		goto err0;
+	err = ESTALE;
+	if (this->prefix_header_path &&
+		(len != strlen(this->prefix_header_path) ||
+		 memcmp(str, this->prefix_header_path, len)))
+		goto err0;
+	err = pch_read_string(&reader, &str, &len);
+	if (err)
+		goto err0;
+	err = ESTALE;
+	if (len != this->command_line_macros_size ||
+		(len && memcmp(str, this->command_line_macros, len)))
+		goto err0;
+
+	err = pch_read_u32(&reader, &num);
+	for (i = 0; !err && i < num; ++i) {
+		err = pch_read_string(&reader, &str, &len);
+		if (!err && len >= sizeof(path))
+			err = ESTALE;
+		if (err)
+			break;
+		memcpy(path, str, len);
+		path[len] = NULL_CHAR;
+		err = pch_read(&reader, value, sizeof(value));
+		if (err)
+			break;
+		dep.path = path;
+		dep.size = value[0];
+		dep.mtime = value[1];
+		dep.hash = value[2];
+		err = pch_dep_check(&dep);
+	}
+
+	if (!err)
+		err = pch_read_u32(&reader, &num);
+	for (i = 0; !err && i < num; ++i) {
+		err = pch_read_macro(&reader, &macro);
+		if (!err)
+			macro->generation = ++this->macros_generation;
+		if (!err)
+			err = macros_add_tail(&macros, macro);
+	}
+	if (!err)
+		err = pch_read_u64(&reader, &size);
+	if (!err && size > reader.size - reader.pos)
+		err = ESTALE;
+	if (err)
+		goto err0;
+
+	/* Commit */
+	str = reader.buffer + reader.pos;
+	while (size) {
+		ret = write(this->cpp_tokens_fd, str, size);
+		if (ret < 0) {
+			err = errno;
+			goto err0;
+		}
+		str += ret;
+		size -= ret;
+	}
+	err = scanner_reset_token_spellings(this);
+	if (err)
+		goto err0;
+	assert(ptrq_is_empty(&this->macros.q));
+	err = ptrq_move(&macros.q, &this->macros.q);
+	this->is_running_predefined_macros = false;
+err0:
+	macros_empty(&macros);
+	pch_unmap_file(reader.buffer, reader.size);
+	return err;
+}
+
+/* Records the files that the prefix pulls in, and then writes the pch. */
+static
+err_t scanner_scan_prefix_header(struct scanner *this)
+{
+	err_t err;
+	off_t begin, end;
+
+	begin = end = 0;
+	if (this->pch_path) {
+		err = scanner_reset_token_spellings(this);
+		if (err)
+			return err;
+		begin = this->token_spellings.position;
+		this->is_recording_pch_deps = true;
+	}
+	err = scanner_scan_file(this, this->prefix_header_path);
+	this->is_recording_pch_deps = false;
+	if (err || this->pch_path == NULL)
+		return err;
+	end = lseek(this->cpp_tokens_fd, 0, SEEK_CUR);
+	if (end < 0)
+		return errno;
+	return scanner_write_pch(this, begin, end);
+}
+
+/*****************************************************************************/
+/*
+ * Include cache.
+ *
+ * When a cache directory is set, each #include is recorded as it is scanned:
+ * the files it reads, the macros it reads before writing them (its inputs,
+ * along with their state at the time), the #define/#undef that change the
+ * macro table, and the cpp tokens that it serializes. The record is stored
+ * in a file named after the path and the contents hash of the included file.
+ * A later #include of the same file whose inputs are in the same state, and
+ * whose files are unchanged, is replayed from the record instead of being
+ * scanned.
+ *
+ * Each cache file keeps the latest INCLUDE_CACHE_NUM_VARIANTS records, for
+ * different inputs. A hit bumps the mtime of the file; when the directory
+ * grows beyond its size, the files with the oldest mtime are removed.
+ *
+ * The layout reuses the pch encoding.
+ *	magic[8], u32 version, u32 byte-order mark
+ *	string path, u64 contents hash, u32 num-variants
+ *	for each variant: u64 size, and then
+ *		u32 num-deps; for each: string path, u64 size, u64 mtime, u64 hash
+ *		u32 num-inputs; for each: string name, u8 is_defined, u64 hash
+ *		u32 num-ops; for each: u8 INCLUDE_OP_DEFINE, macro, or
+ *			u8 INCLUDE_OP_UNDEF, string name
+ *		u64 output size, output bytes
+ */
+#define INCLUDE_CACHE_MAGIC			"x24-inc"	/* 8 bytes, with the nul */
+#define INCLUDE_CACHE_VERSION		3
+#define INCLUDE_CACHE_NUM_VARIANTS	4
+
+enum include_op {
+	INCLUDE_OP_UNDEF,
+	INCLUDE_OP_DEFINE,
+};
+
+/*
+ * A macro that an include read, or wrote, first. Only the ones read first
+ * are inputs.
+ */
+struct include_input {
+	const char	*name;
+	uint64_t	hash;	/* of the definition */
+	bool		is_defined;
+	bool		is_written;	/* written before read; not an input */
+};
+
+struct include_recorder {
+	struct ptr_queue	deps;	/* of pch_dep */
+	struct ptr_queue	inputs;	/* of include_input */
+	struct pch_writer	ops;
+	uint32_t	num_ops;
+	off_t		output_begin;
+	bool		is_invalid;	/* Ran out of memory while recording */
+};
+
+static
+void include_input_delete(void *p)
+{
+	struct include_input *this = p;
+	free((void *)this->name);
+	free(this);
+}
+
+static
+void include_recorder_delete(void *p)
+{
+	struct include_recorder *this = p;
+	ptrq_empty(&this->deps);
+	ptrq_empty(&this->inputs);
+	free(this->ops.buffer);
+	free(this);
+}
+
+static
+err_t include_recorder_new(const off_t output_begin,
+						   struct include_recorder **out)
+{
+	struct include_recorder *this;
+
+	this = malloc(sizeof(*this));
+	if (this == NULL)
+		return ENOMEM;
+	ptrq_init(&this->deps, pch_dep_delete);
+	ptrq_init(&this->inputs, include_input_delete);
+	this->ops.buffer = NULL;
+	this->ops.size = this->ops.num_allocated = 0;
+	this->num_ops = 0;
+	this->output_begin = output_begin;
+	this->is_invalid = false;
+	*out = this;
+	return ESUCCESS;
+}
+
+/* The hash of the serialized definition. */
+static
+err_t macro_hash(const struct macro *this,
+				 uint64_t *out)
+{
+	err_t err;
+	struct pch_writer writer;
+
+	writer.buffer = NULL;
+	writer.size = writer.num_allocated = 0;
+	err = pch_write_macro(&writer, this);
+	if (!err)
+		*out = pch_hash(writer.buffer, writer.size);
+	free(writer.buffer);
+	return err;
+}
+
+static
+struct include_input *include_recorder_find_input(const struct include_recorder
+												  *this,
+												  const char *name)
+{
+	int i;
+	struct include_input *input;
+
+	PTRQ_FOR_EACH(&this->inputs, i, input) {
+		if (!strcmp(input->name, name))
+			return input;
+	}
+	return NULL;
+}
+
+static
+err_t include_recorder_add_input(struct include_recorder *this,
+								 const char *name,
+								 const struct macro *macro,
+								 const bool is_written)
+{
+	err_t err;
+	struct include_input *input;
+
+	input = malloc(sizeof(*input));
+	if (input == NULL)
+		return ENOMEM;
+	input->name = strdup(name);
+	if (input->name == NULL) {
+		free(input);
+		return ENOMEM;
+	}
+	input->hash = 0;
+	input->is_defined = macro != NULL;
+	input->is_written = is_written;
+	err = ESUCCESS;
+	if (macro && !is_written)
+		err = macro_hash(macro, &input->hash);
+	if (!err)
+		err = ptrq_add_tail(&this->inputs, input);
+	if (err)
+		include_input_delete(input);
+	return err;
+}
+
+/* Called on each lookup of a macro, while recording. */
+static
+void scanner_note_macro_read(const struct scanner *this,
+							 const char *name,
+							 const struct macro *macro)
+{
+	int i;
+	err_t err;
+	struct include_recorder *recorder;
+
+	PTRQ_FOR_EACH(&this->include_recorders, i, recorder) {
+		if (recorder->is_invalid ||
+			include_recorder_find_input(recorder, name))
+			continue;
+		err = include_recorder_add_input(recorder, name, macro, false);
+		if (err)
+			recorder->is_invalid = true;
+	}
+}
+
+/* macro is NULL for an #undef. */
+static
+void scanner_note_macro_write(struct scanner *this,
+							  const char *name,
+							  const struct macro *macro)
+{
+	int i;
+	err_t err;
+	uint8_t op;
+	struct include_recorder *recorder;
+
+	op = macro ? INCLUDE_OP_DEFINE : INCLUDE_OP_UNDEF;
+	PTRQ_FOR_EACH(&this->include_recorders, i, recorder) {
+		if (recorder->is_invalid)
+			continue;
+		err = ESUCCESS;
+		if (include_recorder_find_input(recorder, name) == NULL)
+			err = include_recorder_add_input(recorder, name, macro, true);
+		if (!err)
+			err = pch_write(&recorder->ops, &op, sizeof(op));
+		if (!err && macro)
+			err = pch_write_macro(&recorder->ops, macro);
+		else if (!err)
+			err = pch_write_string(&recorder->ops, name, strlen(name));
+		++recorder->num_ops;
+		if (err)
+			recorder->is_invalid = true;
+	}
+}
+
+/* Called for each file that is scanned, or replayed from the cache. */
+static
+err_t scanner_note_file_read(struct scanner *this,
+							 const char *path)
+{
+	int i;
+	err_t err;
+	struct include_recorder *recorder;
+
+	err = ESUCCESS;
+	if (this->is_recording_pch_deps)
+		err = pch_deps_add(&this->pch_deps, path);
+	if (err)
+		return err;
+	PTRQ_FOR_EACH(&this->include_recorders, i, recorder) {
+		if (recorder->is_invalid)
+			continue;
+		err = pch_deps_add(&recorder->deps, path);
+		if (err)
+			recorder->is_invalid = true;
+	}
+	return ESUCCESS;
+}
+/*****************************************************************************/
+/* Returns the malloc'd path of the cache file for the included file. */
+static
+err_t scanner_include_cache_path(const struct scanner *this,
+								 const char *path,
+								 const uint64_t file_hash,
+								 char **out)
+{
+	char *cache_path;
+	uint64_t hash;
+	size_t len;
+
+	hash = pch_hash(path, strlen(path)) ^ file_hash;
+	len = strlen(this->include_cache_dir) + 1 + 16;	/* / and hex */
+	cache_path = malloc(len + 1);
+	if (cache_path == NULL)
+		return ENOMEM;
+	sprintf(cache_path, "%s/%016llx", this->include_cache_dir,
+			(unsigned long long)hash);
+	*out = cache_path;
+	return ESUCCESS;
+}
+
+/*
+ * Checks the header of a cache file, and positions the reader at the
+ * num-variants. Returns ENOENT if the file belongs to another include.
+ */
+static
+err_t include_cache_read_header(struct pch_reader *reader,
+								const char *path,
+								const uint64_t file_hash)
+{
+	err_t err;
+	uint32_t version, byte_order, len;
+	uint64_t hash;
+	char magic[8];
+	const char *str;
+
+	err = pch_read(reader, magic, sizeof(magic));
+	if (!err)
+		err = pch_read_u32(reader, &version);
+	if (!err)
+		err = pch_read_u32(reader, &byte_order);
+	if (!err)
+		err = pch_read_string(reader, &str, &len);
+	if (!err)
+		err = pch_read_u64(reader, &hash);
+	if (err ||
+		memcmp(magic, INCLUDE_CACHE_MAGIC, sizeof(magic)) ||
+		version != INCLUDE_CACHE_VERSION ||
+		byte_order != PCH_BYTE_ORDER ||
+		len != strlen(path) ||
+		memcmp(str, path, len) ||
+		hash != file_hash)
+		return ENOENT;
+	return ESUCCESS;
+}
+
+/* Returns ENOENT if the variant does not apply in the current state. */
+static
+err_t scanner_check_include_variant(const struct scanner *this,
+									struct pch_reader *reader)
+{
+	err_t err;
+	uint8_t is_defined;
+	uint32_t i, num, len;
+	uint64_t hash, value[3];
+	char name[PATH_MAX];
+	const char *str;
+	struct pch_dep dep;
+	const struct macro *macro;
+
+	err = pch_read_u32(reader, &num);
+	for (i = 0; !err && i < num; ++i) {
+		err = pch_read_string(reader, &str, &len);
+		if (!err && len >= sizeof(name))
+			err = ESTALE;
+		if (!err)
+			err = pch_read(reader, value, sizeof(value));
+		if (err)
+			break;
+		memcpy(name, str, len);
+		name[len] = NULL_CHAR;
+		dep.path = name;
+		dep.size = value[0];
+		dep.mtime = value[1];
+		dep.hash = value[2];
+		err = pch_dep_check(&dep);
+	}
+
+	if (!err)
+		err = pch_read_u32(reader, &num);
+	for (i = 0; !err && i < num; ++i) {
+		err = pch_read_string(reader, &str, &len);
+		if (!err && len >= sizeof(name))
+			err = ESTALE;
+		if (!err)
+			err = pch_read(reader, &is_defined, sizeof(is_defined));
+		if (!err)
+			err = pch_read_u64(reader, &hash);
+		if (err)
+			break;
+		memcpy(name, str, len);
+		name[len] = NULL_CHAR;
+		macro = scanner_find_macro(this, name);
+		if ((macro != NULL) != is_defined) {
+			err = ESTALE;
+			break;
+		}
+		if (macro == NULL)
+			continue;
+		err = macro_hash(macro, &value[0]);
+		if (!err && value[0] != hash)
+			err = ESTALE;
+	}
+	return err == ESTALE ? ENOENT : err;
+}
+
+/* Applies the #define/#undef of the variant, and writes its output. */
+static
+err_t scanner_apply_include_variant(struct scanner *this,
+									struct pch_reader *reader)
+{
+	err_t err;
+	int i;
+	ssize_t ret;
+	uint8_t op;
+	uint32_t j, num, len;
+	uint64_t size;
+	char name[PATH_MAX];
+	const char *str;
+	struct macro *macro;
+
+	/* Rewind, and note the files for the enclosing records, and the pch. */
+	reader->pos = 0;
+	err = pch_read_u32(reader, &num);
+	for (j = 0; !err && j < num; ++j) {
+		err = pch_read_string(reader, &str, &len);
+		if (!err)
+			err = pch_read(reader, name, 3 * sizeof(uint64_t));
+		if (err)
+			break;
+		memcpy(name, str, len);
+		name[len] = NULL_CHAR;
+		err = scanner_note_file_read(this, name);
+	}
+
+	/* Skip the inputs */
+	if (!err)
+		err = pch_read_u32(reader, &num);
+	for (j = 0; !err && j < num; ++j) {
+		err = pch_read_string(reader, &str, &len);
+		if (!err)
+			err = pch_read(reader, name, sizeof(uint8_t) + sizeof(uint64_t));
+	}
+
+	if (!err)
+		err = pch_read_u32(reader, &num);
+	for (j = 0; !err && j < num; ++j) {
+		err = pch_read(reader, &op, sizeof(op));
+		if (err)
+			break;
+		if (op == INCLUDE_OP_DEFINE) {
+			err = pch_read_macro(reader, &macro);
+			if (!err)
+				err = scanner_add_macro(this, macro);
+			continue;
+		}
+		err = pch_read_string(reader, &str, &len);
+		if (!err && len >= sizeof(name))
+			err = ESTALE;
+		if (err)
+			break;
+		memcpy(name, str, len);
+		name[len] = NULL_CHAR;
+		i = scanner_find_macro_index(this, name);
+		if (i < 0)
+			continue;
+		scanner_note_macro_write(this, name, NULL);
+		macros_delete_entry(&this->macros, i);
+		++this->macros_generation;
+	}
+
+	if (!err)
+		err = pch_read_u64(reader, &size);
+	if (!err && size > reader->size - reader->pos)
+		err = ESTALE;
+	str = reader->buffer + reader->pos;
+	while (!err && size) {
+		ret = write(this->cpp_tokens_fd, str, size);
+		if (ret < 0) {
+			err = errno;
+			break;
+		}
+		str += ret;
+		size -= ret;
+	}
+	if (!err)
+		err = scanner_reset_token_spellings(this);
+	return err;
+}
+
+/* Returns ENOENT on a miss. */
+static
+err_t scanner_replay_include(struct scanner *this,
+							 const char *path,
+							 const uint64_t file_hash)
+{
+	err_t err;
+	uint32_t i, num;
+	uint64_t size;
+	char *cache_path;
+	struct pch_reader reader, variant;
+
+	err = scanner_include_cache_path(this, path, file_hash, &cache_path);
+	if (err)
+		return err;
+	err = pch_map_file(cache_path, &reader.buffer, &reader.size);
+	if (err) {
+		free(cache_path);
+		return ENOENT;
+	}
+	reader.pos = 0;
+
+	err = include_cache_read_header(&reader, path, file_hash);
+	if (!err)
+		err = pch_read_u32(&reader, &num);
+	for (i = 0; !err && i < num; ++i) {
+		err = pch_read_u64(&reader, &size);
+		if (!err && size > reader.size - reader.pos)
+			err = ESTALE;
+		if (err)
+			break;
+		variant.buffer = reader.buffer + reader.pos;
+		variant.size = size;
+		variant.pos = 0;
+		reader.pos += size;
+		err = scanner_check_include_variant(this, &variant);
+		if (err == ENOENT) {
+			err = ESUCCESS;
+			continue;
+		}
+		if (!err)
+			err = scanner_apply_include_variant(this, &variant);
+		if (!err)
+			utime(cache_path, NULL);	/* LRU */
+		goto done;
+	}
+	err = ENOENT;
+done:
+	pch_unmap_file(reader.buffer, reader.size);
+	free(cache_path);
+	return err == ESTALE ? ENOENT : err;
+}
+/*****************************************************************************/
+struct include_cache_file {
+	char	*path;
+	off_t	size;
+	time_t	mtime;
+};
+
+static
+int include_cache_file_compare(const void *a,
+							   const void *b)
+{
+	const struct include_cache_file *f[2] = {a, b};
+
+	if (f[0]->mtime == f[1]->mtime)
+		return 0;
+	return f[0]->mtime < f[1]->mtime ? -1 : 1;
+}
+
+/* Removes the least recently used files until the directory fits. */
+static
+void scanner_evict_include_cache(const struct scanner *this)
+{
+	int i, num_files, num_allocated, ret;
+	off_t total;
+	char *path;
+	DIR *dir;
+	struct dirent *entry;
+	struct stat stat_buf;
+	struct include_cache_file *files, *p;
+
+	dir = opendir(this->include_cache_dir);
+	if (dir == NULL)
+		return;
+	files = NULL;
+	num_files = num_allocated = 0;
+	total = 0;
+	while ((entry = readdir(dir))) {
+		if (strchr(entry->d_name, '.'))
+			continue;	/* ., .., and the temporaries */
+		path = malloc(strlen(this->include_cache_dir) + 1 +
+					  strlen(entry->d_name) + 1);
+		if (path == NULL)
+			break;
+		sprintf(path, "%s/%s", this->include_cache_dir, entry->d_name);
+		ret = stat(path, &stat_buf);
+		if (ret < 0 || !S_ISREG(stat_buf.st_mode)) {
+			free(path);
+			continue;
+		}
+		if (num_files == num_allocated) {
+			num_allocated = num_allocated ? 2 * num_allocated : 64;
+			p = realloc(files, num_allocated * sizeof(*files));
+			if (p == NULL) {
+				free(path);
+				break;
+			}
+			files = p;
+		}
+		files[num_files].path = path;
+		files[num_files].size = stat_buf.st_size;
+		files[num_files].mtime = stat_buf.st_mtime;
+		total += stat_buf.st_size;
+		++num_files;
+	}
+	closedir(dir);
+
+	if (total > this->include_cache_size)
+		qsort(files, num_files, sizeof(*files), include_cache_file_compare);
+	for (i = 0; i < num_files; ++i) {
+		if (total > this->include_cache_size &&
+			unlink(files[i].path) == 0)
+			total -= files[i].size;
+		free(files[i].path);
+	}
+	free(files);
+}
+
+/*
+ * Stores the record as the latest variant, keeping the newest of the ones
+ * already in the cache file.
+ */
+static
+err_t scanner_store_include(struct scanner *this,
+							const char *path,
+							const uint64_t file_hash,
+							const struct include_recorder *recorder,
+							const off_t output_end)
+{
+	err_t err;
+	int i, fd;
+	ssize_t ret;
+	uint32_t num, num_inputs, j;
+	uint64_t size;
+	size_t variant_pos;
+	char *cache_path, *tmp_path;
+	const char *p;
+	struct pch_writer writer;
+	struct pch_reader reader;
+	const struct pch_dep *dep;
+	const struct include_input *input;
+	static const char magic[8] = INCLUDE_CACHE_MAGIC;
+
+	writer.buffer = NULL;
+	writer.size = writer.num_allocated = 0;
+
+	err = pch_write(&writer, magic, sizeof(magic));
+	if (!err)
+		err = pch_write_u32(&writer, INCLUDE_CACHE_VERSION);
+	if (!err)
+		err = pch_write_u32(&writer, PCH_BYTE_ORDER);
+	if (!err)
+		err = pch_write_string(&writer, path, strlen(path));
+	if (!err)
+		err = pch_write_u64(&writer, file_hash);
+	if (!err)
+		err = pch_write_u32(&writer, 1);	/* num-variants, fixed below */
+
+	/* The variant; its size is fixed below. */
+	variant_pos = writer.size;
+	if (!err)
+		err = pch_write_u64(&writer, 0);
+	if (!err)
+		err = pch_write_u32(&writer, ptrq_num_entries(&recorder->deps));
+	PTRQ_FOR_EACH(&recorder->deps, i, dep) {
+		if (!err)
+			err = pch_write_string(&writer, dep->path, strlen(dep->path));
+		if (!err)
+			err = pch_write_u64(&writer, dep->size);
+		if (!err)
+			err = pch_write_u64(&writer, dep->mtime);
+		if (!err)
+			err = pch_write_u64(&writer, dep->hash);
+	}
+
+	num_inputs = 0;
+	PTRQ_FOR_EACH(&recorder->inputs, i, input)
+		num_inputs += !input->is_written;
+	if (!err)
+		err = pch_write_u32(&writer, num_inputs);
+	PTRQ_FOR_EACH(&recorder->inputs, i, input) {
+		if (err)
+			break;
+		if (input->is_written)
+			continue;
+		err = pch_write_string(&writer, input->name, strlen(input->name));
+		if (!err)
+			err = pch_write(&writer, &input->is_defined, sizeof(uint8_t));
+		if (!err)
+			err = pch_write_u64(&writer, input->hash);
+	}
+
+	if (!err)
+		err = pch_write_u32(&writer, recorder->num_ops);
+	if (!err && recorder->num_ops)
+		err = pch_write(&writer, recorder->ops.buffer, recorder->ops.size);
+	if (!err)
+		err = pch_write_output(&writer, this->cpp_tokens_fd,
+							   recorder->output_begin, output_end);
+	if (err)
+		goto err0;
+	size = writer.size - variant_pos - sizeof(size);
+	memcpy(writer.buffer + variant_pos, &size, sizeof(size));
+
+	err = scanner_include_cache_path(this, path, file_hash, &cache_path);
+	if (err)
+		goto err0;
+
+	/* Copy the older variants. */
+	num = 1;
+	j = 0;
+	if (pch_map_file(cache_path, &reader.buffer, &reader.size) == ESUCCESS) {
+		reader.pos = 0;
+		err = include_cache_read_header(&reader, path, file_hash);
+		if (!err)
+			err = pch_read_u32(&reader, &j);
+		for (; !err && j && num < INCLUDE_CACHE_NUM_VARIANTS; --j, ++num) {
+			p = reader.buffer + reader.pos;
+			err = pch_read_u64(&reader, &size);
+			if (!err && size > reader.size - reader.pos)
+				err = ESTALE;
+			if (!err)
+				err = pch_write(&writer, p, sizeof(size) + size);
+			reader.pos += size;
+		}
+		pch_unmap_file(reader.buffer, reader.size);
+		if (err == ENOMEM)
+			goto err1;
+		err = ESUCCESS;	/* Keep what could be read */
+	}
+	memcpy(writer.buffer + variant_pos - sizeof(num), &num, sizeof(num));
+
+	/* Write to a temporary name, and rename, so that readers see it whole. */
+	tmp_path = malloc(strlen(cache_path) + 32);
+	if (tmp_path == NULL) {
+		err = ENOMEM;
+		goto err1;
+	}
+	sprintf(tmp_path, "%s.%d.tmp", cache_path, (int)getpid());
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		err = errno;
+		goto err2;
+	}
+	p = writer.buffer;
+	size = writer.size;
+	while (size) {
+		ret = write(fd, p, size);
+		if (ret < 0) {
+			err = errno;
+			break;
+		}
+		p += ret;
+		size -= ret;
+	}
+	close(fd);
+	if (!err && rename(tmp_path, cache_path) < 0)
+		err = errno;
+	if (err)
+		unlink(tmp_path);
+	if (!err)
+		scanner_evict_include_cache(this);
+err2:
+	free(tmp_path);
+err1:
+	free(cache_path);
+err0:
+	free(writer.buffer);
+	return err;
+}
+
+/*
+ * Replays the include from the cache, or scans it while recording. A failure
+ * to store the record only loses the record.
+ */
+static
+err_t scanner_scan_include_cached(struct scanner *this,
+								  const char *path)
+{
+	err_t err;
+	uint64_t file_hash;
+	off_t begin, end;
+	struct include_recorder *recorder;
+
+	err = pch_dep_hash(path, &file_hash);
+	if (err)
+		return err;
+	err = scanner_replay_include(this, path, file_hash);
+	if (err != ENOENT)
+		return err;
+
+	err = scanner_reset_token_spellings(this);
+	if (err)
+		return err;
+	begin = this->token_spellings.position;
+	err = include_recorder_new(begin, &recorder);
+	if (!err)
+		err = ptrq_add_tail(&this->include_recorders, recorder);
+	if (err)
+		return err;
+
+	err = scanner_lex_file(this, path, false);
+	recorder = ptrq_remove_tail(&this->include_recorders);
+	if (!err && !recorder->is_invalid) {
+		end = lseek(this->cpp_tokens_fd, 0, SEEK_CUR);
+		if (end >= 0)
+			scanner_store_include(this, path, file_hash, recorder, end);
+	}
+	include_recorder_delete(recorder);
+	return err;
+}
+/*****************************************************************************/
+/*
+ * -include-trace records each inclusion as a complete event of the Chrome
+ * trace-event format, followed by the totals of each header. The trace loads
+ * in chrome://tracing, or in ui.perfetto.dev.
+ */
+static
+void include_trace_header_delete(void *p)
+{
+	struct include_trace_header *this = p;
+	free((void *)this->path);
+	free(this);
+}
+
+static
+uint64_t include_trace_ns()
+{
+	struct timespec ts;
+
+	timespec_get(&ts, TIME_UTC);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static
+err_t scanner_sample_include_trace(const struct scanner *this,
+								   uint64_t *out)
+{
+	off_t pos;
+
+	pos = lseek(this->cpp_tokens_fd, 0, SEEK_CUR);
+	if (pos < 0)
+		return errno;
+	out[INCLUDE_TRACE_NS] = include_trace_ns();
+	out[INCLUDE_TRACE_BYTES_READ] = this->num_bytes_lexed;
+	out[INCLUDE_TRACE_TOKENS_LEXED] = this->num_tokens_lexed;
+	out[INCLUDE_TRACE_TOKENS_EMITTED] = this->num_tokens_emitted;
+	out[INCLUDE_TRACE_BYTES_EMITTED] = pos;
+	return ESUCCESS;
+}
+
+/* path is owned by the caller, and outlives the frame. */
+static
+err_t scanner_begin_include_trace(struct scanner *this,
+								  const char *path)
+{
+	err_t err;
+	struct include_trace_frame frame;
+
+	frame.path = path;
+	memset(frame.children, 0, sizeof(frame.children));
+	err = scanner_sample_include_trace(this, frame.start);
+	if (!err)
+		err = valq_add_tail(&this->include_trace_frames, &frame);
+	return err;
+}
+
+static
+err_t scanner_find_include_trace_header(struct scanner *this,
+										const char *path,
+										struct include_trace_header **out)
+{
+	int i;
+	err_t err;
+	struct include_trace_header *header;
+
+	PTRQ_FOR_EACH(&this->include_trace_headers, i, header) {
+		if (!strcmp(header->path, path)) {
+			*out = header;
+			return ESUCCESS;
+		}
+	}
+	header = calloc(1, sizeof(*header));
+	if (header == NULL)
+		return ENOMEM;
+	header->path = strdup(path);
+	err = header->path ? ptrq_add_tail(&this->include_trace_headers, header) :
+		ENOMEM;
+	if (err) {
+		include_trace_header_delete(header);
+		return err;
+	}
+	*out = header;
+	return ESUCCESS;
+}
+
+static
+err_t scanner_end_include_trace(struct scanner *this)
+{
+	int i;
+	err_t err;
+	uint64_t end[INCLUDE_TRACE_NUM_COUNTERS];
+	struct include_trace_frame frame, *parent;
+	struct include_trace_header *header;
+	struct include_trace_event *event;
+
+	frame = *(struct include_trace_frame *)
+		valq_peek_tail(&this->include_trace_frames);
+	valq_remove_tail(&this->include_trace_frames);
+
+	header = NULL;
+	err = scanner_sample_include_trace(this, end);
+	if (!err)
+		err = scanner_find_include_trace_header(this, frame.path, &header);
+	if (err)
+		return err;
+	event = malloc(sizeof(*event));
+	if (event == NULL)
+		return ENOMEM;
+
+	parent = NULL;
+	if (!valq_is_empty(&this->include_trace_frames))
+		parent = valq_peek_tail(&this->include_trace_frames);
+	event->header = header;
+	event->start = frame.start[INCLUDE_TRACE_NS];
+	for (i = 0; i < INCLUDE_TRACE_NUM_COUNTERS; ++i) {
+		event->inclusive[i] = end[i] - frame.start[i];
+		event->exclusive[i] = event->inclusive[i] - frame.children[i];
+		header->inclusive[i] += event->inclusive[i];
+		header->exclusive[i] += event->exclusive[i];
+		if (parent)
+			parent->children[i] += event->inclusive[i];
+	}
+	++header->num_entries;
+	if (event->inclusive[INCLUDE_TRACE_BYTES_EMITTED] == 0)
+		++header->num_skipped;
+	err = ptrq_add_tail(&this->include_trace_events, event);
+	if (err)
+		free(event);
+	return err;
+}
+
+static
+err_t include_trace_printf(struct pch_writer *this,
+						   const char *format,
+						   ...)
+{
+	int len;
+	err_t err;
+	va_list args;
+
+	va_start(args, format);
+	len = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+	if (len < 0)
+		return EINVAL;
+	err = pch_reserve(this, len + 1);	/* vsnprintf writes the NUL */
+	if (err)
+		return err;
+	va_start(args, format);
+	vsnprintf(this->buffer + this->size, len + 1, format, args);
+	va_end(args);
+	this->size += len;
+	return ESUCCESS;
+}
+
+/* A JSON string; the prefix needs no escaping. */
+static
+err_t include_trace_write_string(struct pch_writer *this,
+								 const char *prefix,
+								 const char *str)
+{
+	err_t err;
+
+	err = include_trace_printf(this, "\"%s", prefix);
+	for (; !err && *str; ++str) {
+		if (*str == '"' || *str == '\\')
+			err = include_trace_printf(this, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			err = include_trace_printf(this, "\\u%04x", *str);
+		else
+			err = pch_write(this, str, 1);
+	}
+	if (!err)
+		err = pch_write(this, "\"", 1);
+	return err;
+}
+
+/* The times are in us, the unit of the trace-event format. */
+static
+err_t include_trace_write_event(struct pch_writer *this,
+								const char *prefix,
+								const char *path,
+								const int tid,
+								const uint64_t start,
+								const uint64_t *inclusive,
+								const uint64_t *exclusive)
+{
+	err_t err;
+
+	err = include_trace_printf(this, "\t{\"name\": ");
+	if (!err)
+		err = include_trace_write_string(this, prefix, path);
+	if (!err)
+		err = include_trace_printf(this, ", \"cat\": \"include\", "
+								   "\"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+								   "\"ts\": %llu.%03llu, "
+								   "\"dur\": %llu.%03llu, \"args\": {"
+								   "\"exclusive_us\": %llu.%03llu, "
+								   "\"bytes_read\": %llu, "
+								   "\"tokens_lexed\": %llu, "
+								   "\"tokens_emitted\": %llu, "
+								   "\"bytes_emitted\": %llu, "
+								   "\"inclusive_bytes_read\": %llu, "
+								   "\"inclusive_tokens_lexed\": %llu, "
+								   "\"inclusive_tokens_emitted\": %llu, "
+								   "\"inclusive_bytes_emitted\": %llu",
+								   tid,
+								   (unsigned long long)start / 1000,
+								   (unsigned long long)start % 1000,
+								   (unsigned long long)
+								   inclusive[INCLUDE_TRACE_NS] / 1000,
+								   (unsigned long long)
+								   inclusive[INCLUDE_TRACE_NS] % 1000,
+								   (unsigned long long)
+								   exclusive[INCLUDE_TRACE_NS] / 1000,
+								   (unsigned long long)
+								   exclusive[INCLUDE_TRACE_NS] % 1000,
+								   (unsigned long long)
+								   exclusive[INCLUDE_TRACE_BYTES_READ],
+								   (unsigned long long)
+								   exclusive[INCLUDE_TRACE_TOKENS_LEXED],
+								   (unsigned long long)
+								   exclusive[INCLUDE_TRACE_TOKENS_EMITTED],
+								   (unsigned long long)
+								   exclusive[INCLUDE_TRACE_BYTES_EMITTED],
+								   (unsigned long long)
+								   inclusive[INCLUDE_TRACE_BYTES_READ],
+								   (unsigned long long)
+								   inclusive[INCLUDE_TRACE_TOKENS_LEXED],
+								   (unsigned long long)
+								   inclusive[INCLUDE_TRACE_TOKENS_EMITTED],
+								   (unsigned long long)
+								   inclusive[INCLUDE_TRACE_BYTES_EMITTED]);
+	return err;
+}
+
+/* Most expensive first. */
+static
+int include_trace_header_compare(const void *a,
+								 const void *b)
+{
+	const struct include_trace_header *header[2];
+
+	header[0] = *(const struct include_trace_header **)a;
+	header[1] = *(const struct include_trace_header **)b;
+	if (header[0]->inclusive[INCLUDE_TRACE_NS] !=
+		header[1]->inclusive[INCLUDE_TRACE_NS])
+		return (header[0]->inclusive[INCLUDE_TRACE_NS] <
+				header[1]->inclusive[INCLUDE_TRACE_NS]) ? 1 : -1;
+	return strcmp(header[0]->path, header[1]->path);
+}
+
+/*
+ * The events are timed from the start of the first inclusion. The totals of
+ * the headers follow, on their own track, each starting at 0.
+ */
+static
+err_t scanner_write_include_trace(const struct scanner *this)
+{
+	int i, fd, num;
+	err_t err;
+	ssize_t ret;
+	uint64_t origin;
+	const char *str;
+	size_t size;
+	struct pch_writer writer;
+	const struct include_trace_event *event;
+	struct include_trace_header *header, **headers;
+
+	memset(&writer, 0, sizeof(writer));
+	num = ptrq_num_entries(&this->include_trace_headers);
+	headers = malloc((num + 1) * sizeof(headers[0]));
+	if (headers == NULL)
+		return ENOMEM;
+	PTRQ_FOR_EACH(&this->include_trace_headers, i, header)
+		headers[i] = header;
+	qsort(headers, num, sizeof(headers[0]), include_trace_header_compare);
+
+	origin = UINT64_MAX;
+	PTRQ_FOR_EACH(&this->include_trace_events, i, event) {
+		if (event->start < origin)
+			origin = event->start;
+	}
+
+	err = include_trace_printf(&writer, "{\"traceEvents\": [\n");
+	PTRQ_FOR_EACH(&this->include_trace_events, i, event) {
+		if (!err)
+			err = include_trace_write_event(&writer, "", event->header->path,
+											1, event->start - origin,
+											event->inclusive,
+											event->exclusive);
+		if (!err)
+			err = include_trace_printf(&writer, ", \"skipped\": %s}},\n",
+									   event->inclusive
+									   [INCLUDE_TRACE_BYTES_EMITTED] ?
+									   "false" : "true");
+	}
+	for (i = 0; !err && i < num; ++i) {
+		header = headers[i];
+		err = include_trace_write_event(&writer, "Total ", header->path, 2, 0,
+										header->inclusive, header->exclusive);
+		if (!err)
+			err = include_trace_printf(&writer, ", \"entered\": %d, "
+									   "\"skipped\": %d}}%s\n",
+									   header->num_entries -
+									   header->num_skipped,
+									   header->num_skipped,
+									   i == num - 1 ? "" : ",");
+	}
+	/* No trailing comma without any totals */
+	if (!err && num == 0 && writer.size >= 2)
+		writer.size -= 2;
+	if (!err)
+		err = include_trace_printf(&writer, "%s]}\n", num ? "" : "\n");
+	if (err)
+		goto err0;
+
+	fd = open(this->include_trace_path, O_WRONLY | O_CREAT | O_TRUNC,
+			  S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		err = errno;
+		goto err0;
+	}
+	str = writer.buffer;
+	size = writer.size;
+	while (size) {
+		ret = write(fd, str, size);
+		if (ret < 0) {
+			err = errno;
+			break;
+		}
+		str += ret;
+		size -= ret;
+	}
+	close(fd);
+err0:
+	free(writer.buffer);
+	free(headers);
+	return err;
+}
+/*****************************************************************************/
+/* -include path */
+err_t scanner_set_prefix_header(struct scanner *this,
+								const char *path)
+{
+	free((void *)this->prefix_header_path);
+	this->prefix_header_path = strdup(path);
+	return this->prefix_header_path ? ESUCCESS : ENOMEM;
+}
+
+/* -include-pch path */
+err_t scanner_set_pch_path(struct scanner *this,
+						   const char *path)
+{
+	free((void *)this->pch_path);
+	this->pch_path = strdup(path);
+	return this->pch_path ? ESUCCESS : ENOMEM;
+}
+
+/* -cache-dir path, -cache-size bytes */
+err_t scanner_set_include_cache(struct scanner *this,
+								const char *dir_path,
+								const off_t size)
+{
+	int ret;
+
+	if (size <= 0)
+		return EINVAL;
+	ret = mkdir(dir_path, S_IRWXU);
+	if (ret < 0 && errno != EEXIST)
+		return errno;
+	free((void *)this->include_cache_dir);
+	this->include_cache_dir = strdup(dir_path);
+	if (this->include_cache_dir == NULL)
+		return ENOMEM;
+	this->include_cache_size = size;
+	return ESUCCESS;
+}
+
+err_t scanner_set_include_trace(struct scanner *this,
+								const char *path)
+{
+	free((void *)this->include_trace_path);
+	this->include_trace_path = strdup(path);
+	if (this->include_trace_path == NULL)
+		return ENOMEM;
+	return ESUCCESS;
+}
+
+err_t scanner_set_macro_profile(struct scanner *this,
+								const char *path)
+{
+	free((void *)this->macro_profile_path);
+	this->macro_profile_path = strdup(path);
+	if (this->macro_profile_path == NULL)
+		return ENOMEM;
+	return ESUCCESS;
+}
+
+/* The counters shared with -include-trace. */
+static
+err_t scanner_note_stats(const struct scanner *this)
+{
+	off_t pos;
+
+	pos = lseek(this->cpp_tokens_fd, 0, SEEK_CUR);
+	if (pos < 0)
+		return errno;
+	g_stats.num_bytes_lexed += this->num_bytes_lexed;
+	g_stats.num_tokens_lexed += this->num_tokens_lexed;
+	g_stats.num_tokens_emitted += this->num_tokens_emitted;
+	g_stats.num_bytes_emitted += pos;
+	return ESUCCESS;
+}
+
+err_t scanner_scan(struct scanner *this,
+				   const char *path)
+{
+	err_t err;
+	char *buffer;
+	enum stats_phase phase;
+
+	err = scanner_write_cpp_tokens_header(this);
+	if (err)
+		return err;
+
+	/* A usable pch replaces everything up to the main file. */
+	err = ENOENT;
+	if (this->pch_path)
+		err = scanner_load_pch(this);
+	if (err == ESUCCESS)
+		goto scan_file;
+	if (err != ENOENT && err != ESTALE)
+		return err;
+	if (this->pch_path && this->prefix_header_path == NULL)
+		return err;	/* Nothing to build it from */
+
+	phase = stats_enter(STATS_PHASE_PREDEFINED_MACROS);
 	err = scanner_scan_predefined_macros(this);
+	stats_leave(phase);
 	this->is_running_predefined_macros = false;
+
+	/*
+	 * The command-line macros are checked for redefinitions. The lexer frees
+	 * its buffer; the lines are kept for the pch.
+	 */
+	if (!err && this->command_line_macros) {
+		buffer = malloc(this->command_line_macros_size + 1);
+		if (buffer == NULL)
+			return ENOMEM;
+		memcpy(buffer, this->command_line_macros,
+			   this->command_line_macros_size + 1);
+		err = scanner_scan_buffer(this, buffer,
+								  this->command_line_macros_size);
+	}
+	if (!err && this->prefix_header_path)
+		err = scanner_scan_prefix_header(this);
+scan_file:
 	if (!err)
 		err = scanner_scan_file(this, path);
+	if (!err)
+		err = scanner_write_cpp_tokens_end(this);
+	if (!err && this->macro_profile_path)
+		err = scanner_write_macro_profile(this);
+	if (!err && this->include_trace_path)
+		err = scanner_write_include_trace(this);
+	if (!err && g_stats.is_enabled)
+		err = scanner_note_stats(this);
 	return err;
 }
@@ -9,10 +9,20 @@
 #include "lexer.h"
 
 #include <inc/types.h>
+#include <inc/list.h>
+#include <inc/stats.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
 
+/*
+ * A cpp_token may be shared, through ref_count, between a macro's
+ * replacement-list, its expansions and the expanded arguments. A shared token
+ * is never modified in place; see cpp_token_make_writable.
+ */
 struct cpp_token {
 	struct lexer_token	*base;
+	int		ref_count;
 	bool	is_marked;
 	bool	has_white_space;
 	bool	is_first;
@@ -99,104 +109,429 @@ bool cpp_token_is_marked(const struct cpp_token *this)
 static
 void cpp_token_delete(void *p);
 /*****************************************************************************/
-struct cpp_tokens {
+/*
+ * cpp_tokens is a list of segments; each segment is a ring of token pointers.
+ * Tokens are added to, and removed from, the head or the tail segment. Moving
+ * a list to the head or to the tail of another list relinks its segments, so
+ * that the cost of a move does not depend on the number of tokens moved.
+ * A segment is freed as soon as it becomes empty; an empty list owns no memory.
+ */
+struct cpp_tokens_segment {
+	struct list_entry	entry;
 	struct ptr_queue	q;
 };
 
+struct cpp_tokens {
+	struct list_entry	segments;
+	int	num_entries;
+};
+
+/*
+ * Lists with at most these many tokens are moved token-by-token, instead of
+ * being linked in, to avoid piling up tiny segments.
+ */
+#define CPP_TOKENS_SEGMENT_MIN	16
+
+/*
+ * A position within a list, kept as the segment and the offset within it, so
+ * that stepping to the next or the previous token does not walk the segments
+ * from the head. The list must not be modified while a cursor is in use.
+ */
+struct cpp_tokens_cursor {
+	const struct list_entry	*head;		/* the segments of the list */
+	const struct list_entry	*segment;	/* == head, once past either end */
+	int	offset;		/* within the segment */
+	int	index;		/* within the list */
+};
+
+/* The cursor is named after ix, so that nested loops do not shadow it. */
 #define CPP_TOKENS_FOR_EACH(cts, ix, e)	\
-	PTRQ_FOR_EACH(&(cts)->q, ix, e)
+	for (struct cpp_tokens_cursor ix##_cursor = cpp_tokens_cursor_first(cts); \
+		 (ix = ix##_cursor.index,	\
+		  e = ix < cpp_tokens_num_entries(cts) ?	\
+		  cpp_tokens_cursor_peek(&ix##_cursor) : NULL);	\
+		 cpp_tokens_cursor_next(&ix##_cursor))
 #define CPP_TOKENS_FOR_EACH_WITH_REMOVE(cts, e)	\
-	PTRQ_FOR_EACH_WITH_REMOVE(&(cts)->q, e)
+	while ((e = cpp_tokens_is_empty(cts) ? NULL : cpp_tokens_remove_head(cts)))
 #define CPP_TOKENS_FOR_EACH_REVERSE(cts, ix, e)	\
-	PTRQ_FOR_EACH_REVERSE(&(cts)->q, ix, e)
+	for (struct cpp_tokens_cursor ix##_cursor = cpp_tokens_cursor_last(cts); \
+		 (ix = ix##_cursor.index,	\
+		  e = ix >= 0 ? cpp_tokens_cursor_peek(&ix##_cursor) : NULL);	\
+		 cpp_tokens_cursor_prev(&ix##_cursor))
 #define CPP_TOKENS_FOR_EACH_WITH_REMOVE_REVERSE(cts, e)	\
-	PTRQ_FOR_EACH_WITH_REMOVE_REVERSE(&(cts)->q, e)
+	while ((e = cpp_tokens_is_empty(cts) ? NULL : cpp_tokens_remove_tail(cts)))
 
 static inline
 void cpp_tokens_init(struct cpp_tokens *this)
 {
-	ptrq_init(&this->q, cpp_token_delete);
+	list_init(&this->segments);
+	this->num_entries = 0;
 }
 
 static inline
 bool cpp_tokens_is_empty(const struct cpp_tokens *this)
 {
-	return ptrq_is_empty(&this->q);
+	return this->num_entries == 0;
 }
 
 static inline
 int cpp_tokens_num_entries(const struct cpp_tokens *this)
 {
-	return ptrq_num_entries(&this->q);
+	return this->num_entries;
+}
+
+static inline
+struct cpp_tokens_segment *cpp_tokens_head_segment(const struct cpp_tokens *this)
+{
+	assert(!list_is_empty(&this->segments));
+	return list_entry(list_peek_head(&this->segments),
+					  struct cpp_tokens_segment, entry);
+}
+
+static inline
+struct cpp_tokens_segment *cpp_tokens_tail_segment(const struct cpp_tokens *this)
+{
+	assert(!list_is_empty(&this->segments));
+	return list_entry(list_peek_tail(&this->segments),
+					  struct cpp_tokens_segment, entry);
+}
+
+static inline
+err_t cpp_tokens_add_segment(struct cpp_tokens *this,
+							 const bool at_head)
+{
+	struct cpp_tokens_segment *segment;
+
+	segment = malloc(sizeof(*segment));
+	if (segment == NULL)
+		return ENOMEM;
+	ptrq_init(&segment->q, NULL);	/* tokens are deleted by cpp_tokens */
+	if (at_head)
+		list_add_head(&this->segments, &segment->entry);
+	else
+		list_add_tail(&this->segments, &segment->entry);
+	return ESUCCESS;
 }
 
+static inline
+void cpp_tokens_free_segment_if_empty(struct cpp_tokens_segment *segment)
+{
+	if (!ptrq_is_empty(&segment->q))
+		return;
+	list_del_entry(&segment->entry);
+	free(segment);
+}
+
+/* Walks the segments; the lists that are indexed into are mostly 1 segment */
 static inline
 struct cpp_token *cpp_tokens_peek_entry(const struct cpp_tokens *this,
 										const int index)
 {
-	return ptrq_peek_entry(&this->q, index);
+	int i, num_entries;
+	const struct list_entry *e;
+	const struct cpp_tokens_segment *segment;
+
+	assert(0 <= index && index < this->num_entries);
+	i = index;
+	list_for_each(&this->segments, e) {
+		segment = list_entry(e, struct cpp_tokens_segment, entry);
+		num_entries = ptrq_num_entries(&segment->q);
+		if (i < num_entries)
+			return ptrq_peek_entry(&segment->q, i);
+		i -= num_entries;
+	}
+	assert(0);
+	return NULL;
+}
+
+static inline
+struct cpp_tokens_cursor cpp_tokens_cursor_first(const struct cpp_tokens *this)
+{
+	struct cpp_tokens_cursor cursor;
+
+	cursor.head = &this->segments;
+	cursor.segment = this->segments.next;
+	cursor.offset = 0;
+	cursor.index = 0;
+	return cursor;
+}
+
+static inline
+struct cpp_tokens_cursor cpp_tokens_cursor_last(const struct cpp_tokens *this)
+{
+	struct cpp_tokens_cursor cursor;
+	const struct cpp_tokens_segment *segment;
+
+	cursor.head = &this->segments;
+	cursor.segment = this->segments.prev;
+	cursor.offset = 0;
+	cursor.index = this->num_entries - 1;
+	if (cursor.segment != cursor.head) {
+		segment = list_entry(cursor.segment, struct cpp_tokens_segment, entry);
+		cursor.offset = ptrq_num_entries(&segment->q) - 1;
+	}
+	return cursor;
+}
+
+/* Returns NULL once the cursor is past either end */
+static inline
+struct cpp_token *cpp_tokens_cursor_peek(const struct cpp_tokens_cursor *this)
+{
+	const struct cpp_tokens_segment *segment;
+
+	if (this->segment == this->head)
+		return NULL;
+	segment = list_entry(this->segment, struct cpp_tokens_segment, entry);
+	return ptrq_peek_entry(&segment->q, this->offset);
+}
+
+/* The segments are never empty. */
+static inline
+void cpp_tokens_cursor_next(struct cpp_tokens_cursor *this)
+{
+	const struct cpp_tokens_segment *segment;
+
+	assert(this->segment != this->head);
+	segment = list_entry(this->segment, struct cpp_tokens_segment, entry);
+	++this->index;
+	if (++this->offset < ptrq_num_entries(&segment->q))
+		return;
+	this->segment = this->segment->next;
+	this->offset = 0;
+}
+
+static inline
+void cpp_tokens_cursor_prev(struct cpp_tokens_cursor *this)
+{
+	const struct cpp_tokens_segment *segment;
+
+	assert(this->segment != this->head);
+	--this->index;
+	if (--this->offset >= 0)
+		return;
+	this->segment = this->segment->prev;
+	this->offset = 0;
+	if (this->segment == this->head)
+		return;
+	segment = list_entry(this->segment, struct cpp_tokens_segment, entry);
+	this->offset = ptrq_num_entries(&segment->q) - 1;
 }
 
 static inline
 struct cpp_token *cpp_tokens_peek_head(const struct cpp_tokens *this)
 {
-	return ptrq_peek_head(&this->q);
+	assert(!cpp_tokens_is_empty(this));
+	return ptrq_peek_head(&cpp_tokens_head_segment(this)->q);
 }
 
 static inline
 struct cpp_token *cpp_tokens_peek_tail(const struct cpp_tokens *this)
 {
-	return ptrq_peek_tail(&this->q);
+	assert(!cpp_tokens_is_empty(this));
+	return ptrq_peek_tail(&cpp_tokens_tail_segment(this)->q);
 }
 
 static inline
 err_t cpp_tokens_add_head(struct cpp_tokens *this,
 						  struct cpp_token *token)
 {
-	return ptrq_add_head(&this->q, token);
+	err_t err;
+	struct cpp_tokens_segment *segment;
+
+	if (cpp_tokens_is_empty(this)) {
+		err = cpp_tokens_add_segment(this, true);
+		if (err)
+			return err;
+	}
+	segment = cpp_tokens_head_segment(this);
+	err = ptrq_add_head(&segment->q, token);
+	if (err) {
+		cpp_tokens_free_segment_if_empty(segment);
+		return err;
+	}
+	++this->num_entries;
+	return ESUCCESS;
 }
 
 static inline
 err_t cpp_tokens_add_tail(struct cpp_tokens *this,
 						  struct cpp_token *token)
 {
-	return ptrq_add_tail(&this->q, token);
+	err_t err;
+	struct cpp_tokens_segment *segment;
+
+	if (cpp_tokens_is_empty(this)) {
+		err = cpp_tokens_add_segment(this, false);
+		if (err)
+			return err;
+	}
+	segment = cpp_tokens_tail_segment(this);
+	err = ptrq_add_tail(&segment->q, token);
+	if (err) {
+		cpp_tokens_free_segment_if_empty(segment);
+		return err;
+	}
+	++this->num_entries;
+	return ESUCCESS;
 }
 
 static inline
 struct cpp_token *cpp_tokens_remove_head(struct cpp_tokens *this)
 {
-	return ptrq_remove_head(&this->q);
+	struct cpp_token *token;
+	struct cpp_tokens_segment *segment;
+
+	assert(!cpp_tokens_is_empty(this));
+	segment = cpp_tokens_head_segment(this);
+	token = ptrq_remove_head(&segment->q);
+	cpp_tokens_free_segment_if_empty(segment);
+	--this->num_entries;
+	return token;
 }
 
 static inline
 struct cpp_token *cpp_tokens_remove_tail(struct cpp_tokens *this)
 {
-	return ptrq_remove_tail(&this->q);
+	struct cpp_token *token;
+	struct cpp_tokens_segment *segment;
+
+	assert(!cpp_tokens_is_empty(this));
+	segment = cpp_tokens_tail_segment(this);
+	token = ptrq_remove_tail(&segment->q);
+	cpp_tokens_free_segment_if_empty(segment);
+	--this->num_entries;
+	return token;
 }
 
 static inline
 void cpp_tokens_delete_head(struct cpp_tokens *this)
 {
-	ptrq_delete_head(&this->q);
+	cpp_token_delete(cpp_tokens_remove_head(this));
 }
 
+/* Moves all the tokens of this to the tail of to. */
 static inline
 err_t cpp_tokens_move(struct cpp_tokens *this,
 					  struct cpp_tokens *to)
 {
-	return ptrq_move(&this->q, &to->q);
+	err_t err;
+
+	if (!cpp_tokens_is_empty(to) &&
+		cpp_tokens_num_entries(this) <= CPP_TOKENS_SEGMENT_MIN) {
+		/* A token is removed only once added; a failure loses none */
+		while (!cpp_tokens_is_empty(this)) {
+			err = cpp_tokens_add_tail(to, cpp_tokens_peek_head(this));
+			if (err)
+				return err;
+			cpp_tokens_remove_head(this);
+		}
+		return ESUCCESS;
+	}
+	list_splice_tail(&this->segments, &to->segments);
+	to->num_entries += this->num_entries;
+	this->num_entries = 0;
+	return ESUCCESS;
+}
+
+/* Moves all the tokens of this to the head of to, keeping their order. */
+static inline
+err_t cpp_tokens_move_to_head(struct cpp_tokens *this,
+							  struct cpp_tokens *to)
+{
+	err_t err;
+
+	if (!cpp_tokens_is_empty(to) &&
+		cpp_tokens_num_entries(this) <= CPP_TOKENS_SEGMENT_MIN) {
+		while (!cpp_tokens_is_empty(this)) {
+			err = cpp_tokens_add_head(to, cpp_tokens_peek_tail(this));
+			if (err)
+				return err;
+			cpp_tokens_remove_tail(this);
+		}
+		return ESUCCESS;
+	}
+	list_splice_head(&this->segments, &to->segments);
+	to->num_entries += this->num_entries;
+	this->num_entries = 0;
+	return ESUCCESS;
 }
 
 static inline
 void cpp_tokens_empty(struct cpp_tokens *this)
+{
+	while (!cpp_tokens_is_empty(this))
+		cpp_tokens_delete_head(this);
+}
+/*****************************************************************************/
+/*
+ * The lexer tokens of an included file, in order, recorded the first time the
+ * file is scanned. Lexing does not depend on the macro state, so a later
+ * inclusion of the same file (same dev/ino) replays these tokens instead of
+ * reading and lexing the file again. Each token in the array holds a ref.
+ * The spacing flags are within the lexer tokens. The size and mtime validate
+ * the files kept across scanners by the compile server.
+ */
+struct lexed_file {
+	dev_t	dev;
+	ino_t	ino;
+	off_t	size;
+	time_t	mtime;
+	const char	*path;		/* as opened */
+	const char	*dir_path;	/* for #include "..." */
+	struct lexer_token	**tokens;
+	int		num_tokens;
+	int		num_tokens_allocated;
+	bool	is_complete;	/* recorded until EOF; may be replayed */
+};
+
+static
+void lexed_file_delete(void *p);
+
+struct lexed_files {
+	struct ptr_queue	q;
+};
+
+#define LEXED_FILES_FOR_EACH(fs, ix, e)	PTRQ_FOR_EACH(&((fs)->q), ix, e)
+
+static inline
+void lexed_files_init(struct lexed_files *this)
+{
+	ptrq_init(&this->q, lexed_file_delete);
+}
+
+static inline
+void lexed_files_empty(struct lexed_files *this)
 {
 	ptrq_empty(&this->q);
 }
+
+static inline
+err_t lexed_files_add_tail(struct lexed_files *this,
+						   struct lexed_file *file)
+{
+	return ptrq_add_tail(&this->q, file);
+}
+
+/*
+ * The files lexed ahead of time by the compile server, from absolute paths.
+ * A scanner reads them, but does not add to them; a forked child cannot
+ * share its own files with the server.
+ */
+struct scanner_cache {
+	struct lexed_files	lexed_files;
+};
 /*****************************************************************************/
+/*
+ * The tokens come from the queue, and then from either the lexer or the
+ * replay of a lexed_file. When both the lexer and the file are set, the
+ * tokens that the lexer returns are recorded into the file.
+ */
 struct cpp_token_stream {
 	struct lexer		*lexer;
+	struct lexed_file	*file;
+	int					file_pos;	/* next token to replay */
 	struct cpp_tokens	tokens;
+	size_t				num_lexed;
 };
 
 static inline
@@ -204,7 +539,18 @@ void cpp_token_stream_init(struct cpp_token_stream *this,
 						   struct lexer *lexer)
 {
 	this->lexer = lexer;
+	this->file = NULL;
+	this->file_pos = 0;
 	cpp_tokens_init(&this->tokens);
+	this->num_lexed = 0;
+}
+
+static inline
+void cpp_token_stream_set_file(struct cpp_token_stream *this,
+							   struct lexed_file *file)
+{
+	this->file = file;
+	this->file_pos = 0;
 }
 
 static inline
@@ -226,6 +572,14 @@ err_t cpp_token_stream_add_head(struct cpp_token_stream *this,
 {
 	return cpp_tokens_add_head(&this->tokens, token);
 }
+
+/* Places tokens, in order, at the front of the stream. */
+static inline
+err_t cpp_token_stream_move_to_head(struct cpp_token_stream *this,
+									struct cpp_tokens *tokens)
+{
+	return cpp_tokens_move_to_head(tokens, &this->tokens);
+}
 /*****************************************************************************/
 struct macro {
 	struct cpp_token	*identifier;
@@ -233,6 +587,8 @@ struct macro {
 	struct cpp_tokens	replacement_list;
 	bool	is_function_like;
 	bool	is_variadic;
+	uint64_t	generation;	/* see struct if_result */
+	struct macro_profile	*profile;	/* with -macro-profile */
 };
 
 static
@@ -428,84 +784,271 @@ static const struct rpn_operator_precedence g_rpn_operator_precedence[] = {
 	{LXR_TOKEN_COLON,	12},
 };
 
-enum rpn_stack_entry_type
-{
-	RPN_STACK_ENTRY_OPERATOR,
-	RPN_STACK_ENTRY_SIGNED,
-	RPN_STACK_ENTRY_UNSIGNED,
-};
-
-static inline
-int rpn_operator_precedence(const enum lexer_token_type operator)
-{
-	int i;
-
-	for (i = 0; i < (int)ARRAY_SIZE(g_rpn_operator_precedence); ++i) {
-		if (g_rpn_operator_precedence[i].operator == operator)
-			return g_rpn_operator_precedence[i].precedence;
-	}
-	assert(0);
-	return -1;
-}
+/*
+ * #if expressions are evaluated directly over the expanded tokens, with an
+ * operand stack and an operator stack. Both start out on the C stack, inside
+ * the expr_stack; they move to the heap only if an expression nests deeper
+ * than EXPR_STACK_SIZE.
+ */
+#define EXPR_STACK_SIZE	32
 
-struct rpn_stack_entry {
-	enum rpn_stack_entry_type	type;
+struct expr_stack_entry {
 	union {
-		enum lexer_token_type		operator;
+		enum lexer_token_type	operator;
 		uintmax_t	value;	/* the std says these nums are [u]intmax_t */
 	} u;
+	bool	is_signed;	/* operand */
+	bool	is_dead;	/* operator; its right operand is not evaluated */
+	int		precedence;	/* operator */
 };
 
-struct rpn_stack {
-	struct val_queue	q;
+struct expr_stack {
+	struct expr_stack_entry	*entries;
+	int	num_entries;
+	int	num_allocated;
+	struct expr_stack_entry	buffer[EXPR_STACK_SIZE];
 };
 
-#define RPN_STACK_FOR_EACH_WITH_REMOVE_REVERSE(stk, e)	\
-	VALQ_FOR_EACH_WITH_REMOVE_REVERSE(&(stk)->q, e)
+static inline
+void expr_stack_init(struct expr_stack *this)
+{
+	this->entries = this->buffer;
+	this->num_entries = 0;
+	this->num_allocated = EXPR_STACK_SIZE;
+}
 
 static inline
-void rpn_stack_init(struct rpn_stack *this)
+void expr_stack_empty(struct expr_stack *this)
 {
-	valq_init(&this->q, sizeof(struct rpn_stack_entry), NULL);
+	if (this->entries != this->buffer)
+		free(this->entries);
+	expr_stack_init(this);
 }
 
 static inline
-bool rpn_stack_is_empty(const struct rpn_stack *this)
+bool expr_stack_is_empty(const struct expr_stack *this)
 {
-	return valq_is_empty(&this->q);
+	return this->num_entries == 0;
 }
 
 static inline
-err_t rpn_stack_push(struct rpn_stack *this,
-					 const struct rpn_stack_entry *entry)
+int expr_stack_num_entries(const struct expr_stack *this)
 {
-	return valq_add_tail(&this->q, entry);
+	return this->num_entries;
 }
 
 static inline
-struct rpn_stack_entry rpn_stack_peek(const struct rpn_stack *this)
+err_t expr_stack_push(struct expr_stack *this,
+					  const struct expr_stack_entry *entry)
 {
-	struct rpn_stack_entry entry;
-	entry = *(struct rpn_stack_entry *)valq_peek_tail(&this->q);
-	return entry;
+	int num_allocated;
+	struct expr_stack_entry *entries;
+
+	if (this->num_entries == this->num_allocated) {
+		num_allocated = this->num_allocated << 1;
+		if (this->entries == this->buffer) {
+			entries = malloc(num_allocated * sizeof(*entries));
+			if (entries)
+				memcpy(entries, this->buffer, sizeof(this->buffer));
+		} else {
+			entries = realloc(this->entries, num_allocated * sizeof(*entries));
+		}
+		if (entries == NULL)
+			return ENOMEM;
+		this->entries = entries;
+		this->num_allocated = num_allocated;
+	}
+	this->entries[this->num_entries++] = *entry;
+	return ESUCCESS;
 }
 
+/* index 0 is the top */
 static inline
-struct rpn_stack_entry rpn_stack_pop(struct rpn_stack *this)
+struct expr_stack_entry *expr_stack_peek(const struct expr_stack *this,
+										 const int index)
 {
-	struct rpn_stack_entry entry = rpn_stack_peek(this);
-	valq_remove_tail(&this->q);
-	return entry;
+	assert(index < this->num_entries);
+	return &this->entries[this->num_entries - 1 - index];
+}
+
+static inline
+struct expr_stack_entry expr_stack_pop(struct expr_stack *this)
+{
+	assert(!expr_stack_is_empty(this));
+	return this->entries[--this->num_entries];
 }
 /*****************************************************************************/
+/*
+ * A file that contributed to a precompiled header. The header is stale if the
+ * size of any such file changes, or if its mtime changes and its contents
+ * no longer hash the same.
+ */
+struct pch_dep {
+	const char	*path;
+	off_t		size;
+	time_t		mtime;
+	uint64_t	hash;
+};
+/*****************************************************************************/
+/*
+ * A memoized lookup of a header-name, shared by #include, #embed and the
+ * __has_include/__has_embed probes. A "..." name depends on the directory
+ * of the includer. The start is the index of the first include path to search;
+ * it is non-zero for __has_include_next.
+ */
+struct include_lookup {
+	const char	*name;		/* "..." with its delimiters, or the <...> name */
+	const char	*dir_path;	/* for "..."; NULL for <...> */
+	int			start;
+	const char	*path;		/* NULL if not found */
+};
+/*****************************************************************************/
+/*
+ * A memoized #if/#elif condition. The key is the unexpanded tokens of the
+ * condition. The value holds as long as each macro looked up while evaluating
+ * it still has the same generation; a generation of 0 is an undefined macro.
+ */
+struct if_dep {
+	const char	*name;
+	uint64_t	generation;
+};
+
+struct if_result {
+	uint64_t	hash;		/* of the key */
+	char		*key;		/* the token sources, each followed by a NUL */
+	size_t		key_size;
+	struct ptr_queue	deps;
+	uint64_t	generation;	/* macros_generation, when last found valid */
+	uintmax_t	value;
+	bool		is_invalid;	/* failed to record a dep */
+};
+
+#define IF_RESULTS_MAX	1024
+/*****************************************************************************/
+/*
+ * The counters kept by -macro-profile. They are per name, so that the
+ * redefinitions of a macro add up. The cycles of an expansion include those of
+ * its argument pre-expansion and its rescan, but not those of the nested
+ * expansions, which are in total_cycles.
+ */
+struct macro_profile {
+	const char	*name;
+	uint64_t	num_expansions;
+	uint64_t	num_tokens;		/* in the replacements, before the rescan */
+	uint64_t	num_arg_tokens;	/* in the pre-expanded arguments */
+	uint64_t	arg_cycles;
+	uint64_t	cycles;
+	uint64_t	total_cycles;
+};
+/*****************************************************************************/
+/*
+ * -include-trace. The counters are sampled when an inclusion begins and ends;
+ * the differences are its inclusive amounts. The exclusive amounts leave out
+ * the inclusive amounts of the nested inclusions.
+ */
+enum include_trace_counter {
+	INCLUDE_TRACE_NS,
+	INCLUDE_TRACE_BYTES_READ,
+	INCLUDE_TRACE_TOKENS_LEXED,
+	INCLUDE_TRACE_TOKENS_EMITTED,
+	INCLUDE_TRACE_BYTES_EMITTED,
+	INCLUDE_TRACE_NUM_COUNTERS,
+};
+
+struct include_trace_frame {
+	const char	*path;
+	uint64_t	start[INCLUDE_TRACE_NUM_COUNTERS];
+	uint64_t	children[INCLUDE_TRACE_NUM_COUNTERS];
+};
+
+/* The totals of a header, over all its inclusions. */
+struct include_trace_header {
+	const char	*path;
+	uint64_t	inclusive[INCLUDE_TRACE_NUM_COUNTERS];
+	uint64_t	exclusive[INCLUDE_TRACE_NUM_COUNTERS];
+	int			num_entries;
+	int			num_skipped;	/* emitted nothing, e.g. due to a guard */
+};
+
+struct include_trace_event {
+	const struct include_trace_header	*header;
+	uint64_t	start;	/* ns */
+	uint64_t	inclusive[INCLUDE_TRACE_NUM_COUNTERS];
+	uint64_t	exclusive[INCLUDE_TRACE_NUM_COUNTERS];
+};
+/*****************************************************************************/
+/*
+ * The spellings defined in the file of cpp-tokens since the last reset, in an
+ * open-addressed hash table. The table is reset wherever a range of the file
+ * begins to be recorded for the include cache or the pch, so that a recorded
+ * range never refers to a spelling defined before it. It is also reset after
+ * a recorded range is replayed, since the scanner did not see those bytes.
+ */
+struct token_spelling {
+	uint64_t	hash;
+	size_t		offset;	/* into chars */
+	size_t		len;
+	off_t		pos;	/* of the definition; 0 for an empty slot */
+};
+
+struct token_spellings {
+	struct token_spelling	*entries;
+	size_t	num_entries;
+	size_t	num_entries_allocated;	/* a power of 2 */
+	char	*chars;
+	size_t	chars_size;
+	size_t	chars_allocated;
+	off_t	position;	/* the size of the file */
+};
+/*****************************************************************************/
 struct scanner {
 	struct macros	macros;
 	struct cond_incl_stack	cistk;
 
 	const char	*include_paths[4];
-	const char	*predefined_macros_path;
+	struct ptr_queue	include_lookups;
 	const char	*cpp_tokens_path;
 	int			cpp_tokens_fd;
+	struct token_spellings	token_spellings;
+
+	struct lexed_files	lexed_files;
+	const struct scanner_cache	*cache;	/* NULL outside the server */
+
+	/* #define/#undef lines built from -D/-U */
+	char	*command_line_macros;
+	size_t	command_line_macros_size;
+
+	/* -include, -include-pch */
+	const char	*prefix_header_path;
+	const char	*pch_path;
+	struct ptr_queue	pch_deps;	/* recorded while scanning the prefix */
+	bool	is_recording_pch_deps;
+
+	/* -cache-dir, -cache-size */
+	const char	*include_cache_dir;
+	off_t		include_cache_size;
+	struct ptr_queue	include_recorders;	/* innermost at the tail */
+
+	struct ptr_queue	if_results;
+	struct if_result	*if_recorder;	/* while evaluating a condition */
+	uint64_t	macros_generation;	/* bumped on each #define/#undef */
+	size_t		num_if_hits;
+	size_t		num_if_misses;
+
+	/* -macro-profile */
+	const char	*macro_profile_path;
+	struct ptr_queue	macro_profiles;
+	uint64_t	macro_profile_nested_cycles;
+
+	/* -include-trace */
+	const char	*include_trace_path;
+	struct val_queue	include_trace_frames;
+	struct ptr_queue	include_trace_headers;
+	struct ptr_queue	include_trace_events;
+
+	size_t	num_bytes_lexed;
+	size_t	num_tokens_lexed;
+	size_t	num_tokens_emitted;
 
 	int	include_path_lens[4];
 	bool	is_running_predefined_macros;
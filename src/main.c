@@ -5,28 +5,188 @@
 #include <inc/cpp/scanner.h>
 #include <inc/cc/parser.h>
 #include <inc/types.h>
+#include <inc/stats.h>
+#include <inc/server.h>
 
 #include <assert.h>
 #include <stdio.h>
 #include <locale.h>
+#include <stdlib.h>
+
+#define DEFAULT_CACHE_SIZE	64	/* MiB */
 /*****************************************************************************/
-int main(int argc, char **argv)
+static
+void usage(const char *prog)
+{
+	printf("Usage: %s [-Dname[=value]] [-Uname] [-include path.to.hdr.h]\n"
+		   "\t[-include-pch path.to.pch] [-cache-dir path.to.dir]\n"
+		   "\t[-cache-size MiB] [-macro-profile path.to.report|-]\n"
+		   "\t[-include-trace path.to.trace.json] [-stats path.to.report|-]\n"
+		   "\t[-skip-function-bodies]\n"
+		   "\t[-dump-ast|-dump-ast-compact path.to.ast|-] path.to.src.c\n"
+		   "       %s -server path.to.socket\n"
+		   "       %s -client path.to.socket [args as above]\n",
+		   prog, prog, prog);
+}
+
+/*
+ * -D and -U are passed to the scanner in the order given. -include names the
+ * prefix header, and -include-pch the pch built from it. -cache-dir enables the
+ * cache of #include results, bounded by -cache-size. -macro-profile writes
+ * the per-macro expansion costs; as JSON if the path ends in .json.
+ * -include-trace writes the costs of the include tree as a Chrome trace.
+ * -stats writes the time spent in each phase, the peak rss, and the counts of
+ * allocations and tokens; as JSON if the path ends in .json.
+ * -skip-function-bodies has the parser skip the bodies of the functions, for
+ * when only the declarations matter. -dump-ast writes the ast, one node per
+ * line, and -dump-ast-compact writes it on a single line; to stdout if the
+ * path is "-".
+ */
+static
+err_t parse_args(struct scanner *scanner,
+				 int argc,
+				 char **argv,
+				 const char **out_src_path,
+				 const char **out_stats_path,
+				 bool *out_skip_function_bodies,
+				 const char **out_ast_path,
+				 bool *out_is_ast_compact)
 {
+	int i;
 	err_t err;
-	const char *path;
-	struct scanner *scanner;
-	struct parser *parser;
+	char option, *end;
+	long cache_size;
+	const char *arg, *src_path, *cache_dir, *stats_path;
 
-	if (argc != 2) {
-		printf("Usage: %s path.to.src.c\n", argv[0]);
+	src_path = cache_dir = stats_path = NULL;
+	cache_size = DEFAULT_CACHE_SIZE;
+	for (i = 1; i < argc; ++i) {
+		arg = argv[i];
+		if (!strcmp(arg, "-include") || !strcmp(arg, "-include-pch")) {
+			if (++i == argc)
+				return EINVAL;
+			if (!strcmp(arg, "-include"))
+				err = scanner_set_prefix_header(scanner, argv[i]);
+			else
+				err = scanner_set_pch_path(scanner, argv[i]);
+			if (err)
+				return err;
+			continue;
+		}
+		if (!strcmp(arg, "-macro-profile") || !strcmp(arg, "-include-trace")) {
+			if (++i == argc)
+				return EINVAL;
+			if (!strcmp(arg, "-macro-profile"))
+				err = scanner_set_macro_profile(scanner, argv[i]);
+			else
+				err = scanner_set_include_trace(scanner, argv[i]);
+			if (err)
+				return err;
+			continue;
+		}
+		if (!strcmp(arg, "-skip-function-bodies")) {
+			*out_skip_function_bodies = true;
+			continue;
+		}
+		if (!strcmp(arg, "-dump-ast") || !strcmp(arg, "-dump-ast-compact")) {
+			if (++i == argc)
+				return EINVAL;
+			*out_ast_path = argv[i];
+			*out_is_ast_compact = !strcmp(arg, "-dump-ast-compact");
+			continue;
+		}
+		if (!strcmp(arg, "-stats")) {
+			if (++i == argc)
+				return EINVAL;
+			stats_path = argv[i];
+			continue;
+		}
+		if (!strcmp(arg, "-cache-dir") || !strcmp(arg, "-cache-size")) {
+			if (++i == argc)
+				return EINVAL;
+			if (!strcmp(arg, "-cache-dir")) {
+				cache_dir = argv[i];
+				continue;
+			}
+			cache_size = strtol(argv[i], &end, 10);
+			if (*end != NULL_CHAR || cache_size <= 0)
+				return EINVAL;
+			continue;
+		}
+		if (arg[0] != '-' || (arg[1] != 'D' && arg[1] != 'U')) {
+			if (src_path)
+				return EINVAL;
+			src_path = arg;
+			continue;
+		}
+
+		/* Either -Dname or -D name */
+		option = arg[1];
+		arg += 2;
+		if (arg[0] == NULL_CHAR) {
+			if (++i == argc)
+				return EINVAL;
+			arg = argv[i];
+		}
+		if (option == 'D')
+			err = scanner_define(scanner, arg);
+		else
+			err = scanner_undefine(scanner, arg);
+		if (err)
+			return err;
+	}
+	if (src_path == NULL)
 		return EINVAL;
+	if (cache_dir) {
+		err = scanner_set_include_cache(scanner, cache_dir,
+										(off_t)cache_size << 20);
+		if (err)
+			return err;
 	}
+	*out_src_path = src_path;
+	*out_stats_path = stats_path;
+	return ESUCCESS;
+}
 
-	setlocale(LC_ALL, "en_US.utf8");
+/*
+ * In a child of the compile server, the scanner also reads the files cached by
+ * the server, and reports the files it lexed itself to report_fd. Otherwise,
+ * cache is NULL, and report_fd is -1.
+ */
+static
+err_t compile(int argc,
+			  char **argv,
+			  const struct scanner_cache *cache,
+			  const int report_fd)
+{
+	err_t err, stats_err;
+	bool skip_function_bodies, is_ast_compact;
+	enum stats_phase phase;
+	const char *path, *src_path, *stats_path, *ast_path;
+	struct scanner *scanner;
+	struct parser *parser;
+
+	parser = NULL;
+	stats_path = ast_path = NULL;
+	skip_function_bodies = is_ast_compact = false;
 	err = scanner_new(&scanner);
 	if (err)
-		goto err0;
-	err = scanner_scan(scanner, argv[1]);
+		return err;
+	if (cache)
+		scanner_set_cache(scanner, cache);
+	err = parse_args(scanner, argc, argv, &src_path, &stats_path,
+					 &skip_function_bodies, &ast_path, &is_ast_compact);
+	if (err) {
+		usage(argv[0]);
+		goto err1;
+	}
+	if (stats_path)
+		stats_enable();
+	stats_begin_stage(STATS_STAGE_SCAN);
+	err = scanner_scan(scanner, src_path);
+	stats_end_stage(STATS_STAGE_SCAN);
+	if (!err && report_fd >= 0)
+		err = scanner_write_lexed_paths(scanner, report_fd);
 	if (err)
 		goto err1;
 	path = scanner_cpp_tokens_path(scanner);	/* path owned by scanner */
@@ -38,18 +198,69 @@ int main(int argc, char **argv)
 	}
 	scanner_delete(scanner);
 	scanner = NULL;
+	stats_begin_stage(STATS_STAGE_PARSE);
 	err = parser_new(path, &parser);	/* path owned by parser */
 	if (err)
-		goto err1;
+		goto err2;
+	parser_set_skip_function_bodies(parser, skip_function_bodies);
+	phase = stats_enter(STATS_PHASE_PARSE);
 	err = parser_parse(parser);
+	stats_leave(phase);
+	if (!err && ast_path) {
+		phase = stats_enter(STATS_PHASE_DUMP_AST);
+		err = parser_dump_ast(parser, ast_path, is_ast_compact);
+		stats_leave(phase);
+	}
 	goto err2;
 err2:
 	if (parser)
 		parser_delete(parser);
+	stats_end_stage(STATS_STAGE_PARSE);
+	if (stats_path) {
+		/* Reported even if the parser failed */
+		stats_err = stats_write(stats_path);
+		if (!err)
+			err = stats_err;
+	}
 err1:
 	if (scanner)
 		scanner_delete(scanner);
-err0:
+	return err;
+}
+
+/*
+ * -server runs the compile server on the unix socket; it keeps the lexed
+ * headers warm across requests. -client forwards the rest of the args, its
+ * cwd, stdin, stdout and stderr to the server, and exits with the status of
+ * the compile.
+ */
+int main(int argc, char **argv)
+{
+	int status;
+	err_t err;
+	const char *socket_path;
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return EINVAL;
+	}
+
+	if (!strcmp(argv[1], "-client") && argc > 3) {
+		socket_path = argv[2];
+		argv[2] = argv[0];	/* The program name, for the server */
+		err = client_run(socket_path, argc - 2, argv + 2, &status);
+		if (err) {
+			fprintf(stderr, "%s: %s: error %d\n", argv[0], socket_path, err);
+			return err;
+		}
+		return status;
+	}
+
+	setlocale(LC_ALL, "en_US.utf8");
+	if (!strcmp(argv[1], "-server") && argc == 3)
+		err = server_run(argv[2], compile);
+	else
+		err = compile(argc, argv, NULL, -1);
 	setlocale(LC_ALL, "C");
 	return err;
 }
@@ -0,0 +1,515 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2023 Amol Surati */
+/* vim: set noet ts=4 sts=4 sw=4: */
+
+#include <inc/server.h>
+#include <inc/types.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <linux/limits.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/*
+ * A request is a header, with the client's stdin, stdout and stderr attached,
+ * followed by the payload: the working directory and then the arguments, each
+ * nul terminated. The reply is the exit status of the compile. Each request
+ * is received and compiled in a child forked from the server, so that the
+ * child starts with the files already lexed; a failing compile, or a client
+ * slow to send, cannot hold up the server. The child reports its working
+ * directory, and then the files it read. Once the child exits, the server
+ * lexes those files, for the next requests.
+ */
+#define SERVER_NUM_FDS	3
+
+struct server_header {
+	uint32_t	payload_size;
+};
+
+struct server_request {
+	int		conn;		/* to the client */
+	int		report_fd;	/* from the child */
+	pid_t	pid;
+	char	*paths;		/* reported by the child; nul terminated */
+	size_t	paths_size;
+	size_t	num_allocated;
+};
+
+static
+void server_request_delete(void *p)
+{
+	struct server_request *this = p;
+
+	if (this->conn >= 0)
+		close(this->conn);
+	if (this->report_fd >= 0)
+		close(this->report_fd);
+	free(this->paths);
+	free(this);
+}
+
+static
+err_t server_read_all(const int fd,
+					  void *buffer,
+					  size_t size)
+{
+	ssize_t ret;
+	char *p = buffer;
+
+	while (size) {
+		ret = read(fd, p, size);
+		if (ret < 0)
+			return errno;
+		if (ret == 0)
+			return EPIPE;
+		p += ret;
+		size -= ret;
+	}
+	return ESUCCESS;
+}
+
+static
+err_t server_write_all(const int fd,
+					   const void *buffer,
+					   size_t size)
+{
+	ssize_t ret;
+	const char *p = buffer;
+
+	while (size) {
+		ret = write(fd, p, size);
+		if (ret < 0)
+			return errno;
+		p += ret;
+		size -= ret;
+	}
+	return ESUCCESS;
+}
+static
+void server_close_fds(const void *fds,
+					  const int num_fds)
+{
+	int i, fd;
+
+	for (i = 0; i < num_fds; ++i) {
+		memcpy(&fd, (const char *)fds + i * sizeof(fd), sizeof(fd));
+		close(fd);
+	}
+}
+/*****************************************************************************/
+/*
+ * fds receives the client's stdin, stdout and stderr. On an error, any fds
+ * that did arrive are closed.
+ */
+static
+err_t server_receive(const int conn,
+					 int *fds,
+					 char **out_payload,
+					 size_t *out_size)
+{
+	int num_fds;
+	err_t err;
+	bool has_fds;
+	ssize_t ret;
+	char *payload;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct server_header header;
+	char control[CMSG_SPACE(SERVER_NUM_FDS * sizeof(int))];
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &header;
+	iov.iov_len = sizeof(header);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ret = recvmsg(conn, &msg, 0);
+	if (ret < 0)
+		return errno;
+	err = ESUCCESS;
+	if (ret != sizeof(header) || header.payload_size == 0 ||
+		(msg.msg_flags & MSG_CTRUNC))
+		err = EINVAL;
+
+	/* Exactly one set of fds is expected */
+	has_fds = false;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (!err && !has_fds && num_fds == SERVER_NUM_FDS) {
+			memcpy(fds, CMSG_DATA(cmsg), SERVER_NUM_FDS * sizeof(int));
+			has_fds = true;
+			continue;
+		}
+		server_close_fds(CMSG_DATA(cmsg), num_fds);
+	}
+	if (!err && !has_fds)
+		err = EINVAL;
+	if (err) {
+		if (has_fds)
+			server_close_fds(fds, SERVER_NUM_FDS);
+		return err;
+	}
+
+	err = ENOMEM;
+	payload = malloc(header.payload_size);
+	if (payload)
+		err = server_read_all(conn, payload, header.payload_size);
+	/* The payload must end with the nul of the last argument */
+	if (!err && payload[header.payload_size - 1] != NULL_CHAR)
+		err = EINVAL;
+	if (err) {
+		free(payload);
+		server_close_fds(fds, SERVER_NUM_FDS);
+		return err;
+	}
+	*out_payload = payload;
+	*out_size = header.payload_size;
+	return ESUCCESS;
+}
+
+/*
+ * Does not return. The child leaves through _exit, as the memory it shares
+ * with the server is not its own to free. The reply is left to the server.
+ */
+static
+void server_run_child(struct ptr_queue *requests,
+					  const int listen_fd,
+					  const int conn,
+					  const int report_fd,
+					  const struct scanner_cache *cache,
+					  fn_server_compile *compile)
+{
+	int i, argc, fds[SERVER_NUM_FDS];
+	err_t err;
+	char **argv, *payload;
+	const char *p;
+	size_t size;
+
+	/* Only the client's fds, and the report */
+	close(listen_fd);
+	ptrq_empty(requests);
+	payload = NULL;
+	size = 0;
+	err = server_receive(conn, fds, &payload, &size);
+	close(conn);
+	if (!err)
+		err = server_write_all(report_fd, payload, strlen(payload) + 1);
+	if (err)
+		_exit(err);
+	for (i = 0; i < SERVER_NUM_FDS; ++i) {
+		if (dup2(fds[i], i) < 0)
+			_exit(errno);
+		close(fds[i]);
+	}
+
+	argc = 0;
+	for (p = payload; p < payload + size; p += strlen(p) + 1)
+		++argc;
+	--argc;	/* The cwd */
+	argv = calloc(argc + 1, sizeof(argv[0]));
+	if (argv == NULL)
+		_exit(ENOMEM);
+	p = payload + strlen(payload) + 1;
+	for (i = 0; i < argc; ++i, p += strlen(p) + 1)
+		argv[i] = (char *)p;
+
+	err = chdir(payload) < 0 ? errno : ESUCCESS;
+	if (!err)
+		err = compile(argc, argv, cache, report_fd);
+	fflush(NULL);
+	_exit(err);
+}
+
+static
+err_t server_accept(struct ptr_queue *requests,
+					const int listen_fd,
+					struct scanner_cache *cache,
+					fn_server_compile *compile)
+{
+	int pipe_fds[2];
+	err_t err;
+	struct server_request *request;
+
+	request = calloc(1, sizeof(*request));
+	if (request == NULL)
+		return ENOMEM;
+	request->report_fd = -1;
+	request->conn = accept(listen_fd, NULL, NULL);
+	if (request->conn < 0) {
+		err = errno;
+		goto err0;
+	}
+
+	if (pipe(pipe_fds) < 0) {
+		err = errno;
+		goto err0;
+	}
+
+	scanner_cache_prune(cache);
+	fflush(NULL);
+	request->pid = fork();
+	if (request->pid == 0) {
+		close(pipe_fds[0]);
+		server_run_child(requests, listen_fd, request->conn, pipe_fds[1],
+						 cache, compile);
+	}
+	close(pipe_fds[1]);
+	request->report_fd = pipe_fds[0];
+	err = request->pid < 0 ? errno : ESUCCESS;
+	if (!err)
+		err = ptrq_add_tail(requests, request);
+err0:
+	if (err)
+		server_request_delete(request);
+	return err;
+}
+
+/*
+ * The child exited. Reply to the client, and lex the reported files. A file
+ * that cannot be lexed is left for the child of a later request.
+ */
+static
+void server_complete(struct server_request *this,
+					 struct scanner_cache *cache)
+{
+	int status;
+	int32_t reply;
+	char *path;
+	const char *p, *cwd;
+
+	reply = EINVAL;
+	if (waitpid(this->pid, &status, 0) == this->pid) {
+		if (WIFEXITED(status))
+			reply = WEXITSTATUS(status);
+		else if (WIFSIGNALED(status))
+			reply = 128 + WTERMSIG(status);
+	}
+	server_write_all(this->conn, &reply, sizeof(reply));
+	close(this->conn);
+	this->conn = -1;
+
+	/* Ignore a path cut short by the death of the child */
+	while (this->paths_size && this->paths[this->paths_size - 1] != NULL_CHAR)
+		--this->paths_size;
+	if (this->paths_size == 0)
+		return;
+
+	/* The first is the cwd of the child */
+	cwd = this->paths;
+	for (p = cwd + strlen(cwd) + 1; p < this->paths + this->paths_size;
+		 p += strlen(p) + 1) {
+		if (p[0] == '/') {
+			scanner_cache_add_file(cache, p);
+			continue;
+		}
+		path = malloc(strlen(cwd) + strlen(p) + 2);
+		if (path == NULL)
+			break;
+		sprintf(path, "%s/%s", cwd, p);
+		scanner_cache_add_file(cache, path);
+		free(path);
+	}
+}
+
+/* Returns EOF once the child exits, and its end is closed. */
+static
+err_t server_read_report(struct server_request *this)
+{
+	size_t num;
+	ssize_t ret;
+	char *paths;
+
+	if (this->paths_size == this->num_allocated) {
+		num = this->num_allocated ? 2 * this->num_allocated : 4096;
+		paths = realloc(this->paths, num);
+		if (paths == NULL)
+			return ENOMEM;
+		this->paths = paths;
+		this->num_allocated = num;
+	}
+	ret = read(this->report_fd, this->paths + this->paths_size,
+			   this->num_allocated - this->paths_size);
+	if (ret < 0)
+		return errno;
+	if (ret == 0)
+		return EOF;
+	this->paths_size += ret;
+	return ESUCCESS;
+}
+
+/*
+ * The requests are served concurrently; the server only waits in poll. It
+ * runs until killed.
+ */
+err_t server_run(const char *socket_path,
+				 fn_server_compile *compile)
+{
+	int i, fd, num;
+	err_t err;
+	struct pollfd *fds;
+	struct sockaddr_un addr;
+	struct ptr_queue requests;
+	struct scanner_cache *cache;
+	struct server_request *request;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+		return ENAMETOOLONG;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	signal(SIGPIPE, SIG_IGN);	/* A client may go away */
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return errno;
+	unlink(socket_path);
+	if (bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(fd, 64) < 0) {
+		err = errno;
+		goto err0;
+	}
+	err = scanner_cache_new(&cache);
+	if (err)
+		goto err0;
+	ptrq_init(&requests, server_request_delete);
+
+	fds = NULL;
+	while (true) {
+		num = ptrq_num_entries(&requests);
+		free(fds);
+		fds = malloc((num + 1) * sizeof(fds[0]));
+		if (fds == NULL) {
+			err = ENOMEM;
+			break;
+		}
+		fds[0].fd = fd;
+		fds[0].events = POLLIN;
+		PTRQ_FOR_EACH(&requests, i, request) {
+			fds[i + 1].fd = request->report_fd;
+			fds[i + 1].events = POLLIN;
+		}
+		if (poll(fds, num + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			err = errno;
+			break;
+		}
+
+		/* Backwards, as completed requests are removed */
+		for (i = num - 1; i >= 0; --i) {
+			if (fds[i + 1].revents == 0)
+				continue;
+			request = ptrq_peek_entry(&requests, i);
+			err = server_read_report(request);
+			if (err == ESUCCESS)
+				continue;
+			server_complete(request, cache);	/* EOF, or a failed read */
+			ptrq_remove_entry(&requests, i);
+			server_request_delete(request);
+		}
+		if (fds[0].revents & POLLIN) {
+			err = server_accept(&requests, fd, cache, compile);
+			if (err)
+				fprintf(stderr, "%s: request failed with %d\n", __func__, err);
+		}
+	}
+	free(fds);
+	ptrq_empty(&requests);
+	scanner_cache_delete(cache);
+err0:
+	close(fd);
+	unlink(socket_path);
+	return err;
+}
+/*****************************************************************************/
+/* argv[0] stands for the program name, as for main. */
+err_t client_run(const char *socket_path,
+				 int argc,
+				 char **argv,
+				 int *out_status)
+{
+	int i, fd;
+	err_t err;
+	int32_t reply;
+	char *payload, *p;
+	size_t size;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct sockaddr_un addr;
+	struct server_header header;
+	char cwd[PATH_MAX];
+	int fds[SERVER_NUM_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+	char control[CMSG_SPACE(SERVER_NUM_FDS * sizeof(int))];
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+		return ENAMETOOLONG;
+	if (getcwd(cwd, sizeof(cwd)) == NULL)
+		return errno;
+	size = strlen(cwd) + 1;
+	for (i = 0; i < argc; ++i)
+		size += strlen(argv[i]) + 1;
+	payload = malloc(size);
+	if (payload == NULL)
+		return ENOMEM;
+	p = payload;
+	strcpy(p, cwd);
+	p += strlen(p) + 1;
+	for (i = 0; i < argc; ++i) {
+		strcpy(p, argv[i]);
+		p += strlen(p) + 1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		err = errno;
+		goto err0;
+	}
+	if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		err = errno;
+		goto err1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	header.payload_size = size;
+	iov.iov_base = &header;
+	iov.iov_len = sizeof(header);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	err = ESUCCESS;
+	if (sendmsg(fd, &msg, 0) != (ssize_t)sizeof(header))
+		err = EPIPE;
+	if (!err)
+		err = server_write_all(fd, payload, size);
+	if (!err)
+		err = server_read_all(fd, &reply, sizeof(reply));
+	if (!err)
+		*out_status = reply;
+err1:
+	close(fd);
+err0:
+	free(payload);
+	return err;
+}
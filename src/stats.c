@@ -0,0 +1,182 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/* Copyright (c) 2023 Amol Surati */
+/* vim: set noet ts=4 sts=4 sw=4: */
+
+/* For clock_gettime; C11 has no monotonic clock. */
+#define _POSIX_C_SOURCE 199309L
+
+#include <inc/stats.h>
+#include <inc/types.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+struct stats g_stats;
+
+static const char *g_stats_phase_str[] = {
+	"other",
+	"predefined_macros",
+	"lex",
+	"directive",
+	"expand",
+	"serialize",
+	"read_tokens",
+	"parse",
+	"dump_ast",
+};
+
+static const char *g_stats_subsystem_str[] = {
+	"lexer",
+	"scanner",
+	"parser",
+};
+
+static const char *g_stats_stage_str[] = {
+	"scan",
+	"parse",
+};
+/*****************************************************************************/
+uint64_t stats_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void stats_enable()
+{
+	g_stats.is_enabled = true;
+	g_stats.phase = STATS_PHASE_OTHER;
+	g_stats.stamp = stats_ns();
+}
+
+void stats_begin_stage(const enum stats_stage stage)
+{
+	(void)stage;
+	if (g_stats.is_enabled)
+		g_stats.cpu_start = clock();
+}
+
+void stats_end_stage(const enum stats_stage stage)
+{
+	if (g_stats.is_enabled)
+		g_stats.cpu[stage] += clock() - g_stats.cpu_start;
+}
+
+static
+err_t stats_printf(const int fd,
+				   const char *format,
+				   ...)
+{
+	int len;
+	va_list args;
+	char line[256];
+
+	va_start(args, format);
+	len = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if (len < 0)
+		return EINVAL;
+	if (len >= (int)sizeof(line))
+		len = sizeof(line) - 1;
+	if (write(fd, line, len) < 0)
+		return errno;
+	return ESUCCESS;
+}
+
+/*
+ * The times are in us. As with -macro-profile, the report is JSON if the path
+ * ends in .json, and goes to stderr if the path is "-".
+ */
+err_t stats_write(const char *path)
+{
+	int i, fd, len;
+	err_t err;
+	bool is_json;
+	const char *format, *sep;
+	struct rusage usage;
+	unsigned long long value;
+
+	stats_enter(STATS_PHASE_OTHER);	/* Charge the time of the last phase */
+	if (getrusage(RUSAGE_SELF, &usage) < 0)
+		return errno;
+
+	len = strlen(path);
+	is_json = len >= 5 && !strcmp(path + len - 5, ".json");
+	fd = STDERR_FILENO;
+	if (strcmp(path, "-")) {
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		if (fd < 0)
+			return errno;
+	}
+
+	err = stats_printf(fd, is_json ? "{\n\t\"wall_us\": {" : "%-20s %14s\n",
+					   "phase", "wall-us");
+	format = is_json ? "%s\"%s\": %llu" : "%-20s %14llu\n";
+	for (i = 0; !err && i < STATS_PHASE_NUM_PHASES; ++i) {
+		sep = i ? ", " : "";
+		value = g_stats.wall_ns[i] / 1000;
+		err = is_json ? stats_printf(fd, format, sep, g_stats_phase_str[i],
+									 value) :
+			stats_printf(fd, format, g_stats_phase_str[i], value);
+	}
+
+	if (!err)
+		err = stats_printf(fd, is_json ? "},\n\t\"cpu_us\": {" :
+						   "\n%-20s %14s\n", "stage", "cpu-us");
+	for (i = 0; !err && i < STATS_STAGE_NUM_STAGES; ++i) {
+		sep = i ? ", " : "";
+		value = (unsigned long long)g_stats.cpu[i] * 1000000 / CLOCKS_PER_SEC;
+		err = is_json ? stats_printf(fd, format, sep, g_stats_stage_str[i],
+									 value) :
+			stats_printf(fd, format, g_stats_stage_str[i], value);
+	}
+
+	if (!err)
+		err = stats_printf(fd, is_json ? "},\n\t\"allocs\": {" :
+						   "\n%-20s %14s %14s\n", "subsystem", "allocs",
+						   "bytes");
+	for (i = 0; !err && i < STATS_SUBSYSTEM_NUM_SUBSYSTEMS; ++i) {
+		if (is_json)
+			err = stats_printf(fd, "%s\"%s\": {\"count\": %llu, "
+							   "\"bytes\": %llu}", i ? ", " : "",
+							   g_stats_subsystem_str[i],
+							   (unsigned long long)g_stats.num_allocs[i],
+							   (unsigned long long)g_stats.num_alloc_bytes[i]);
+		else
+			err = stats_printf(fd, "%-20s %14llu %14llu\n",
+							   g_stats_subsystem_str[i],
+							   (unsigned long long)g_stats.num_allocs[i],
+							   (unsigned long long)g_stats.num_alloc_bytes[i]);
+	}
+
+	/* ru_maxrss is in KiB on linux */
+	format = "\n%-20s %14llu\n%-20s %14llu\n%-20s %14llu\n%-20s %14llu\n"
+		"%-20s %14llu\n%-20s %14llu\n";
+	if (is_json)
+		format = "},\n\t\"%s\": %llu, \"%s\": %llu, \"%s\": %llu, "
+			"\"%s\": %llu,\n\t\"%s\": %llu, \"%s\": %llu\n}\n";
+	if (!err)
+		err = stats_printf(fd, format,
+						   "peak_rss_kib", (unsigned long long)usage.ru_maxrss,
+						   "bytes_lexed",
+						   (unsigned long long)g_stats.num_bytes_lexed,
+						   "tokens_lexed",
+						   (unsigned long long)g_stats.num_tokens_lexed,
+						   "tokens_emitted",
+						   (unsigned long long)g_stats.num_tokens_emitted,
+						   "bytes_emitted",
+						   (unsigned long long)g_stats.num_bytes_emitted,
+						   "tokens_read",
+						   (unsigned long long)g_stats.num_tokens_read);
+	if (fd != STDERR_FILENO)
+		close(fd);
+	return err;
+}